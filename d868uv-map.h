@@ -321,7 +321,7 @@
 { 0x025c0000, 0x880 },              // 075c40 - Unknown data, status message
 { 0x025c0b00, 0x40 },               // 0764c0 - Unknown data
 { 0x02600000, 0x9c40 },             // 076500 - Unknown data, bitmap
-{ 0x02640000, 0x500 },              // 080140 - Bitmap of contacts
+{ 0x02640000, 0x500, 0x080140 },    // 080140 - Bitmap of contacts
 { 0x02680000, 0xf4240 },            // 080640 - Contacts 1-10000
 { 0x02900000, 0x80 },               // 174880 - Unknown index
 { 0x02900100, 0x80 },               // 174900 - Unknown index
@@ -30,7 +30,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/stat.h>
+#include <pthread.h>
 #include "radio.h"
 #include "util.h"
 
@@ -114,6 +114,15 @@ static fragment_t region_map[] = {
 #include "d868uv-map.h"
 };
 
+//
+// Contiguous range of live data, transferred as a whole.
+//
+typedef struct {
+    unsigned address;       // Address in radio memory
+    unsigned offset;        // Offset in the image file
+    unsigned length;        // Number of bytes
+} transfer_t;
+
 //
 // Channel data.
 //
@@ -443,9 +452,10 @@ static void d868uv_print_version(radio_device_t *radio, FILE *out)
 
 //
 // Return true when the specified region has to be skipped.
-// Skip unused channels, contacts, zones and scanlists.
+// Skip unused channels, contacts, zones and scanlists,
+// according to bitmaps of the given memory image.
 //
-static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsigned nbytes)
+static int skip_region(const uint8_t *image, unsigned addr, unsigned file_offset, uint8_t *mem, unsigned nbytes)
 {
     int index;
 
@@ -453,7 +463,7 @@ static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsign
     if (addr >= 0x00800000 && addr < 0x01000000) {
         index = (file_offset - OFFSET_BANK1) / 64;
         if (index < NCHAN) {
-            uint8_t *bitmap = &radio_mem[OFFSET_CHAN_MAP];
+            const uint8_t *bitmap = &image[OFFSET_CHAN_MAP];
 
             if ((bitmap[index / 8] >> (index & 7)) & 1) {
                 // Channel is valid, don't skip.
@@ -472,7 +482,7 @@ static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsign
     if (addr >= 0x02680000 && addr < 0x02900000) {
         index = (file_offset - OFFSET_CONTACTS) / 100;
         if (index < NCONTACTS) {
-            uint8_t *cmap = GET_CONTACT_MAP();
+            const uint8_t *cmap = &image[OFFSET_CONTACT_MAP];
 
             if ((cmap[index / 8] >> (index & 7)) & 1) {
                 // Invalid contact: skip it, erase data.
@@ -491,7 +501,7 @@ static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsign
     if (addr >= 0x01000000 && addr < 0x01080000) {
         index = (file_offset - OFFSET_ZONELISTS) / 512;
         if (index < NZONES) {
-            uint8_t *zmap = GET_ZONEMAP();
+            const uint8_t *zmap = &image[OFFSET_ZONE_MAP];
 
             if ((zmap[index / 8] >> (index & 7)) & 1) {
                 // Zone is valid, don't skip.
@@ -510,7 +520,7 @@ static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsign
     if (addr >= 0x01080000 && addr < 0x01640000) {
         index = (file_offset - OFFSET_SCANLISTS) / 192;
         if (index < NSCANL) {
-            uint8_t *slmap = GET_SCANL_MAP();
+            const uint8_t *slmap = &image[OFFSET_SCANL_MAP];
 
             if ((slmap[index / 8] >> (index & 7)) & 1) {
                 // Scanlist is valid, don't skip.
@@ -528,46 +538,60 @@ static int skip_region(unsigned addr, unsigned file_offset, uint8_t *mem, unsign
 }
 
 //
-// Read memory image from the device.
+// Build a list of contiguous ranges of live data.
+// Adjacent 64-byte blocks are merged into one range.
+// For download, bitmap fragments are excluded (they are read in advance),
+// and skipped data are erased.
+// When the original image is given, only blocks which differ from it,
+// or were not live in it, are included.
+// Return the number of ranges; the list is allocated by malloc().
 //
-static void d868uv_download(radio_device_t *radio)
+static int build_plan(transfer_t **result, int download_flag, const uint8_t *orig)
 {
+    transfer_t *plan, *t = 0;
     fragment_t *f;
+    unsigned file_offset = 0;
+    int nranges = 0;
 
-    // Read bitmaps first.
-    for (f=region_map; f->length; f++) {
-        if (f->offset != 0) {
-            serial_read_region(f->address, &radio_mem[f->offset], f->length);
-        }
+    plan = malloc(MEMSZ / 64 * sizeof(transfer_t));
+    if (!plan) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
     }
-
-    // Read other regions sequentially.
-    unsigned file_offset = 0;
-    unsigned bytes_transferred = 0;
-    unsigned last_printed = 0;
-    //printf("Address     Offset\n");
     for (f=region_map; f->length; f++) {
         unsigned addr = f->address;
         unsigned nbytes = f->length;
 
-        //printf("%08x    %06x\n", addr, file_offset);
+        if (download_flag && f->offset != 0) {
+            // Bitmap is already read.
+            file_offset += nbytes;
+            continue;
+        }
         while (nbytes > 0) {
             unsigned n = (nbytes > 64) ? 64 : nbytes;
 
-            if (! skip_region(addr, file_offset, &radio_mem[file_offset], n)) {
-                if (f->offset == 0)
-                    serial_read_region(addr, &radio_mem[file_offset], n);
-                bytes_transferred += n;
+            if (skip_region(radio_mem, addr, file_offset,
+                    download_flag ? &radio_mem[file_offset] : 0, n)) {
+                // Unused data.
+            } else if (orig && ! skip_region(orig, addr, file_offset, 0, 0) &&
+                memcmp(&radio_mem[file_offset], &orig[file_offset], n) == 0) {
+                // Not changed.
+            } else {
+                if (t && t->address + t->length == addr &&
+                    t->offset + t->length == file_offset) {
+                    // Extend the current range.
+                    t->length += n;
+                } else {
+                    // Start a new range.
+                    t = &plan[nranges++];
+                    t->address = addr;
+                    t->offset = file_offset;
+                    t->length = n;
+                }
             }
             file_offset += n;
             addr += n;
             nbytes -= n;
-
-            if (bytes_transferred / (32*1024) != last_printed) {
-                fprintf(stderr, "#");
-                fflush(stderr);
-                last_printed = bytes_transferred / (32*1024);
-            }
         }
     }
     if (file_offset != MEMSZ) {
@@ -575,42 +599,61 @@ static void d868uv_download(radio_device_t *radio)
         fprintf(stderr, "Should be %u; check d868uv-map.h!\n", file_offset);
         exit(-1);
     }
+    *result = plan;
+    return nranges;
 }
 
 //
-// Get contact by index.
+// Print the transfer plan.
+// With verbose flag, list all ranges.
 //
-static contact_t *get_contact(int i)
+static void print_plan(transfer_t *plan, int nranges, int verbose)
 {
-    uint8_t *cmap = GET_CONTACT_MAP();
-
-    if ((cmap[i / 8] >> (i & 7)) & 1)
-        return 0;
+    unsigned nbytes = 0, nrequests = 0;
+    int i;
 
-    return GET_CONTACT(i);
+    for (i=0; i<nranges; i++) {
+        if (verbose)
+            fprintf(stderr, "%08x-%08x  offset %06x\n", plan[i].address,
+                plan[i].address + plan[i].length - 1, plan[i].offset);
+        nbytes += plan[i].length;
+        nrequests += (plan[i].length + 63) / 64;
+    }
+    fprintf(stderr, "Transfer plan: %d ranges, %u bytes, %u requests of 64 bytes.\n",
+        nranges, nbytes, nrequests);
 }
 
 //
-// Write memory image to the device.
+// Read or write all ranges of the plan.
+// Print a progress mark for every 32 kbytes.
+// On write, every chunk of up to 32 kbytes is a step of the upload journal.
 //
-static void d868uv_upload(radio_device_t *radio, int cont_flag)
+static void execute_plan(transfer_t *plan, int nranges, int write_flag)
 {
-    fragment_t *f;
-    unsigned file_offset = 0;
     unsigned bytes_transferred = 0;
     unsigned last_printed = 0;
+    int i, step = 0;
 
-    for (f=region_map; f->length; f++) {
-        unsigned addr = f->address;
-        unsigned nbytes = f->length;
+    if (trace_flag)
+        print_plan(plan, nranges, trace_flag > 1);
+    for (i=0; i<nranges; i++) {
+        unsigned addr = plan[i].address;
+        unsigned file_offset = plan[i].offset;
+        unsigned nbytes = plan[i].length;
 
         while (nbytes > 0) {
-            unsigned n = (nbytes > 64) ? 64 : nbytes;
+            unsigned n = (nbytes > 32*1024) ? 32*1024 : nbytes;
 
-            if (! skip_region(addr, file_offset, 0, 0)) {
-                serial_write_region(addr, &radio_mem[file_offset], n);
-                bytes_transferred += n;
-            }
+            if (write_flag) {
+                if (radio_journal_pending(step)) {
+                    serial_write_region(addr, &radio_mem[file_offset], n);
+                    radio_journal_commit(step);
+                }
+                step++;
+            } else
+                serial_read_region(addr, &radio_mem[file_offset], n);
+
+            bytes_transferred += n;
             file_offset += n;
             addr += n;
             nbytes -= n;
@@ -622,20 +665,103 @@ static void d868uv_upload(radio_device_t *radio, int cont_flag)
             }
         }
     }
-    if (file_offset != MEMSZ) {
-        fprintf(stderr, "\nWrong MEMSZ=%u for D868UV!\n", MEMSZ);
-        fprintf(stderr, "Should be %u; check d868uv-map.h!\n", file_offset);
-        exit(-1);
+}
+
+//
+// Read memory image from the device.
+//
+static void d868uv_download(radio_device_t *radio)
+{
+    fragment_t *f;
+    transfer_t *plan;
+    int nranges;
+
+    // Read bitmaps first.
+    for (f=region_map; f->length; f++) {
+        if (f->offset != 0) {
+            serial_read_region(f->address, &radio_mem[f->offset], f->length);
+        }
+    }
+
+    // Read other regions.
+    nranges = build_plan(&plan, 1, 0);
+    execute_plan(plan, nranges, 0);
+    free(plan);
+}
+
+//
+// Get contact by index.
+//
+static contact_t *get_contact(int i)
+{
+    uint8_t *cmap = GET_CONTACT_MAP();
+
+    if ((cmap[i / 8] >> (i & 7)) & 1)
+        return 0;
+
+    return GET_CONTACT(i);
+}
+
+//
+// Sorting callback for the map of contact IDs.
+// Entries with the same ID are ordered by contact index.
+//
+static int compare_contact_map(const void *ap, const void *bp)
+{
+    uint64_t a = *(uint64_t*) ap;
+    uint64_t b = *(uint64_t*) bp;
+
+    if ((uint32_t) a < (uint32_t) b)
+        return -1;
+    if ((uint32_t) a > (uint32_t) b)
+        return 1;
+    if (a < b)
+        return -1;
+    if (a > b)
+        return 1;
+    return 0;
+}
+
+//
+// Return true when contacts differ from the original image.
+//
+static int contacts_changed()
+{
+    return memcmp(&radio_mem[OFFSET_CONTACT_MAP], &radio_orig[OFFSET_CONTACT_MAP],
+                  OFFSET_CONTACTS - OFFSET_CONTACT_MAP + NCONTACTS*100) != 0;
+}
+
+//
+// Write memory image to the device.
+//
+static void d868uv_upload(radio_device_t *radio, int cont_flag)
+{
+    transfer_t *plan;
+    int nranges;
+
+    // When the image was just read from the radio,
+    // write only the changed blocks.
+    nranges = build_plan(&plan, 0, cont_flag ? radio_orig : 0);
+    execute_plan(plan, nranges, 1);
+    free(plan);
+
+    if (cont_flag && ! contacts_changed()) {
+        // No need to rebuild the map of contact IDs.
+        return;
     }
 
     //
     // Build and upload a map of IDs to contacts.
     // The map has to be sorted by ID.
+    // The list is terminated by 0xff bytes, up to 64-byte boundary.
     //
-    uint64_t map[8*NCONTACTS + 72];
+    uint64_t *map = malloc((NCONTACTS + 9) * sizeof(uint64_t));
     int index, ncontacts = 0;
 
-    memset(map, 0xff, sizeof(map));
+    if (!map) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
     for (index=0; index<NCONTACTS; index++) {
         contact_t *ct = get_contact(index);
         if (!ct)
@@ -651,30 +777,40 @@ static void d868uv_upload(radio_device_t *radio, int cont_flag)
             item |= 1;
         item |= (uint64_t) index << 32;
 
-        int k;
-        for (k=0; k<NCONTACTS; k++) {
-            if (map[k] == item) {
-                // The item is already in the list.
-                break;
-            }
-            if (map[k] == 0xffffffffffffffff) {
-                // Append to the end of the list.
-                map[k] = item;
-                ncontacts = k + 1;
-                break;
-            }
-            if ((uint32_t)map[k] > (uint32_t)item) {
-                // Insert item there and shift the rest.
-                uint64_t prev = map[k];
-                map[k] = item;
-                item = prev;
-            }
-        }
+        map[ncontacts++] = item;
     }
+    qsort(map, ncontacts, sizeof(map[0]), compare_contact_map);
+
+    int nbytes = (ncontacts*8 + 8 + 63) / 64 * 64;
+    memset(&map[ncontacts], 0xff, nbytes - ncontacts*8);
     //printf("\n");
     //print_hex((uint8_t*)map, ncontacts*8 + 8);
     //printf("\n");
-    serial_write_region(ADDR_CONT_ID_LIST, (uint8_t*)map, (ncontacts*8 + 8 + 63) / 64 * 64);
+    serial_write_region(ADDR_CONT_ID_LIST, (uint8_t*)map, nbytes);
+    free(map);
+}
+
+//
+// Print the ranges which d868uv_upload() would write.
+//
+static void d868uv_print_plan(radio_device_t *radio, int cont_flag)
+{
+    transfer_t *plan;
+    int nranges, index, ncontacts = 0;
+
+    nranges = build_plan(&plan, 0, cont_flag ? radio_orig : 0);
+    print_plan(plan, nranges, 1);
+    free(plan);
+
+    if (cont_flag && ! contacts_changed())
+        return;
+
+    for (index=0; index<NCONTACTS; index++) {
+        if (get_contact(index))
+            ncontacts++;
+    }
+    fprintf(stderr, "%08x-%08x  map of %d contact IDs\n", ADDR_CONT_ID_LIST,
+        ADDR_CONT_ID_LIST + (ncontacts*8 + 8 + 63) / 64 * 64 - 1, ncontacts);
 }
 
 //
@@ -1435,26 +1571,16 @@ static void d868uv_print_config(radio_device_t *radio, FILE *out, int verbose)
 
 //
 // Read memory image from the binary file.
+// File contents are already loaded into radio_mem.
 //
-static void d868uv_read_image(radio_device_t *radio, FILE *img)
+static void d868uv_read_image(radio_device_t *radio, unsigned size)
 {
-    struct stat st;
-
-    // Guess device type by file size.
-    if (fstat(fileno(img), &st) < 0) {
-        fprintf(stderr, "Cannot get file size.\n");
-        exit(-1);
-    }
-    switch (st.st_size) {
+    switch (size) {
     case MEMSZ:
         // IMG file.
-        if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
         break;
     default:
-        fprintf(stderr, "Unrecognized file size %u bytes.\n", (int) st.st_size);
+        fprintf(stderr, "Unrecognized file size %u bytes.\n", size);
         exit(-1);
     }
 }
@@ -1770,7 +1896,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         }
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
         erase_zones();
@@ -1781,7 +1907,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, rxonly, admit, colorcode, timeslot,
         grouplist, contact, 0, 0, BW_12_5_KHZ);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -1946,7 +2072,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
     }
@@ -1955,7 +2081,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, rxonly, admit, 0, 1,
         0, 0, rxtone, txtone, width);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -2803,22 +2929,57 @@ static int compare_callsign_map(const void *ap, const void *bp)
 //     The data are stored in 100000-byte chunks with 256kbyte step:
 //      04500000-0451869f, 04540000-0455869f, ... 05340000-0535869f and so on.
 //
-static void d868uv_write_csv(radio_device_t *radio, FILE *csv)
+//
+// Write a chunk of callsign database to the radio.
+//
+//#define DUMP_NO_WRITE
+static void write_calldb_chunk(unsigned addr, void *data, unsigned nbytes, int progress_flag)
 {
-    callsign_map_t map[NCALLSIGNS];
-    callsign_sizes_t sz = {0};
+#ifdef DUMP_NO_WRITE
+    // Dump the data, for debugging purposes.
+    print_hex_addr_data(addr, (uint8_t*) data, nbytes);
+#else
+    serial_write_region(addr, (uint8_t*) data, nbytes);
+#endif
+    if (progress_flag) {
+        fprintf(stderr, "#");
+        fflush(stderr);
+    }
+}
+
+//
+// State of the callsign database parser.
+//
+typedef struct {
+    FILE            *csv;       // Input file
+    chunk_queue_t   *queue;     // Data chunks ready for writing
+    callsign_map_t  *map;       // Map of DMR IDs to data offsets
+    callsign_sizes_t sz;        // Count of records and last address
+    unsigned        nbytes;     // Total size of data
+    int             status;     // 0 on success, -1 on error, 1 for dump
+} calldb_parser_t;
 
-    // Allocate data.
-    char *data = malloc(CALLSIGN_SIZE);
+//
+// Parse CSV file in a separate thread.
+// Data are passed to the writer in 100000-byte chunks as soon
+// as they are complete. Each chunk buffer has space for one more
+// record and final padding.
+//
+static void *parse_calldb(void *arg)
+{
+    calldb_parser_t *ps = arg;
+    unsigned nbuffered = 0;     // Bytes in the current chunk
+    unsigned addr = ADDR_CALLDB_DATA;
+    char *radioid, *callsign, *name, *city, *state, *country, *remarks;
+    char *data;
+
+    data = malloc(100000 + 256);
     if (!data) {
         fprintf(stderr, "Out of memory!\n");
-        return;
+        ps->status = -1;
+        goto failed;
     }
-    memset(data, 0, CALLSIGN_SIZE);
-    memset(map, 0xff, sizeof(map));
 
-    //
-    // Parse CSV file.
     //
     // The file has the following format:
     // Radio ID,Callsign,Name,City,State,Country,Remarks
@@ -2827,14 +2988,7 @@ static void d868uv_write_csv(radio_device_t *radio, FILE *csv)
     // Need to rearrange the fields like:
     // Radio ID, Name, City, Callsign, State, Country, Remarks
     //
-    unsigned nbytes = 0;
-    char *radioid, *callsign, *name, *city, *state, *country, *remarks;
-
-    if (csv_init(csv) < 0) {
-        free(data);
-        return;
-    }
-    while (csv_read(csv, &radioid, &callsign, &name, &city, &state, &country, &remarks)) {
+    while (csv_read(ps->csv, &radioid, &callsign, &name, &city, &state, &country, &remarks)) {
         radioid  = trim_spaces(radioid,  16);
         callsign = trim_spaces(callsign, 16);
         name     = trim_spaces(name,     16);
@@ -2849,34 +3003,34 @@ static void d868uv_write_csv(radio_device_t *radio, FILE *csv)
             fprintf(stderr, "Bad id: %d\n", id);
             fprintf(stderr, "Line: '%s,%s,%s,%s,%s,%s,%s'\n",
                 radioid, callsign, name, city, state, country, remarks);
-            return;
+            ps->status = -1;
+            goto failed;
         }
 
         // Eastern egg: when file contains id 1 with callsign 'dump',
         // read the callsign database from the radio
         // and save to a file.
         if (id == 1 && strcmp(callsign, "dump") == 0) {
-            free(data);
-            dump_csv(radio);
-            return;
+            ps->status = 1;
+            goto failed;
         }
 
         // Add map record.
-        if (sz.count >= NCALLSIGNS) {
+        if (ps->sz.count >= NCALLSIGNS) {
             fprintf(stderr, "WARNING: Too many callsigns!\n");
             fprintf(stderr, "Skipping the rest.\n");
             break;
         }
-        callsign_map_t *m = &map[sz.count];
-        sz.count++;
+        callsign_map_t *m = &ps->map[ps->sz.count];
+        ps->sz.count++;
         m->id = ((id / 10     % 10) << 5)  |  (id            % 10) << 1 |
                 ((id / 1000   % 10) << 13) | ((id / 100)     % 10) << 9 |
                 ((id / 100000 % 10) << 21) | ((id / 10000)   % 10) << 17 |
                 ((id / 10000000)    << 29) | ((id / 1000000) % 10) << 25;
-        m->offset = nbytes;
+        m->offset = ps->nbytes;
 
         // Fill data.
-        char *p = &data[nbytes];
+        char *p = &data[nbuffered];
 
         // Radio ID.
         *p++ = 0;
@@ -2894,86 +3048,146 @@ static void d868uv_write_csv(radio_device_t *radio, FILE *csv)
         strcpy(p, country);  p += strlen(p) + 1;
         strcpy(p, remarks);  p += strlen(p) + 1;
 
-        nbytes = p - data;
-    }
-    fprintf(stderr, "Total %d contacts, %d bytes.\n", sz.count, nbytes);
+        ps->nbytes += (p - data) - nbuffered;
+        nbuffered = p - data;
 
-    sz.last = ADDR_CALLDB_DATA + (nbytes / 100000) * 256*1024 + (nbytes % 100000);
+        if (nbuffered >= 100000) {
+            // Chunk is complete: pass it to the writer, keep the rest.
+            char *next = malloc(100000 + 256);
+            if (!next) {
+                fprintf(stderr, "Out of memory!\n");
+                ps->status = -1;
+                goto failed;
+            }
+            nbuffered -= 100000;
+            memcpy(next, &data[100000], nbuffered);
+            queue_put(ps->queue, addr, (uint8_t*) data, 100000);
+            addr += 256*1024;
+            data = next;
+        }
+    }
+    ps->sz.last = ADDR_CALLDB_DATA + (ps->nbytes / 100000) * 256*1024 + (ps->nbytes % 100000);
 
     // Append extra zeroes and align.
-    nbytes = (nbytes + 63) & ~15;
+    unsigned nalign = ((ps->nbytes + 63) & ~15) - ps->nbytes;
+    memset(&data[nbuffered], 0, nalign);
+    nbuffered += nalign;
+
+    // Pass the rest of data.
+    if (nbuffered > 100000) {
+        char *next = malloc(nbuffered - 100000);
+        if (!next) {
+            fprintf(stderr, "Out of memory!\n");
+            ps->status = -1;
+            goto failed;
+        }
+        nbuffered -= 100000;
+        memcpy(next, &data[100000], nbuffered);
+        queue_put(ps->queue, addr, (uint8_t*) data, 100000);
+        addr += 256*1024;
+        data = next;
+    }
+    queue_put(ps->queue, addr, (uint8_t*) data, nbuffered);
+    queue_close(ps->queue);
+    return 0;
+
+failed:
+    free(data);
+    queue_fail(ps->queue);
+    return 0;
+}
 
-    // Sort the map by DMR ID.
-    qsort(map, sz.count, sizeof(map[0]), compare_callsign_map);
+static void d868uv_write_csv(radio_device_t *radio, FILE *csv)
+{
+    calldb_parser_t ps = {0};
+    pthread_t parser;
+    chunk_t chunk;
+    int cleared = 0;
 
+    if (csv_init(csv) < 0) {
+        return;
+    }
+    ps.csv = csv;
+    ps.map = malloc(NCALLSIGNS * sizeof(callsign_map_t));
+    if (!ps.map) {
+        fprintf(stderr, "Out of memory!\n");
+        return;
+    }
+
+    //
+    // Parse CSV file in a separate thread, and write data chunks
+    // to the radio while parsing continues.
+    // Up to 4 chunks are queued.
+    // Before the first chunk, the sizes are cleared: until the map
+    // and the sizes are written at the end, the radio sees
+    // an empty database, also when the parser fails.
+    //
+    ps.queue = queue_create(4);
+    if (pthread_create(&parser, 0, parse_calldb, &ps) != 0) {
+        fprintf(stderr, "Cannot create parser thread!\n");
+        exit(-1);
+    }
     if (! trace_flag) {
         fprintf(stderr, "Write: ");
         fflush(stderr);
     }
+    while (queue_get(ps.queue, &chunk)) {
+        if (! queue_failed(ps.queue)) {
+            if (! cleared) {
+                callsign_sizes_t empty = { 0, ADDR_CALLDB_DATA };
+
+                write_calldb_chunk(ADDR_CALLDB_SIZE, &empty, 16, 0);
+                cleared = 1;
+            }
+            write_calldb_chunk(chunk.addr, chunk.data, chunk.nbytes, 1);
+        }
+        free(chunk.data);
+    }
+    pthread_join(parser, 0);
+
+    // The parser has stopped on error: leave the database empty,
+    // and fail the command.
+    if (queue_failed(ps.queue) && ps.status < 0) {
+        if (cleared)
+            fprintf(stderr, "Callsign database in the radio is now empty.\n");
+        queue_destroy(ps.queue);
+        free(ps.map);
+        exit(-1);
+    }
+
+    // Eastern egg: dump the database instead of writing it.
+    if (ps.status > 0) {
+        dump_csv(radio);
+        goto done;
+    }
 
     //
-    // Write callsign map.
+    // Sort the map by DMR ID, and write it in 128000-byte chunks.
     //
-    unsigned addr = ADDR_CALLDB_LIST;
-    unsigned index;
+    qsort(ps.map, ps.sz.count, sizeof(ps.map[0]), compare_callsign_map);
 
-//#define DUMP_NO_WRITE
-#ifdef DUMP_NO_WRITE
-    printf("Map:\n");
-#endif
-    for (index = 0; index < sz.count; index += 16000) {
-        unsigned n = (sz.count - index) * 8;
+    unsigned index, addr = ADDR_CALLDB_LIST;
+    for (index = 0; index < ps.sz.count; index += 16000) {
+        unsigned n = (ps.sz.count - index) * 8;
         if (n > 128000)
             n = 128000;
 
-#ifdef DUMP_NO_WRITE
-        // Dump the data, for debugging purposes.
-        print_hex_addr_data(addr, (uint8_t*) &map[index], n);
-#else
-        serial_write_region(addr, (uint8_t*) &map[index], n);
-#endif
+        write_calldb_chunk(addr, &ps.map[index], n, 1);
         addr += 256*1024;
-
-        fprintf(stderr, "#");
-        fflush(stderr);
     }
 
     //
     // Write sizes.
     //
-#ifdef DUMP_NO_WRITE
-    printf("\nSizes:\n");
-    print_hex_addr_data(ADDR_CALLDB_SIZE, (uint8_t*) &sz, 16);
-#else
-    serial_write_region(ADDR_CALLDB_SIZE, (uint8_t*) &sz, 16);
-#endif
-
-    //
-    // Write data.
-    //
-    addr = ADDR_CALLDB_DATA;
-#ifdef DUMP_NO_WRITE
-    printf("\nData:\n");
-#endif
-    for (index = 0; index < nbytes; index += 100000) {
-        unsigned n = nbytes - index;
-        if (n > 100000)
-            n = 100000;
-
-#ifdef DUMP_NO_WRITE
-        print_hex_addr_data(addr, (uint8_t*) &data[index], n);
-#else
-        serial_write_region(addr, (uint8_t*) &data[index], n);
-#endif
-        addr += 256*1024;
-
-        fprintf(stderr, "#");
-        fflush(stderr);
-    }
+    write_calldb_chunk(ADDR_CALLDB_SIZE, &ps.sz, 16, 0);
 
     if (! trace_flag)
         fprintf(stderr, "# done.\n");
-    free(data);
+    fprintf(stderr, "Total %d contacts, %d bytes.\n", ps.sz.count, ps.nbytes);
+    queue_print_stats(ps.queue, "Parse", "Write");
+done:
+    queue_destroy(ps.queue);
+    free(ps.map);
 }
 
 //
@@ -2993,7 +3207,9 @@ radio_device_t radio_d868uv = {
     d868uv_parse_header,
     d868uv_parse_row,
     d868uv_update_timestamp,
+    0,                                  // No change counter: not cached
     d868uv_write_csv,
+    d868uv_print_plan,
 };
 
 //
@@ -3013,7 +3229,9 @@ radio_device_t radio_d878uv = {
     d868uv_parse_header,
     d868uv_parse_row,
     d868uv_update_timestamp,
+    0,                                  // No change counter: not cached
     d868uv_write_csv,
+    d868uv_print_plan,
 };
 
 //
@@ -3033,5 +3251,7 @@ radio_device_t radio_dmr6x2 = {
     d868uv_parse_header,
     d868uv_parse_row,
     d868uv_update_timestamp,
+    0,                                  // No change counter: not cached
     d868uv_write_csv,
+    d868uv_print_plan,
 };
@@ -28,7 +28,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <libusb.h>
 #include "util.h"
 
@@ -69,9 +71,42 @@ typedef struct {
     unsigned    string_index : 8;
 } status_t;
 
-static libusb_context *ctx = NULL;
-static libusb_device_handle *dev;
-static status_t status;
+static __thread libusb_context *ctx = NULL;
+static __thread libusb_device_handle *dev;
+static __thread status_t status;
+static __thread int upload_pending;      // Device may be in dfuUPLOAD-IDLE state
+static __thread int reads_unchecked;     // Blocks read without status query
+static __thread int program_mode;        // Programming mode entered for erase
+
+//
+// Fast read: send UPLOAD requests back to back, and query status
+// only every STATUS_INTERVAL blocks, at sector boundaries and on error.
+// Comment out to query status after every block.
+//
+#define FAST_READ
+#define STATUS_INTERVAL 16
+
+//
+// Operations, for statistics of wait times.
+//
+enum {
+    OP_COMMAND,
+    OP_ERASE,
+    OP_WRITE,
+    NOPS,
+};
+
+//
+// Histogram of wait times: <1, <2, <4 ... <512, and more msec.
+//
+#define NBUCKETS        11
+static __thread unsigned wait_histogram[NOPS][NBUCKETS];
+
+//
+// Longest delay between polls, in msec.
+//
+#define MAX_POLL_DELAY  100
+#define MAX_POLL_TIMEOUT 5000
 
 static int detach(int timeout)
 {
@@ -98,6 +133,73 @@ static int get_status()
     return error;
 }
 
+//
+// Wait until the device completes the last download request.
+// The delay between polls is taken from bwPollTimeout, as reported
+// by the device; when it is zero, the delay doubles from 1 msec.
+//
+static void wait_status(int op)
+{
+    struct timeval t0, t1;
+    unsigned delay = 1, msec;
+    int bucket;
+
+    gettimeofday(&t0, 0);
+    for (;;) {
+        if (get_status() < 0)
+            break;
+        if (status.state != dfuDNBUSY)
+            break;
+
+        if (status.poll_timeout > 0) {
+            msec = status.poll_timeout;
+            if (msec > MAX_POLL_TIMEOUT)
+                msec = MAX_POLL_TIMEOUT;
+        } else {
+            msec = delay;
+            if (delay < MAX_POLL_DELAY)
+                delay *= 2;
+        }
+        usleep(msec * 1000);
+    }
+    gettimeofday(&t1, 0);
+
+    msec = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+    for (bucket = 0; bucket < NBUCKETS-1; bucket++) {
+        if (msec < (1U << bucket))
+            break;
+    }
+    wait_histogram[op][bucket]++;
+}
+
+//
+// Print statistics of wait times.
+//
+static void print_wait_histogram()
+{
+    static const char *name[NOPS] = { "Command", "Erase", "Write" };
+    int op, bucket;
+
+    printf("Wait time, msec:\n        ");
+    for (bucket = 0; bucket < NBUCKETS; bucket++) {
+        char label[16];
+
+        if (bucket < NBUCKETS-1)
+            sprintf(label, "<%u", 1U << bucket);
+        else
+            sprintf(label, ">=%u", 1U << (bucket-1));
+        printf(" %6s", label);
+    }
+    printf("\n");
+
+    for (op = 0; op < NOPS; op++) {
+        printf("%-8s", name[op]);
+        for (bucket = 0; bucket < NBUCKETS; bucket++)
+            printf(" %6u", wait_histogram[op][bucket]);
+        printf("\n");
+    }
+}
+
 static int clear_status()
 {
     if (trace_flag) {
@@ -139,6 +241,7 @@ static int dfu_abort()
 static void wait_dfu_idle()
 {
     int state, error;
+    unsigned delay = 1;
 
     for (;;) {
         error = get_state(&state);
@@ -163,7 +266,9 @@ static void wait_dfu_idle()
         case appDETACH:
         case dfuDNBUSY:
         case dfuMANIFEST_WAIT_RESET:
-            usleep(100000);
+            usleep(delay * 1000);
+            if (delay < MAX_POLL_DELAY)
+                delay *= 2;
             continue;
 
         default:
@@ -195,8 +300,7 @@ static void md380_command(uint8_t a, uint8_t b)
             __func__, error, libusb_strerror(error));
         exit(-1);
     }
-    get_status();
-    usleep(100000);
+    wait_status(OP_COMMAND);
     wait_dfu_idle();
 }
 
@@ -221,7 +325,7 @@ static void set_address(uint32_t address)
             __func__, error, libusb_strerror(error));
         exit(-1);
     }
-    get_status();
+    wait_status(OP_COMMAND);
     wait_dfu_idle();
 }
 
@@ -246,7 +350,7 @@ static void erase_block(uint32_t address, int progress_flag)
             __func__, error, libusb_strerror(error));
         exit(-1);
     }
-    get_status();
+    wait_status(OP_ERASE);
     wait_dfu_idle();
 
     if (progress_flag) {
@@ -257,7 +361,7 @@ static void erase_block(uint32_t address, int progress_flag)
 
 static const char *identify()
 {
-    static uint8_t data[64];
+    static __thread uint8_t data[64];
 
     md380_command(0xa2, 0x01);
 
@@ -280,6 +384,90 @@ static const char *identify()
     return (const char*) data;
 }
 
+//
+// Find the radio with given vid:pid and index among
+// devices of the same type, or at device_location when set.
+// Return 0 when not found.
+//
+static libusb_device *find_device(libusb_device **list, unsigned vid, unsigned pid, int index)
+{
+    struct libusb_device_descriptor desc;
+    int i;
+
+    for (i=0; list[i]; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0)
+            continue;
+        if (desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+        if (device_location != 0) {
+            if (device_location == (libusb_get_bus_number(list[i]) << 8 |
+                                    libusb_get_device_address(list[i])))
+                return list[i];
+            continue;
+        }
+        if (index-- == 0)
+            return list[i];
+    }
+    return 0;
+}
+
+//
+// Port name of the device as in Linux sysfs: bus-port.port...
+//
+static void port_name(libusb_device *d, char *buf)
+{
+    uint8_t path[8];
+    int i, n, len;
+
+    len = sprintf(buf, "%d", libusb_get_bus_number(d));
+    n = libusb_get_port_numbers(d, path, sizeof(path));
+    for (i=0; i<n; i++)
+        len += sprintf(buf + len, "%c%d", i ? '.' : '-', path[i]);
+}
+
+//
+// Identify the opened device by its serial number,
+// or by the port it is attached to.
+//
+static void set_identity(libusb_device *d, libusb_device_handle *handle)
+{
+    struct libusb_device_descriptor desc;
+    unsigned char serial[40];
+
+    if (libusb_get_device_descriptor(d, &desc) == 0 && desc.iSerialNumber &&
+        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                           serial, sizeof(serial)) > 0) {
+        snprintf(device_identity, sizeof(device_identity), "serial %s", serial);
+        return;
+    }
+    strcpy(device_identity, "port ");
+    port_name(d, device_identity + 5);
+}
+
+//
+// Open the radio with given vid:pid, selected by device_index
+// or device_location.  Used by DFU and HID drivers.
+// Return 0 when not found.
+//
+libusb_device_handle *usb_open(libusb_context *ctx, unsigned vid, unsigned pid)
+{
+    libusb_device **list;
+    libusb_device *d;
+    libusb_device_handle *handle = 0;
+
+    if (libusb_get_device_list(ctx, &list) < 0)
+        return 0;
+
+    d = find_device(list, vid, pid, device_index);
+    if (d && libusb_open(d, &handle) < 0)
+        handle = 0;
+    if (handle)
+        set_identity(d, handle);
+
+    libusb_free_device_list(list, 1);
+    return handle;
+}
+
 const char *dfu_init(unsigned vid, unsigned pid)
 {
     int error = libusb_init(&ctx);
@@ -289,7 +477,7 @@ const char *dfu_init(unsigned vid, unsigned pid)
         exit(-1);
     }
 
-    dev = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    dev = usb_open(ctx, vid, pid);
     if (!dev) {
         if (trace_flag) {
             fprintf(stderr, "Cannot find USB device %04x:%04x\n",
@@ -319,6 +507,7 @@ const char *dfu_init(unsigned vid, unsigned pid)
 
     // Get device identifier in a static buffer.
     const char *ident = identify();
+    program_mode = 0;
 
     // Zero address.
     set_address(0x00000000);
@@ -329,6 +518,8 @@ const char *dfu_init(unsigned vid, unsigned pid)
 void dfu_close()
 {
     if (ctx) {
+        if (trace_flag)
+            print_wait_histogram();
         libusb_release_interface(dev, 0);
         libusb_close(dev);
         libusb_exit(ctx);
@@ -336,13 +527,152 @@ void dfu_close()
     }
 }
 
-void dfu_erase(unsigned start, unsigned finish)
+//
+// Count attached USB devices of given types, in one pass.
+// Return -1 when the list of devices is not available.
+//
+int usb_scan(int ntypes, const unsigned vid[], const unsigned pid[], int count[])
+{
+    libusb_context *c;
+    libusb_device **list;
+    struct libusb_device_descriptor desc;
+    int i, k;
+
+    if (libusb_init(&c) < 0)
+        return -1;
+    if (libusb_get_device_list(c, &list) < 0) {
+        libusb_exit(c);
+        return -1;
+    }
+    for (k=0; k<ntypes; k++)
+        count[k] = 0;
+    for (i=0; list[i]; i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0)
+            continue;
+        for (k=0; k<ntypes; k++) {
+            if (desc.idVendor == vid[k] && desc.idProduct == pid[k])
+                count[k]++;
+        }
+    }
+    libusb_free_device_list(list, 1);
+    libusb_exit(c);
+    return 0;
+}
+
+//
+// Hotplug events, queued by the callback.
+//
+#define HOTPLUG_QUEUE   16
+
+static libusb_context *hotplug_ctx;
+static hotplug_event_t hotplug_queue[HOTPLUG_QUEUE];
+static int hotplug_count;
+
+//
+// Callback: radio attached.
+//
+static int LIBUSB_CALL hotplug_callback(libusb_context *c, libusb_device *d,
+    libusb_hotplug_event event, void *arg)
+{
+    hotplug_event_t *ev;
+
+    if (event != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ||
+        hotplug_count >= HOTPLUG_QUEUE)
+        return 0;
+
+    ev = &hotplug_queue[hotplug_count++];
+    ev->type = (intptr_t) arg;
+    ev->location = libusb_get_bus_number(d) << 8 | libusb_get_device_address(d);
+    port_name(d, ev->port);
+    return 0;
+}
+
+//
+// Start monitoring for radios of given types.
+// Return -1 when hotplug is not supported.
+//
+int usb_hotplug_init(int ntypes, const unsigned vid[], const unsigned pid[])
+{
+    int k;
+
+    if (! libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ||
+        libusb_init(&hotplug_ctx) < 0)
+        return -1;
+
+    for (k=0; k<ntypes; k++) {
+        if (libusb_hotplug_register_callback(hotplug_ctx,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                vid[k], pid[k], LIBUSB_HOTPLUG_MATCH_ANY,
+                hotplug_callback, (void*) (intptr_t) k, NULL) < 0) {
+            libusb_exit(hotplug_ctx);
+            hotplug_ctx = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//
+// Wait up to msec milliseconds for a radio to be attached.
+// Return 1 when the event is available, 0 on timeout.
+//
+int usb_hotplug_wait(hotplug_event_t *ev, int msec)
+{
+    struct timeval tv = { msec / 1000, msec % 1000 * 1000 };
+
+    if (! hotplug_ctx)
+        return 0;
+
+    if (hotplug_count == 0)
+        libusb_handle_events_timeout(hotplug_ctx, &tv);
+    if (hotplug_count == 0)
+        return 0;
+
+    *ev = hotplug_queue[0];
+    memmove(&hotplug_queue[0], &hotplug_queue[1], --hotplug_count * sizeof(*ev));
+    return 1;
+}
+
+//
+// Get the number of attached radios with given vid:pid.
+//
+int usb_count(unsigned vid, unsigned pid)
+{
+    libusb_context *c;
+    libusb_device **list;
+    int n = 0;
+
+    if (libusb_init(&c) < 0)
+        return 0;
+    if (libusb_get_device_list(c, &list) >= 0) {
+        while (find_device(list, vid, pid, n))
+            n++;
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(c);
+    return n;
+}
+
+int dfu_count(unsigned vid, unsigned pid)
+{
+    return usb_count(vid, pid);
+}
+
+//
+// Enter programming mode, as required for erasing.
+//
+static void enter_program_mode()
 {
-    // Enter Programming Mode.
     get_status();
     wait_dfu_idle();
     md380_command(0x91, 0x01);
     usleep(100000);
+    program_mode = 1;
+}
+
+void dfu_erase(unsigned start, unsigned finish)
+{
+    enter_program_mode();
 
     if (start == 0) {
         // Erase 256kbytes of configuration memory.
@@ -380,6 +710,22 @@ void dfu_erase(unsigned start, unsigned finish)
     set_address(0x00000000);
 }
 
+//
+// Erase one 64-kbyte sector at the given address.
+// Programming mode is entered before the first sector.
+// After reading, the device must be returned to idle state first.
+//
+void dfu_erase_sector(unsigned addr)
+{
+    if (! program_mode)
+        enter_program_mode();
+    wait_dfu_idle();
+    erase_block(addr, 0);
+
+    // Zero address.
+    set_address(0x00000000);
+}
+
 void dfu_read_block(int bno, uint8_t *data, int nbytes)
 {
     if (bno >= 256 && bno < 2048)
@@ -390,6 +736,15 @@ void dfu_read_block(int bno, uint8_t *data, int nbytes)
     }
     int error = libusb_control_transfer(dev, REQUEST_TYPE_TO_HOST,
         REQUEST_UPLOAD, bno+2, 0, data, nbytes, 0);
+#ifdef FAST_READ
+    if (error < 0 && reads_unchecked > 0) {
+        // Status was not queried: recover and try again.
+        wait_dfu_idle();
+        reads_unchecked = 0;
+        error = libusb_control_transfer(dev, REQUEST_TYPE_TO_HOST,
+            REQUEST_UPLOAD, bno+2, 0, data, nbytes, 0);
+    }
+#endif
     if (error < 0) {
         fprintf(stderr, "%s: cannot read block %d, nbytes = %d: %d: %s\n",
             __func__, bno, nbytes, error, libusb_strerror(error));
@@ -400,7 +755,17 @@ void dfu_read_block(int bno, uint8_t *data, int nbytes)
         print_hex(data, nbytes);
         printf("\n");
     }
+#ifdef FAST_READ
+    // Query status at the end of 64-kbyte sector, or every few blocks.
+    reads_unchecked++;
+    if (reads_unchecked < STATUS_INTERVAL && (bno + 1) % 64 != 0) {
+        upload_pending = 1;
+        return;
+    }
+    reads_unchecked = 0;
+#endif
     get_status();
+    upload_pending = 1;
 }
 
 void dfu_write_block(int bno, uint8_t *data, int nbytes)
@@ -408,6 +773,12 @@ void dfu_write_block(int bno, uint8_t *data, int nbytes)
     if (bno >= 256 && bno < 2048)
         bno += 832;
 
+    if (upload_pending) {
+        // Download is not allowed after upload: return to idle state.
+        wait_dfu_idle();
+        upload_pending = 0;
+    }
+
     if (trace_flag) {
         printf("--- Send DNLOAD [%d] ", nbytes);
         if (trace_flag > 1)
@@ -422,7 +793,7 @@ void dfu_write_block(int bno, uint8_t *data, int nbytes)
         exit(-1);
     }
 
-    get_status();
+    wait_status(OP_WRITE);
     wait_dfu_idle();
 }
 
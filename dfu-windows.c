@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include "util.h"
 
@@ -83,8 +84,19 @@ typedef struct {
     ULONG Length;
 } CNTRPIPE_RQ, *PCNTRPIPE_RQ;
 
-static HANDLE dev;
-static status_t status;
+static __thread HANDLE dev;
+static __thread status_t status;
+static __thread int upload_pending;      // Device may be in dfuUPLOAD-IDLE state
+static __thread int reads_unchecked;     // Blocks read without status query
+static __thread int program_mode;        // Programming mode entered for erase
+
+//
+// Fast read: send UPLOAD requests back to back, and query status
+// only every STATUS_INTERVAL blocks, at sector boundaries and on error.
+// Comment out to query status after every block.
+//
+#define FAST_READ
+#define STATUS_INTERVAL 16
 
 static int dev_request(int request, int value)
 {
@@ -321,7 +333,7 @@ static void erase_block(uint32_t address, int progress_flag)
 
 static const char *identify()
 {
-    static uint8_t data[64];
+    static __thread uint8_t data[64];
 
     md380_command(0xa2, 0x01);
 
@@ -344,10 +356,11 @@ static const char *identify()
 
 //
 // Find path for a device with a given GUID.
-// Return the first path found (dynamically allocated).
+// Skip the first `skip' devices found.
+// Return the path (dynamically allocated).
 // Return 0 when no device with such GUID is present.
 //
-static char *find_path(GUID *guid)
+static char *find_path(GUID *guid, int skip)
 {
     char *path = 0;
 
@@ -374,7 +387,9 @@ static char *find_path(GUID *guid)
 
         // Get device information.
         if (SetupDiGetDeviceInterfaceDetail(devinfo, &iface, detail, needed, NULL, &did)) {
-            // Use the first device found.
+            if (skip-- > 0)
+                continue;
+
             //printf("Device %d: path %s\n", index, detail->DevicePath);
             path = strdup(detail->DevicePath);
             break;
@@ -385,14 +400,15 @@ static char *find_path(GUID *guid)
     return path;
 }
 
+static GUID guid_0483_df11 = { 0x3fe809ab, 0xfb91, 0x4cb5, { 0xa6, 0x43, 0x69, 0x67, 0x0d, 0x52, 0x36, 0x6e } };
+
 const char *dfu_init(unsigned vid, unsigned pid)
 {
-    static GUID guid_0483_df11 = { 0x3fe809ab, 0xfb91, 0x4cb5, { 0xa6, 0x43, 0x69, 0x67, 0x0d, 0x52, 0x36, 0x6e } };
     char *path = 0;
 
     // Find path for device.
     if (vid == 0x0483 && pid == 0xdf11) {
-        path = find_path(&guid_0483_df11);
+        path = find_path(&guid_0483_df11, device_index);
     } else {
         fprintf(stderr, "No guid for vid=%04x, pid=%04x!\n", vid, pid);
         exit(-1);
@@ -408,6 +424,8 @@ const char *dfu_init(unsigned vid, unsigned pid)
     // Open the device.
     dev = CreateFile(path, GENERIC_WRITE | GENERIC_READ,
         0, NULL, OPEN_EXISTING, 0, NULL);
+    snprintf(device_identity, sizeof(device_identity), "path %016llx",
+        hash_fnv(0, (unsigned char*) path, strlen(path)));
     if (! dev) {
         printf("%s: Cannot open\n", path);
         exit(-1);
@@ -423,6 +441,7 @@ const char *dfu_init(unsigned vid, unsigned pid)
 
     // Get device identifier in a static buffer.
     const char *ident = identify();
+    program_mode = 0;
 
     // Zero address.
     set_address(0x00000000);
@@ -438,13 +457,88 @@ void dfu_close()
     }
 }
 
-void dfu_erase(unsigned start, unsigned finish)
+//
+// Count attached USB devices of given types, in one pass.
+// Return -1 when the list of devices is not available.
+//
+int usb_scan(int ntypes, const unsigned vid[], const unsigned pid[], int count[])
+{
+    HDEVINFO devinfo = SetupDiGetClassDevs(NULL, "USB", NULL, DIGCF_PRESENT | DIGCF_ALLCLASSES);
+    if (devinfo == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    int index, k;
+    for (k=0; k<ntypes; k++)
+        count[k] = 0;
+
+    SP_DEVINFO_DATA did = { sizeof(SP_DEVINFO_DATA) };
+    for (index=0; SetupDiEnumDeviceInfo(devinfo, index, &did); ++index) {
+        char id[256];
+        unsigned v, p;
+
+        // Instance ID looks like USB\VID_0483&PID_DF11\serial.
+        // Skip interfaces of composite devices.
+        if (!SetupDiGetDeviceInstanceId(devinfo, &did, id, sizeof(id), NULL))
+            continue;
+        if (sscanf(id, "USB\\VID_%4x&PID_%4x", &v, &p) != 2 || strstr(id, "&MI_"))
+            continue;
+
+        for (k=0; k<ntypes; k++) {
+            if (v == vid[k] && p == pid[k])
+                count[k]++;
+        }
+    }
+    SetupDiDestroyDeviceInfoList(devinfo);
+    return 0;
+}
+
+//
+// Hotplug is not supported on Windows.
+//
+int usb_hotplug_init(int ntypes, const unsigned vid[], const unsigned pid[])
+{
+    return -1;
+}
+
+int usb_hotplug_wait(hotplug_event_t *ev, int msec)
+{
+    return 0;
+}
+
+//
+// Get the number of attached radios with given vid:pid.
+//
+int dfu_count(unsigned vid, unsigned pid)
+{
+    char *path;
+    int n = 0;
+
+    if (vid != 0x0483 || pid != 0xdf11)
+        return 0;
+
+    while ((path = find_path(&guid_0483_df11, n)) != 0) {
+        free(path);
+        n++;
+    }
+    return n;
+}
+
+//
+// Enter programming mode, as required for erasing.
+//
+static void enter_program_mode()
 {
-    // Enter Programming Mode.
     get_status();
     wait_dfu_idle();
     md380_command(0x91, 0x01);
     usleep(100000);
+    program_mode = 1;
+}
+
+void dfu_erase(unsigned start, unsigned finish)
+{
+    enter_program_mode();
 
     if (start == 0) {
         // Erase 256kbytes of configuration memory.
@@ -482,6 +576,22 @@ void dfu_erase(unsigned start, unsigned finish)
     set_address(0x00000000);
 }
 
+//
+// Erase one 64-kbyte sector at the given address.
+// Programming mode is entered before the first sector.
+// After reading, the device must be returned to idle state first.
+//
+void dfu_erase_sector(unsigned addr)
+{
+    if (! program_mode)
+        enter_program_mode();
+    wait_dfu_idle();
+    erase_block(addr, 0);
+
+    // Zero address.
+    set_address(0x00000000);
+}
+
 void dfu_read_block(int bno, uint8_t *data, int nbytes)
 {
     if (bno >= 256 && bno < 2048)
@@ -491,6 +601,14 @@ void dfu_read_block(int bno, uint8_t *data, int nbytes)
         printf("--- Send UPLOAD [%d]\n", nbytes);
     }
     int error = dev_read(REQUEST_UPLOAD, bno+2, nbytes, data);
+#ifdef FAST_READ
+    if (error < 0 && reads_unchecked > 0) {
+        // Status was not queried: recover and try again.
+        wait_dfu_idle();
+        reads_unchecked = 0;
+        error = dev_read(REQUEST_UPLOAD, bno+2, nbytes, data);
+    }
+#endif
     if (error < 0) {
         fprintf(stderr, "%s: cannot read block %d, nbytes = %d\n",
             __func__, bno, nbytes);
@@ -501,7 +619,17 @@ void dfu_read_block(int bno, uint8_t *data, int nbytes)
         print_hex(data, nbytes);
         printf("\n");
     }
+#ifdef FAST_READ
+    // Query status at the end of 64-kbyte sector, or every few blocks.
+    reads_unchecked++;
+    if (reads_unchecked < STATUS_INTERVAL && (bno + 1) % 64 != 0) {
+        upload_pending = 1;
+        return;
+    }
+    reads_unchecked = 0;
+#endif
     get_status();
+    upload_pending = 1;
 }
 
 void dfu_write_block(int bno, uint8_t *data, int nbytes)
@@ -509,6 +637,12 @@ void dfu_write_block(int bno, uint8_t *data, int nbytes)
     if (bno >= 256 && bno < 2048)
         bno += 832;
 
+    if (upload_pending) {
+        // Download is not allowed after upload: return to idle state.
+        wait_dfu_idle();
+        upload_pending = 0;
+    }
+
     if (trace_flag) {
         printf("--- Send DNLOAD [%d] ", nbytes);
         if (trace_flag > 1)
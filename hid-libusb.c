@@ -32,14 +32,20 @@
 #include <libusb.h>
 #include "util.h"
 
-static libusb_context *ctx = NULL;          // libusb context
-static libusb_device_handle *dev;           // libusb device
-static struct libusb_transfer *transfer;    // async transfer descriptor
-static unsigned char receive_buf[42];       // receive buffer
-static volatile int nbytes_received = 0;    // receive result
+static __thread libusb_context *ctx = NULL;          // libusb context
+static __thread libusb_device_handle *dev;           // libusb device
+static __thread struct libusb_transfer *transfer;    // async transfer descriptor
+static __thread unsigned char receive_buf[42];       // receive buffer
+static __thread volatile int nbytes_received = 0;    // receive result
 
 #define HID_INTERFACE   0                   // interface index
 #define TIMEOUT_MSEC    500                 // receive timeout
+#define PIPELINE_DEPTH  4                   // max outstanding requests
+
+static __thread struct libusb_transfer *pipeline[PIPELINE_DEPTH];    // pipelined receive
+static __thread unsigned char pipeline_buf[PIPELINE_DEPTH][42];      // receive buffers
+static __thread volatile int pipeline_result[PIPELINE_DEPTH];        // receive results
+static __thread int pipeline_depth = PIPELINE_DEPTH;                 // current depth
 
 //
 // Callback function for asynchronous receive.
@@ -132,18 +138,14 @@ again:
 }
 
 //
-// Send a request to the device.
-// Store the reply into the rdata[] array.
-// Terminate in case of errors.
+// Build a packet for the device.
+// Return the packet length.
 //
-void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rdata, unsigned rlength)
+static unsigned make_packet(unsigned char *buf, const unsigned char *data, unsigned nbytes)
 {
-    unsigned char buf[42];
-    unsigned char reply[42];
     unsigned k;
-    int reply_len;
 
-    memset(buf, 0, sizeof(buf));
+    memset(buf, 0, 42);
     buf[0] = 1;
     buf[1] = 0;
     buf[2] = nbytes;
@@ -161,13 +163,20 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rd
         }
         fprintf(stderr, "\n");
     }
-    reply_len = write_read(buf, sizeof(buf), reply, sizeof(reply));
-    if (reply_len < 0) {
-        exit(-1);
-    }
-    if (reply_len != sizeof(reply)) {
+    return nbytes;
+}
+
+//
+// Check the reply and store it into the rdata[] array.
+// Terminate in case of errors.
+//
+static void get_reply(const unsigned char *reply, int reply_len, unsigned char *rdata, unsigned rlength)
+{
+    unsigned k;
+
+    if (reply_len != 42) {
         fprintf(stderr, "Short read: %d bytes instead of %d!\n",
-            reply_len, (int)sizeof(reply));
+            reply_len, 42);
         exit(-1);
     }
     if (trace_flag > 0) {
@@ -191,6 +200,184 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rd
     memcpy(rdata, reply+4, rlength);
 }
 
+//
+// Send a request to the device.
+// Store the reply into the rdata[] array.
+// Terminate in case of errors.
+//
+void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rdata, unsigned rlength)
+{
+    unsigned char buf[42];
+    unsigned char reply[42];
+    int reply_len;
+
+    make_packet(buf, data, nbytes);
+    reply_len = write_read(buf, sizeof(buf), reply, sizeof(reply));
+    if (reply_len < 0) {
+        exit(-1);
+    }
+    get_reply(reply, reply_len, rdata, rlength);
+}
+
+//
+// Discard replies, which came too late.
+//
+void hid_flush()
+{
+    unsigned char buf[42];
+    int n;
+
+    while (libusb_interrupt_transfer(dev,
+        LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_IN,
+        buf, sizeof(buf), &n, 50) == 0)
+        continue;
+}
+
+//
+// Callback function for pipelined receive.
+// Store the result into the slot status.
+//
+static void pipeline_callback(struct libusb_transfer *t)
+{
+    volatile int *result = t->user_data;
+
+    switch (t->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        *result = t->actual_length;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        *result = LIBUSB_ERROR_INTERRUPTED;
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        *result = LIBUSB_ERROR_NO_DEVICE;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        *result = LIBUSB_ERROR_TIMEOUT;
+        break;
+    default:
+        *result = LIBUSB_ERROR_IO;
+        break;
+    }
+}
+
+//
+// Wait until the slot transfer is complete.
+//
+static void pipeline_wait(int slot)
+{
+    while (pipeline_result[slot] == 0) {
+        int result = libusb_handle_events(ctx);
+        if (result < 0 &&
+            result != LIBUSB_ERROR_BUSY &&
+            result != LIBUSB_ERROR_TIMEOUT &&
+            result != LIBUSB_ERROR_OVERFLOW &&
+            result != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error %d receiving data via interrupt transfer: %s\n",
+                result, libusb_strerror(result));
+            exit(-1);
+        }
+    }
+}
+
+//
+// Cancel the outstanding transfers from first to last-1,
+// drop late replies and continue without pipelining.
+//
+static void pipeline_disable(int first, int last)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        libusb_cancel_transfer(pipeline[i % pipeline_depth]);
+    }
+    for (i = first; i < last; i++) {
+        pipeline_wait(i % pipeline_depth);
+    }
+    hid_flush();
+    pipeline_depth = 1;
+}
+
+//
+// Send a sequence of requests, keeping up to PIPELINE_DEPTH
+// of them outstanding. Every request has nbytes of data,
+// every reply has rlength bytes; the replies are stored in order.
+// Interrupt IN transfers are submitted before the requests are sent,
+// and complete in the order of submission.
+// On timeout, the pipeline is disabled and the remaining requests
+// are sent one by one.
+//
+void hid_send_recv_multi(int count, const unsigned char *data, unsigned nbytes,
+    unsigned char *rdata, unsigned rlength)
+{
+    unsigned char buf[42];
+    int sent = 0, received = 0, slot, result;
+
+    while (received < count) {
+        if (pipeline_depth <= 1) {
+            // No pipelining.
+            hid_send_recv(data + received*nbytes, nbytes, rdata + received*rlength, rlength);
+            received++;
+            continue;
+        }
+
+        // Keep the pipeline full.
+        while (sent < count && sent - received < pipeline_depth) {
+            slot = sent % pipeline_depth;
+            if (! pipeline[slot]) {
+                // Allocate transfer descriptor on first invocation.
+                pipeline[slot] = libusb_alloc_transfer(0);
+                if (! pipeline[slot]) {
+                    fprintf(stderr, "Out of memory!\n");
+                    exit(-1);
+                }
+            }
+            libusb_fill_interrupt_transfer(pipeline[slot], dev,
+                LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_IN,
+                pipeline_buf[slot], sizeof(pipeline_buf[slot]),
+                pipeline_callback, (void*)&pipeline_result[slot], TIMEOUT_MSEC);
+            pipeline_result[slot] = 0;
+            result = libusb_submit_transfer(pipeline[slot]);
+            if (result < 0) {
+                if (trace_flag > 0) {
+                    fprintf(stderr, "Error %d submitting interrupt transfer: %s, pipelining disabled.\n",
+                        result, libusb_strerror(result));
+                }
+                pipeline_disable(received, sent);
+                break;
+            }
+
+            make_packet(buf, data + sent*nbytes, nbytes);
+            result = libusb_control_transfer(dev,
+                LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+                0x09/*HID Set_Report*/, (2/*HID output*/ << 8) | 0,
+                HID_INTERFACE, buf, sizeof(buf), TIMEOUT_MSEC);
+            if (result < 0) {
+                fprintf(stderr, "Error %d transmitting data via control transfer: %s\n",
+                    result, libusb_strerror(result));
+                exit(-1);
+            }
+            sent++;
+        }
+
+        if (pipeline_depth <= 1)
+            continue;
+
+        // Get the oldest reply.
+        slot = received % pipeline_depth;
+        pipeline_wait(slot);
+        if (pipeline_result[slot] < 0) {
+            // Cancel the outstanding transfers, and continue without pipelining.
+            if (trace_flag > 0) {
+                fprintf(stderr, "No response from HID device, pipelining disabled.\n");
+            }
+            pipeline_disable(received+1, sent);
+            continue;
+        }
+        get_reply(pipeline_buf[slot], pipeline_result[slot], rdata + received*rlength, rlength);
+        received++;
+    }
+}
+
 //
 // Connect to the specified device.
 // Initiate the programming session.
@@ -204,7 +391,7 @@ int hid_init(int vid, int pid)
         exit(-1);
     }
 
-    dev = libusb_open_device_with_vid_pid(ctx, vid, pid);
+    dev = usb_open(ctx, vid, pid);
     if (!dev) {
         if (trace_flag) {
             fprintf(stderr, "Cannot find USB device %04x:%04x\n",
@@ -232,6 +419,8 @@ int hid_init(int vid, int pid)
 
 void hid_close()
 {
+    int i;
+
     if (!ctx)
         return;
 
@@ -239,8 +428,22 @@ void hid_close()
         libusb_free_transfer(transfer);
         transfer = 0;
     }
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        if (pipeline[i]) {
+            libusb_free_transfer(pipeline[i]);
+            pipeline[i] = 0;
+        }
+    }
     libusb_release_interface(dev, HID_INTERFACE);
     libusb_close(dev);
     libusb_exit(ctx);
     ctx = 0;
 }
+
+//
+// Get the number of attached radios with given vid:pid.
+//
+int hid_count(int vid, int pid)
+{
+    return usb_count(vid, pid);
+}
@@ -32,10 +32,10 @@
 #include <IOKit/hid/IOHIDManager.h>
 #include "util.h"
 
-static volatile IOHIDDeviceRef dev;         // device handle
-static unsigned char transfer_buf[42];      // device buffer
-static unsigned char receive_buf[42];       // receive buffer
-static volatile int nbytes_received = 0;    // receive result
+static __thread volatile IOHIDDeviceRef dev;         // device handle
+static __thread unsigned char transfer_buf[42];      // device buffer
+static __thread unsigned char receive_buf[42];       // receive buffer
+static __thread volatile int nbytes_received = 0;    // receive result
 
 //
 // Send a request to the device.
@@ -115,6 +115,29 @@ again:
     memcpy(rdata, receive_buf+4, rlength);
 }
 
+//
+// Discard replies, which came too late.
+//
+void hid_flush()
+{
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.05, false);
+    nbytes_received = 0;
+}
+
+//
+// Send a sequence of requests, one by one.
+// Every request has nbytes of data, every reply has rlength bytes.
+//
+void hid_send_recv_multi(int count, const unsigned char *data, unsigned nbytes,
+    unsigned char *rdata, unsigned rlength)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        hid_send_recv(data + i*nbytes, nbytes, rdata + i*rlength, rlength);
+    }
+}
+
 //
 // Callback: data is received from the HID device
 //
@@ -171,6 +194,11 @@ static void callback_close(void *ontext,
 //
 int hid_init(int vid, int pid)
 {
+    if (device_index > 0) {
+        // Only one radio is supported, see hid_count().
+        return -1;
+    }
+
     // Create the USB HID Manager.
     IOHIDManagerRef HIDManager = IOHIDManagerCreate(kCFAllocatorDefault,
                                                     kIOHIDOptionsTypeNone);
@@ -231,3 +259,32 @@ void hid_close()
     IOHIDDeviceClose(dev, kIOHIDOptionsTypeNone);
     dev = 0;
 }
+
+//
+// Get the number of attached radios with given vid:pid.
+// HID devices are served by the main run loop,
+// so at most one radio is reported.
+//
+int hid_count(int vid, int pid)
+{
+    IOHIDManagerRef HIDManager = IOHIDManagerCreate(kCFAllocatorDefault,
+                                                    kIOHIDOptionsTypeNone);
+    CFMutableDictionaryRef matchDict = CFDictionaryCreateMutable(kCFAllocatorDefault,
+        2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue(matchDict, CFSTR(kIOHIDVendorIDKey), CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &vid));
+    CFDictionarySetValue(matchDict, CFSTR(kIOHIDProductIDKey), CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &pid));
+    IOHIDManagerSetDeviceMatching(HIDManager, matchDict);
+    CFRelease(matchDict);
+
+    int n = 0;
+    if (IOHIDManagerOpen(HIDManager, kIOHIDOptionsTypeNone) == kIOReturnSuccess) {
+        CFSetRef devices = IOHIDManagerCopyDevices(HIDManager);
+        if (devices) {
+            n = CFSetGetCount(devices);
+            CFRelease(devices);
+        }
+        IOHIDManagerClose(HIDManager, kIOHIDOptionsTypeNone);
+    }
+    CFRelease(HIDManager);
+    return (n > 1) ? 1 : n;
+}
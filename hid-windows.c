@@ -35,8 +35,8 @@
 #include <stdint.h>
 #include "util.h"
 
-HANDLE dev = INVALID_HANDLE_VALUE;          // HID device
-static unsigned char receive_buf[42];       // receive buffer
+__thread HANDLE dev = INVALID_HANDLE_VALUE;        // HID device
+static __thread unsigned char receive_buf[42];       // receive buffer
 
 //
 // Send a request to the device.
@@ -109,25 +109,49 @@ void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rd
 }
 
 //
-// Open the radio in programming mode.
+// Discard replies, which came too late.
+//
+void hid_flush()
+{
+    HidD_FlushQueue(dev);
+}
+
+//
+// Send a sequence of requests, one by one.
+// Every request has nbytes of data, every reply has rlength bytes.
+//
+void hid_send_recv_multi(int count, const unsigned char *data, unsigned nbytes,
+    unsigned char *rdata, unsigned rlength)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        hid_send_recv(data + i*nbytes, nbytes, rdata + i*rlength, rlength);
+    }
+}
+
+//
 // Find a HID device with given GUID, vendor ID and product ID.
-// Setup `dev' file descriptor.
+// Skip the first `skip' matching devices.
+// With `exclusive' set, return the device handle, opened for i/o.
+// Otherwise return the handle opened for query only: it does not
+// take the device from another session.
 //
-int hid_init(int vid, int pid)
+static HANDLE open_device(int vid, int pid, int skip, int exclusive)
 {
     static GUID guid = { 0x4d1e55b2, 0xf16f, 0x11cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+    HANDLE h = INVALID_HANDLE_VALUE;
 
     HDEVINFO devinfo = SetupDiGetClassDevs(&guid, NULL, NULL, DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
     if (devinfo == INVALID_HANDLE_VALUE) {
         printf("Cannot get devinfo!\n");
-        return -1;
+        return INVALID_HANDLE_VALUE;
     }
 
     // Loop through available devices with a given GUID.
     int index;
     SP_INTERFACE_DEVICE_DATA iface;
     iface.cbSize = sizeof(iface);
-    dev = INVALID_HANDLE_VALUE;
     for (index=0; SetupDiEnumDeviceInterfaces(devinfo, NULL, &guid, index, &iface); ++index) {
 
         // Obtain a required size of device detail structure.
@@ -146,30 +170,55 @@ int hid_init(int vid, int pid)
         }
         //printf("Device %d: path %s\n", index, detail->DevicePath);
 
-        dev = CreateFile(detail->DevicePath, GENERIC_WRITE | GENERIC_READ,
-            0, NULL, OPEN_EXISTING, 0, NULL);
-        if (dev == INVALID_HANDLE_VALUE) {
+        // Open for query only: this succeeds even when
+        // the device is already in use by another session.
+        h = CreateFile(detail->DevicePath, 0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
             continue;
         }
 
         // Get the Vendor ID and Product ID for this device.
         HIDD_ATTRIBUTES attrib;
         attrib.Size = sizeof(HIDD_ATTRIBUTES);
-        HidD_GetAttributes(dev, &attrib);
+        HidD_GetAttributes(h, &attrib);
+        CloseHandle(h);
+        h = INVALID_HANDLE_VALUE;
         //printf("Vendor/Product: %04x %04x\n", attrib.VendorID, attrib.ProductID);
 
         // Check the VID/PID.
         if (attrib.VendorID != vid || attrib.ProductID != pid) {
-            CloseHandle(dev);
-            dev = INVALID_HANDLE_VALUE;
+            continue;
+        }
+        if (skip-- > 0) {
             continue;
         }
 
         // Required device found.
+        if (! exclusive) {
+            h = CreateFile(detail->DevicePath, 0,
+                FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+            break;
+        }
+        h = CreateFile(detail->DevicePath, GENERIC_WRITE | GENERIC_READ,
+            0, NULL, OPEN_EXISTING, 0, NULL);
+
+        // The device path includes the instance of the USB port.
+        snprintf(device_identity, sizeof(device_identity), "path %016llx",
+            hash_fnv(0, (unsigned char*) detail->DevicePath, strlen(detail->DevicePath)));
         break;
     }
     SetupDiDestroyDeviceInfoList(devinfo);
+    return h;
+}
 
+//
+// Open the radio in programming mode.
+// Setup `dev' file descriptor.
+//
+int hid_init(int vid, int pid)
+{
+    dev = open_device(vid, pid, device_index, 1);
     if (dev == INVALID_HANDLE_VALUE) {
         if (trace_flag) {
             fprintf(stderr, "Cannot find HID device %04x:%04x\n", vid, pid);
@@ -179,6 +228,22 @@ int hid_init(int vid, int pid)
     return 0;
 }
 
+//
+// Get the number of attached radios with given vid:pid.
+// Radios are opened for query only, so those in use are counted too.
+//
+int hid_count(int vid, int pid)
+{
+    HANDLE h;
+    int n = 0;
+
+    while ((h = open_device(vid, pid, n, 0)) != INVALID_HANDLE_VALUE) {
+        CloseHandle(h);
+        n++;
+    }
+    return n;
+}
+
 //
 // Close HID device.
 //
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "radio.h"
 #include "util.h"
 
 static const unsigned char CMD_PRG[]   = "\2PROGRA";
@@ -41,14 +42,17 @@ static const unsigned char CMD_ENDW[]  = "ENDW";
 static const unsigned char CMD_CWB0[]  = "CWB\4\0\0\0\0";
 static const unsigned char CMD_CWB1[]  = "CWB\4\0\1\0\0";
 
-static unsigned offset = 0;                 // CWD offset
+static __thread unsigned offset = 0;                 // CWD offset
+
+#define MAXREQ  8                           // max requests per block
+#define MAXRETRY 3                          // max retries of a request
 
 //
 // Query and return the device identification string.
 //
 const char *hid_identify()
 {
-    static unsigned char reply[38];
+    static __thread unsigned char reply[38];
     unsigned char ack;
 
     hid_send_recv(CMD_PRG, 7, &ack, 1);
@@ -78,11 +82,12 @@ const char *hid_identify()
     return (char*)reply;
 }
 
-void hid_read_block(int bno, unsigned char *data, int nbytes)
+//
+// Select memory bank for the given address.
+//
+static void select_bank(unsigned addr)
 {
-    unsigned addr = bno * nbytes;
-    unsigned char ack, cmd[4], reply[32+4];
-    int n;
+    unsigned char ack;
 
     if (addr < 0x10000 && offset != 0) {
         offset = 0;
@@ -101,14 +106,53 @@ void hid_read_block(int bno, unsigned char *data, int nbytes)
             exit(-1);
         }
     }
+}
 
-    for (n=0; n<nbytes; n+=32) {
-        cmd[0] = CMD_READ[0];
-        cmd[1] = (addr + n) >> 8;
-        cmd[2] = addr + n;
-        cmd[3] = 32;
-        hid_send_recv(cmd, 4, reply, sizeof(reply));
-        memcpy(data + n, reply + 4, 32);
+//
+// Read a block of data.
+// All read requests of the block are sent without waiting
+// for replies. Every reply is matched by address: in case of
+// mismatch the request is repeated.
+//
+void hid_read_block(int bno, unsigned char *data, int nbytes)
+{
+    unsigned addr = bno * nbytes;
+    unsigned char cmd[MAXREQ][4], reply[MAXREQ][32+4];
+    int n, i, retry, count = nbytes / 32;
+
+    if (count > MAXREQ) {
+        fprintf(stderr, "%s: Block size %d is too large\n", __func__, nbytes);
+        exit(-1);
+    }
+    select_bank(addr);
+
+    for (i=0; i<count; i++) {
+        n = i * 32;
+        cmd[i][0] = CMD_READ[0];
+        cmd[i][1] = (addr + n) >> 8;
+        cmd[i][2] = addr + n;
+        cmd[i][3] = 32;
+    }
+    hid_send_recv_multi(count, cmd[0], 4, reply[0], sizeof(reply[0]));
+
+    for (i=0; i<count; i++) {
+        n = i * 32;
+        for (retry=0; reply[i][1] != cmd[i][1] || reply[i][2] != cmd[i][2]; retry++) {
+            if (retry >= MAXRETRY) {
+                fprintf(stderr, "%s: No reply for address %#x\n",
+                    __func__, (addr + n) & 0xffff);
+                exit(-1);
+            }
+            if (trace_flag > 0) {
+                fprintf(stderr, "%s: Reply for address %#x instead of %#x, retry\n",
+                    __func__, reply[i][1] << 8 | reply[i][2], (addr + n) & 0xffff);
+            }
+
+            // Drop stale replies, to get in sync with the device.
+            hid_flush();
+            hid_send_recv(cmd[i], 4, reply[i], sizeof(reply[i]));
+        }
+        memcpy(data + n, reply[i] + 4, 32);
     }
 }
 
@@ -118,23 +162,7 @@ void hid_write_block(int bno, unsigned char *data, int nbytes)
     unsigned char ack, cmd[4+32];
     int n;
 
-    if (addr < 0x10000 && offset != 0) {
-        offset = 0;
-        hid_send_recv(CMD_CWB0, 8, &ack, 1);
-        if (ack != CMD_ACK[0]) {
-            fprintf(stderr, "%s: Wrong acknowledge %#x, expected %#x\n",
-                __func__, ack, CMD_ACK[0]);
-            exit(-1);
-        }
-    } else if (addr >= 0x10000 && offset == 0) {
-        offset = 0x00010000;
-        hid_send_recv(CMD_CWB1, 8, &ack, 1);
-        if (ack != CMD_ACK[0]) {
-            fprintf(stderr, "%s: Wrong acknowledge %#x, expected %#x\n",
-                __func__, ack, CMD_ACK[0]);
-            exit(-1);
-        }
-    }
+    select_bank(addr);
 
     for (n=0; n<nbytes; n+=32) {
         cmd[0] = CMD_WRITE[0];
@@ -149,6 +177,7 @@ void hid_write_block(int bno, unsigned char *data, int nbytes)
             exit(-1);
         }
     }
+    radio_written(data, nbytes);
 }
 
 void hid_read_finish()
@@ -172,3 +201,84 @@ void hid_write_finish()
             __func__, ack, CMD_ACK[0]);
     }
 }
+
+//
+// States of HID blocks on download.
+//
+enum {
+    BLOCK_UNREAD,
+    BLOCK_READ,
+    BLOCK_SKIPPED,
+};
+
+//
+// Read blocks of HID device (GD-77, RD-5R or DM-1801), which contain
+// used data.  Header ranges (bitmaps and such) are read first,
+// and the driver marks unused entries based on them.
+//
+void hid_read_used_blocks(int first, int last, const hid_range_t *headers,
+    void (*mark_unused)(unsigned char *unused), void (*erase_unused)(const unsigned char *state))
+{
+    unsigned char *unused, *state;
+    const hid_range_t *h;
+    int bno, nskipped = 0;
+
+    unused = calloc(last, 128);
+    state = calloc(last, 1);
+    if (! unused || ! state) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+
+    // Read headers.
+    for (h=headers; h->length; h++) {
+        for (bno = h->offset/128; bno <= (h->offset + h->length - 1)/128; bno++) {
+            if (state[bno] == BLOCK_UNREAD) {
+                hid_read_block(bno, &radio_mem[bno*128], 128);
+                state[bno] = BLOCK_READ;
+            }
+        }
+    }
+    mark_unused(unused);
+
+    for (bno=first; bno<last; bno++) {
+        if (bno >= 248 && bno < 256) {
+            // Skip range 0x7c00...0x8000.
+            continue;
+        }
+        if (state[bno] == BLOCK_UNREAD) {
+            if (memchr(&unused[bno*128], 0, 128)) {
+                hid_read_block(bno, &radio_mem[bno*128], 128);
+                state[bno] = BLOCK_READ;
+            } else {
+                state[bno] = BLOCK_SKIPPED;
+                nskipped++;
+            }
+        }
+
+        ++radio_progress;
+        if (radio_progress % 32 == 0) {
+            fprintf(stderr, "#");
+            fflush(stderr);
+        }
+    }
+
+    // Fill unused entries.
+    erase_unused(state);
+    free(unused);
+    free(state);
+    if (trace_flag)
+        printf("Skipped %d unused blocks.\n", nskipped);
+}
+
+int hid_is_skipped(const unsigned char *state, const void *item, int nbytes)
+{
+    unsigned offset = (const unsigned char*) item - radio_mem;
+    unsigned bno;
+
+    for (bno = offset/128; bno <= (offset + nbytes - 1)/128; bno++) {
+        if (state[bno] == BLOCK_SKIPPED)
+            return 1;
+    }
+    return 0;
+}
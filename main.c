@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include "radio.h"
 #include "util.h"
 
@@ -38,6 +39,11 @@ extern char *optarg;
 extern int optind;
 
 int trace_flag = 0;
+int verify_blank_flag = 0;
+int cache_flag = 0;
+int resume_flag = 0;
+int archive_flag = 0;
+int dry_run_flag = 0;
 
 void usage()
 {
@@ -46,15 +52,25 @@ void usage()
     fprintf(stderr, "    dmrconfig -r [-t]\n");
     fprintf(stderr, "                         Read codeplug from the radio to a file 'device.img'.\n");
     fprintf(stderr, "                         Save configuration to a text file 'device.conf'.\n");
-    fprintf(stderr, "    dmrconfig -w [-t] file.img\n");
+    fprintf(stderr, "    dmrconfig -w [-t] [--resume] file.img\n");
     fprintf(stderr, "                         Write codeplug to the radio.\n");
+    fprintf(stderr, "    dmrconfig -r -F [-t]\n");
+    fprintf(stderr, "                         Read all attached radios in parallel.\n");
+    fprintf(stderr, "                         Save files 'device-1.img', 'device-1.conf' and so on.\n");
+    fprintf(stderr, "    dmrconfig -w -F [-t] file.img\n");
+    fprintf(stderr, "                         Write codeplug to all attached radios in parallel.\n");
+    fprintf(stderr, "    dmrconfig -S [-t] file.img\n");
+    fprintf(stderr, "                         Write codeplug to every radio, as it is plugged in.\n");
     fprintf(stderr, "    dmrconfig -v [-t] file.conf\n");
     fprintf(stderr, "                         Verify configuration script for the radio.\n");
-    fprintf(stderr, "    dmrconfig -c [-t] file.conf\n");
+    fprintf(stderr, "    dmrconfig -c [-t] [-f] file.conf\n");
     fprintf(stderr, "                         Apply configuration script to the radio.\n");
     fprintf(stderr, "    dmrconfig -c file.img file.conf\n");
     fprintf(stderr, "                         Apply configuration script to the codeplug image.\n");
     fprintf(stderr, "                         Store modified copy to a file 'device.img'.\n");
+    fprintf(stderr, "    dmrconfig -B [-t] manifest\n");
+    fprintf(stderr, "                         Apply configuration scripts to codeplug images in parallel.\n");
+    fprintf(stderr, "                         Every line of manifest: template.img file.conf output.img\n");
     fprintf(stderr, "    dmrconfig file.img\n");
     fprintf(stderr, "                         Display configuration from the codeplug image.\n");
     fprintf(stderr, "    dmrconfig -u [-t] file.csv\n");
@@ -67,25 +83,65 @@ void usage()
     fprintf(stderr, "    -u           Update contacts database.\n");
     fprintf(stderr, "    -l           List all supported radios.\n");
     fprintf(stderr, "    -t           Trace USB protocol.\n");
+    fprintf(stderr, "    -b           Verify that blank blocks, skipped on write, are erased.\n");
+    fprintf(stderr, "    -f, --full   Write the whole codeplug, not only the changes.\n");
+    fprintf(stderr, "    -F, --fleet  Read or write all attached radios.\n");
+    fprintf(stderr, "    -S, --station Write all radios, as they are attached.\n");
+    fprintf(stderr, "    -B, --batch  Apply configuration scripts listed in manifest.\n");
+    fprintf(stderr, "    --cache      Use a cached codeplug when the radio fingerprint matches.\n");
+    fprintf(stderr, "    --resume     Continue interrupted write of the codeplug.\n");
+    fprintf(stderr, "    --archive    Save codeplug images in compressed format.\n");
+    fprintf(stderr, "    --dry-run    With -w or -c, print what would be written to the radio.\n");
+    fprintf(stderr, "    --port path  Serial port of the radio, instead of USB lookup.\n");
+    fprintf(stderr, "    --window N   Maximum number of serial read requests in flight.\n");
     exit(-1);
 }
 
+static const struct option long_options[] = {
+    { "full", no_argument, 0, 'f' },
+    { "fleet", no_argument, 0, 'F' },
+    { "station", no_argument, 0, 'S' },
+    { "batch", no_argument, 0, 'B' },
+    { "cache", no_argument, &cache_flag, 1 },
+    { "resume", no_argument, &resume_flag, 1 },
+    { "archive", no_argument, &archive_flag, 1 },
+    { "dry-run", no_argument, &dry_run_flag, 1 },
+    { "port", required_argument, 0, 'P' },
+    { "window", required_argument, 0, 'W' },
+    { 0, 0, 0, 0 },
+};
+
 int main(int argc, char **argv)
 {
     int read_flag = 0, write_flag = 0, config_flag = 0, csv_flag = 0;
-    int list_flag = 0, verify_flag = 0;
+    int list_flag = 0, verify_flag = 0, full_flag = 0, fleet_flag = 0;
+    int station_flag = 0, batch_flag = 0;
 
     copyright = "Copyright (C) 2018 Serge Vakulenko KK6ABQ";
     trace_flag = 0;
     for (;;) {
-        switch (getopt(argc, argv, "tcwrulv")) {
+        switch (getopt_long(argc, argv, "tcwrulvbfFSB", long_options, 0)) {
         case 't': ++trace_flag;  continue;
         case 'r': ++read_flag;   continue;
         case 'w': ++write_flag;  continue;
         case 'c': ++config_flag; continue;
         case 'u': ++csv_flag;    continue;
         case 'l': ++list_flag;   continue;
+        case 'b': ++verify_blank_flag; continue;
+        case 'f': ++full_flag;   continue;
+        case 'F': ++fleet_flag;  continue;
+        case 'S': ++station_flag; continue;
+        case 'B': ++batch_flag;  continue;
+        case 'P': serial_port = optarg; continue;
+        case 'W':
+            serial_window = strtol(optarg, 0, 0);
+            if (serial_window < 1) {
+                fprintf(stderr, "Bad window size: %s\n", optarg);
+                usage();
+            }
+            continue;
 	case 'v': ++verify_flag; continue;
+        case 0:                  continue;
         default:
             usage();
         case EOF:
@@ -99,18 +155,65 @@ int main(int argc, char **argv)
         radio_list();
         exit(0);
     }
-    if (read_flag + write_flag + config_flag + csv_flag + verify_flag > 1) {
-        fprintf(stderr, "Only one of -r, -w, -c, -v or -u options is allowed.\n");
+    if (read_flag + write_flag + config_flag + csv_flag + verify_flag + station_flag + batch_flag > 1) {
+        fprintf(stderr, "Only one of -r, -w, -c, -v, -u, --station or --batch options is allowed.\n");
+        usage();
+    }
+    if (resume_flag && (! write_flag || fleet_flag)) {
+        fprintf(stderr, "Option --resume is allowed only with -w.\n");
+        usage();
+    }
+    if (dry_run_flag && ((! write_flag && ! config_flag) || fleet_flag)) {
+        fprintf(stderr, "Option --dry-run is allowed only with -w or -c.\n");
+        usage();
+    }
+    if (fleet_flag && ! read_flag && ! write_flag) {
+        fprintf(stderr, "Option -F is allowed only with -r or -w.\n");
         usage();
     }
     setvbuf(stdout, 0, _IOLBF, 0);
     setvbuf(stderr, 0, _IOLBF, 0);
 
-    if (write_flag) {
+    if (batch_flag) {
+        // Apply configuration scripts to codeplug images.
+        if (argc != 1)
+            usage();
+
+        if (radio_batch(argv[0]) > 0)
+            exit(-1);
+
+    } else if (station_flag) {
+        // Program radios as they are plugged in.
+        if (argc != 1)
+            usage();
+
+        radio_read_image(argv[0]);
+        radio_print_version(stdout);
+        radio_station();
+
+    } else if (fleet_flag) {
+        // Program all attached radios.
+        if (argc != write_flag)
+            usage();
+
+        if (write_flag) {
+            radio_read_image(argv[0]);
+            radio_print_version(stdout);
+        }
+        if (radio_fleet(write_flag) > 0)
+            exit(-1);
+
+    } else if (write_flag) {
         // Restore image file to device.
         if (argc != 1)
             usage();
 
+        if (dry_run_flag) {
+            // No need for the radio.
+            radio_read_image(argv[0]);
+            radio_print_plan(0);
+            exit(0);
+        }
         radio_connect();
         radio_read_image(argv[0]);
         radio_print_version(stdout);
@@ -137,7 +240,10 @@ int main(int argc, char **argv)
             radio_save_image("backup.img");
             radio_parse_config(argv[0]);
             radio_verify_config();
-            radio_upload(1);
+            if (dry_run_flag)
+                radio_print_plan(! full_flag);
+            else
+                radio_upload(! full_flag);
             radio_disconnect();
         }
 
@@ -30,7 +30,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/stat.h>
 #include "radio.h"
 #include "util.h"
 
@@ -382,12 +381,19 @@ static void md380_download(radio_device_t *radio)
 //
 static void md380_upload(radio_device_t *radio, int cont_flag)
 {
-    int bno;
+    int bno, nskipped = 0;
 
+    if (cont_flag || radio_journal_resumed()) {
+        dfu_upload_changed_sectors(MEMSZ, cont_flag);
+        return;
+    }
     dfu_erase(0, MEMSZ);
 
     for (bno=0; bno<MEMSZ/1024; bno++) {
-        dfu_write_block(bno, &radio_mem[bno*1024], 1024);
+        if (! dfu_write_erased_block(bno, &radio_mem[bno*1024], 1024))
+            nskipped++;
+        if (bno % 64 == 63)
+            radio_journal_commit(bno / 64);
 
         ++radio_progress;
         if (radio_progress % 32 == 0) {
@@ -395,6 +401,7 @@ static void md380_upload(radio_device_t *radio, int cont_flag)
             fflush(stderr);
         }
     }
+    fprintf(stderr, " %d blank blocks skipped,", nskipped);
 }
 
 //
@@ -1271,35 +1278,22 @@ static void md380_print_config(radio_device_t *radio, FILE *out, int verbose)
 
 //
 // Read memory image from the binary file.
+// File contents are already loaded into radio_mem.
 //
-static void md380_read_image(radio_device_t *radio, FILE *img)
+static void md380_read_image(radio_device_t *radio, unsigned size)
 {
-    struct stat st;
-
-    // Guess device type by file size.
-    if (fstat(fileno(img), &st) < 0) {
-        fprintf(stderr, "Cannot get file size.\n");
-        exit(-1);
-    }
-    switch (st.st_size) {
+    switch (size) {
     case MEMSZ:
         // IMG file.
-        if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
         break;
     case MEMSZ + 0x225 + 0x10:
         // RTD file.
         // Header 0x225 bytes and footer 0x10 bytes at 0x40225.
-        fseek(img, 0x225, SEEK_SET);
-        if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
+        radio_image_skip(0, 0x225);
+        radio_image_skip(MEMSZ, 0x10);
         break;
     default:
-        fprintf(stderr, "Unrecognized file size %u bytes.\n", (int) st.st_size);
+        fprintf(stderr, "Unrecognized file size %u bytes.\n", size);
         exit(-1);
     }
 }
@@ -1525,7 +1519,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         }
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
         erase_zones();
@@ -1536,7 +1530,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, SQ_NORMAL, tot, rxonly, admit,
         colorcode, timeslot, grouplist, contact, 0xffff, 0xffff, BW_12_5_KHZ);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -1659,7 +1653,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
     }
@@ -1668,7 +1662,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, squelch, tot, rxonly, admit,
         1, 1, 0, 0, rxtone, txtone, width);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -2096,6 +2090,28 @@ static void md380_update_timestamp(radio_device_t *radio)
     }
 }
 
+//
+// Compute fingerprint of the codeplug: timestamp and a few sampled blocks.
+// With read_flag, read these blocks from the radio first.
+//
+static unsigned long long md380_fingerprint(radio_device_t *radio, int read_flag)
+{
+    static const unsigned sample[] = {
+        OFFSET_TIMESTMP, OFFSET_CONTACTS, OFFSET_GLISTS, OFFSET_ZONES, OFFSET_CHANNELS,
+    };
+    unsigned long long hash = 0;
+    int i;
+
+    for (i=0; i<sizeof(sample)/sizeof(sample[0]); i++) {
+        int bno = sample[i] / 1024;
+
+        if (read_flag)
+            dfu_read_block(bno, &radio_mem[bno*1024], 1024);
+        hash = hash_fnv(hash, &radio_mem[bno*1024], 1024);
+    }
+    return hash;
+}
+
 //
 // Check that configuration is correct.
 // Return 0 on error.
@@ -2251,6 +2267,7 @@ radio_device_t radio_md380 = {
     md380_parse_header,
     md380_parse_row,
     md380_update_timestamp,
+    md380_fingerprint,
     //TODO: md380_write_csv,
 };
 
@@ -2271,6 +2288,7 @@ radio_device_t radio_md390 = {
     md380_parse_header,
     md380_parse_row,
     md380_update_timestamp,
+    md380_fingerprint,
     //TODO: md380_write_csv,
 };
 
@@ -2291,6 +2309,7 @@ radio_device_t radio_d900 = {
     md380_parse_header,
     md380_parse_row,
     md380_update_timestamp,
+    md380_fingerprint,
 };
 
 //
@@ -2310,6 +2329,7 @@ radio_device_t radio_dp880 = {
     md380_parse_header,
     md380_parse_row,
     md380_update_timestamp,
+    md380_fingerprint,
 };
 
 //
@@ -2329,4 +2349,5 @@ radio_device_t radio_rt27d = {
     md380_parse_header,
     md380_parse_row,
     md380_update_timestamp,
+    md380_fingerprint,
 };
@@ -32,6 +32,15 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <errno.h>
+#if ! defined(__WIN32__) && ! defined(WIN32)
+#   include <sys/mman.h>
+#   include <sys/wait.h>
+#   include <poll.h>
+#   define FLEET_FORK                       // One process per radio
+#endif
 #include "radio.h"
 #include "util.h"
 
@@ -58,98 +67,1700 @@ static struct {
     { 0, 0 }
 };
 
-unsigned char radio_mem [1024*1024*2];  // Radio memory contents, up to 2 Mbytes
-int radio_progress;                     // Read/write progress counter
+static unsigned char default_mem [RADIO_MEMSZ];
+static unsigned char default_orig [RADIO_MEMSZ];
 
-static radio_device_t *device;          // Device-dependent interface
+static dmr_session_t default_session = {   // Session of the main thread
+    0, default_mem, default_orig, 0, 0,
+};
+
+__thread dmr_session_t *dmr_session = &default_session;
+
+//
+// Allocate a new programming session.
+//
+dmr_session_t *dmr_session_create(dmr_session_t *parent)
+{
+    dmr_session_t *s = calloc(1, sizeof(dmr_session_t));
+
+    if (!s) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    if (parent) {
+        s->device = parent->device;
+        s->mem = parent->mem;
+        s->shared = 1;
+    } else {
+        s->mem = calloc(1, RADIO_MEMSZ);
+    }
+    s->orig = calloc(1, RADIO_MEMSZ);
+    if (!s->mem || !s->orig) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    return s;
+}
+
+//
+// Release memory contents of the session: unmap the image file,
+// or free the buffer.
+//
+static void session_release(dmr_session_t *s)
+{
+#if ! defined(__WIN32__) && ! defined(WIN32)
+    if (s->map)
+        munmap(s->map, s->map_size);
+    else
+#endif
+    if (! s->shared && s->mem != default_mem)
+        free(s->mem);
+    s->mem = 0;
+    s->map = 0;
+    s->map_size = 0;
+    s->shared = 0;
+}
+
+//
+// Deallocate the session.
+//
+void dmr_session_destroy(dmr_session_t *s)
+{
+    if (s == dmr_session)
+        dmr_session = &default_session;
+    if (s != &default_session) {
+        session_release(s);
+        free(s->orig);
+        free(s);
+    }
+}
+
+//
+// Make the session current for the calling thread.
+//
+void dmr_session_select(dmr_session_t *s)
+{
+    dmr_session = s;
+}
+
+//
+// Close the serial port.
+//
+void radio_disconnect()
+{
+    fprintf(stderr, "Close device.\n");
+
+    // Restore the normal radio mode.
+    dfu_reboot();
+    dfu_close();
+    hid_close();
+    serial_close();
+}
+
+//
+// Print a generic information about the device.
+//
+void radio_print_version(FILE *out)
+{
+    dmr_session->device->print_version(dmr_session->device, out);
+}
+
+//
+// USB ports of supported radios, probed in this order.
+//
+enum {
+    PORT_DFU,                               // TYT MD family
+    PORT_HID,                               // RD-5R, DM-1801 and GD-77
+    PORT_SERIAL,                            // AT-D868UV
+    NPORTS
+};
+
+static const struct {
+    unsigned vid, pid;
+} port_tab[NPORTS] = {
+    { 0x0483, 0xdf11 },
+    { 0x15a2, 0x0073 },
+    { 0x28e9, 0x018a },
+};
+
+//
+// Open the port and get the radio identifier.
+// Return 0 when no radio is attached.
+//
+static const char *port_open(int port)
+{
+    unsigned vid = port_tab[port].vid;
+    unsigned pid = port_tab[port].pid;
+
+    switch (port) {
+    case PORT_DFU:
+        return dfu_init(vid, pid);
+    case PORT_HID:
+        if (hid_init(vid, pid) >= 0)
+            return hid_identify();
+        break;
+    case PORT_SERIAL:
+        if (serial_init(vid, pid) >= 0)
+            return serial_identify();
+        break;
+    }
+    return 0;
+}
+
+//
+// Get the number of radios attached to the port.
+//
+static int port_count(int port)
+{
+    unsigned vid = port_tab[port].vid;
+    unsigned pid = port_tab[port].pid;
+
+    switch (port) {
+    case PORT_DFU:
+        return dfu_count(vid, pid);
+    case PORT_HID:
+        return hid_count(vid, pid);
+    case PORT_SERIAL:
+        return serial_count(vid, pid);
+    }
+    return 0;
+}
+
+//
+// Count radios on all ports in one pass over the USB devices.
+// When the list of USB devices is not available, query every port.
+//
+static void scan_ports(int count[NPORTS])
+{
+    unsigned vid[NPORTS], pid[NPORTS];
+    int port;
+
+    for (port=0; port<NPORTS; port++) {
+        vid[port] = port_tab[port].vid;
+        pid[port] = port_tab[port].pid;
+    }
+    if (serial_port) {
+        // Port given explicitly: talk to nothing else.
+        for (port=0; port<NPORTS; port++)
+            count[port] = 0;
+        count[PORT_SERIAL] = 1;
+    } else if (usb_scan(NPORTS, vid, pid, count) < 0) {
+        for (port=0; port<NPORTS; port++)
+            count[port] = port_count(port);
+    }
+    if (trace_flag) {
+        for (port=0; port<NPORTS; port++) {
+            if (count[port] > 0)
+                printf("Found %d radios %04x:%04x\n", count[port], vid[port], pid[port]);
+        }
+    }
+}
+
+//
+// Find device by identifier.
+//
+static radio_device_t *find_device(const char *ident)
+{
+    int i;
+
+    for (i=0; radio_tab[i].ident; i++) {
+        if (strcasecmp(ident, radio_tab[i].ident) == 0)
+            return radio_tab[i].device;
+    }
+    return 0;
+}
+
+//
+// Connect to the radio and identify the type of device.
+//
+void radio_connect()
+{
+    const char *ident = 0;
+    int port, count[NPORTS];
+    struct timeval t0, t1;
+
+    gettimeofday(&t0, 0);
+    scan_ports(count);
+
+    // Open only the port with a radio attached.
+    for (port=0; port<NPORTS && !ident; port++) {
+        if (count[port] > 0)
+            ident = port_open(port);
+    }
+    if (! ident) {
+        fprintf(stderr, "No radio detected.\n");
+        fprintf(stderr, "Check your USB cable!\n");
+        exit(-1);
+    }
+
+    dmr_session->device = find_device(ident);
+    if (! dmr_session->device) {
+        fprintf(stderr, "Unrecognized radio '%s'.\n", ident);
+        exit(-1);
+    }
+    fprintf(stderr, "Connect to %s.\n", dmr_session->device->name);
+
+    if (trace_flag) {
+        gettimeofday(&t1, 0);
+        printf("Connect latency: %.1f msec\n",
+            (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0);
+    }
+}
+
+//
+// Fleet mode: one worker thread per attached radio.
+//
+enum {
+    UNIT_WAITING,                           // Not started yet
+    UNIT_BUSY,                              // Transfer in progress
+    UNIT_DONE,                              // Completed successfully
+    UNIT_FAILED,                            // Error
+};
+
+typedef struct {
+    int port;                               // PORT_DFU, PORT_HID or PORT_SERIAL
+    int index;                              // Index among radios on this port
+    unsigned location;                      // USB bus and address, or 0
+    char where[32];                         // Physical USB port
+    int status;                             // UNIT_xxx
+    double seconds;                         // Time of transfer
+    const char *name;                       // Detected radio type
+    const char *error;                      // Reason of failure
+    dmr_session_t *session;                 // Image and state of the radio
+#ifdef FLEET_FORK
+    pid_t pid;
+#else
+    pthread_t thread;
+#endif
+} fleet_unit_t;
+
+static fleet_unit_t *fleet;                 // Array of radios
+static int fleet_size;                      // Number of radios
+static int fleet_write;                     // Upload the image, or download
+
+//
+// Save the image and configuration of the radio, read in fleet mode.
+//
+static void fleet_save(int num)
+{
+    char filename[32];
+    FILE *conf;
+
+    sprintf(filename, "device-%d.img", num);
+    radio_save_image(filename);
+
+    sprintf(filename, "device-%d.conf", num);
+    printf("Print configuration to file '%s'.\n", filename);
+    conf = fopen(filename, "w");
+    if (!conf) {
+        perror(filename);
+        exit(-1);
+    }
+    radio_print_config(conf, 1);
+    fclose(conf);
+}
+
+//
+// Worker: read or write one radio.
+//
+static void *fleet_worker(void *arg)
+{
+    fleet_unit_t *u = arg;
+    radio_device_t *device;
+    const char *ident;
+    struct timeval t0, t1;
+
+    gettimeofday(&t0, 0);
+    dmr_session_select(u->session);
+    device_index = u->index;
+    device_location = u->location;
+    u->status = UNIT_BUSY;
+
+    ident = port_open(u->port);
+    if (! ident) {
+        u->error = "cannot connect";
+        goto failed;
+    }
+    device = find_device(ident);
+    if (! device) {
+        u->error = "unrecognized radio";
+        goto failed;
+    }
+    u->name = device->name;
+    if (fleet_write) {
+        // Radios of another type are left untouched.
+        // Same check as for a single radio: the image must belong
+        // to the same family of radios, and pass the driver test.
+        if (! radio_is_compatible(device->name) ||
+            ! u->session->device->is_compatible(u->session->device)) {
+            u->error = "incompatible image";
+            goto failed;
+        }
+        u->session->device->upload(u->session->device, 0);
+    } else {
+        u->session->device = device;
+        device->download(device);
+    }
+    dfu_reboot();
+    dfu_close();
+    hid_close();
+    serial_close();
+    if (! fleet_write)
+        fleet_save(u - fleet + 1);
+    gettimeofday(&t1, 0);
+    u->seconds = t1.tv_sec - t0.tv_sec + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+    u->status = UNIT_DONE;
+    return 0;
+
+failed:
+    dfu_close();
+    hid_close();
+    serial_close();
+    u->status = UNIT_FAILED;
+    return 0;
+}
+
+//
+// Allocate descriptors of n radios, zeroed.  With one process per radio,
+// they are placed in shared memory, so that the parent sees the status.
+//
+static fleet_unit_t *fleet_alloc(int n)
+{
+    fleet_unit_t *u;
+
+#ifdef FLEET_FORK
+    u = mmap(0, n * sizeof(fleet_unit_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (u == MAP_FAILED)
+        u = 0;
+#else
+    u = calloc(n, sizeof(fleet_unit_t));
+#endif
+    if (!u) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    return u;
+}
+
+static void fleet_free(fleet_unit_t *u, int n)
+{
+#ifdef FLEET_FORK
+    munmap(u, n * sizeof(fleet_unit_t));
+#else
+    free(u);
+#endif
+}
+
+//
+// Start the worker for the radio.
+// Every radio is served by a separate process, so that a fatal error,
+// which calls exit(), fails only this radio.  On Windows, a thread
+// is started instead, and a fatal error terminates all transfers.
+//
+static void fleet_start(fleet_unit_t *u)
+{
+#ifdef FLEET_FORK
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        fleet_worker(u);
+        exit(u->status == UNIT_DONE ? 0 : -1);
+    }
+    u->pid = pid;
+#else
+    if (pthread_create(&u->thread, 0, fleet_worker, u) != 0) {
+        fprintf(stderr, "Cannot start thread!\n");
+        exit(-1);
+    }
+#endif
+}
+
+//
+// Check whether the worker has finished, or wait for it.
+// Return 1 when finished.
+//
+static int fleet_finished(fleet_unit_t *u, int wait_flag)
+{
+#ifdef FLEET_FORK
+    int wstatus;
+    pid_t pid;
+
+    do {
+        pid = waitpid(u->pid, &wstatus, wait_flag ? 0 : WNOHANG);
+    } while (pid < 0 && errno == EINTR);
+    if (pid == 0)
+        return 0;
+
+    if (u->status < UNIT_DONE) {
+        // Worker called exit() on fatal error.
+        u->status = UNIT_FAILED;
+        u->error = "fatal error";
+    }
+    return 1;
+#else
+    if (! wait_flag && u->status < UNIT_DONE)
+        return 0;
+    pthread_join(u->thread, 0);
+    return 1;
+#endif
+}
+
+//
+// Print status of all radios.
+//
+static void fleet_report()
+{
+    static const char *status_name[] = {
+        "not started", "interrupted", "done", "FAILED",
+    };
+    int i;
+
+    if (! fleet)
+        return;
+
+    fprintf(stderr, "\n");
+    for (i=0; i<fleet_size; i++) {
+        fleet_unit_t *u = &fleet[i];
+
+#ifndef FLEET_FORK
+        // Radio, which called exit() on fatal error.
+        if (u->session == dmr_session && u->status == UNIT_BUSY)
+            u->status = UNIT_FAILED;
+#endif
+        fprintf(stderr, "Radio %d: %s", i+1, u->name ? u->name : "unknown");
+        fprintf(stderr, " - %s", status_name[u->status]);
+        if (u->error)
+            fprintf(stderr, ", %s", u->error);
+        if (u->status == UNIT_DONE)
+            fprintf(stderr, ", %.1f seconds", u->seconds);
+        fprintf(stderr, ".\n");
+    }
+}
+
+//
+// Find all attached radios, and read or write them in parallel.
+// For upload, the image must be loaded by radio_read_image() in advance;
+// all radios share it.  Downloaded images are saved to files
+// device-1.img, device-2.img and so on, with configuration
+// in device-1.conf, device-2.conf...
+// Return the number of failed radios.
+//
+int radio_fleet(int write_flag)
+{
+    int port, i, n, nfailed = 0, count[NPORTS];
+
+    // Enumerate radios.
+    scan_ports(count);
+    n = 0;
+    for (port=0; port<NPORTS; port++)
+        n += count[port];
+    if (n == 0) {
+        fprintf(stderr, "No radio detected.\n");
+        fprintf(stderr, "Check your USB cable!\n");
+        exit(-1);
+    }
+    fleet = fleet_alloc(n);
+    fleet_size = 0;
+    for (port=0; port<NPORTS; port++) {
+        for (i=0; i<count[port]; i++) {
+            fleet_unit_t *u = &fleet[fleet_size++];
+
+            u->port = port;
+            u->index = i;
+            u->session = dmr_session_create(write_flag ? dmr_session : 0);
+        }
+    }
+    fprintf(stderr, "Found %d radios.\n", fleet_size);
+    fprintf(stderr, "%s devices: ", write_flag ? "Write" : "Read");
+    fflush(stderr);
+
+#ifndef FLEET_FORK
+    // Report status when any of the radios fails fatally.
+    atexit(fleet_report);
+#endif
+    fleet_write = write_flag;
+    for (i=0; i<fleet_size; i++) {
+        fleet_start(&fleet[i]);
+    }
+    for (i=0; i<fleet_size; i++) {
+        fleet_finished(&fleet[i], 1);
+    }
+    fprintf(stderr, " done.\n");
+    fleet_report();
+
+    for (i=0; i<fleet_size; i++) {
+        fleet_unit_t *u = &fleet[i];
+
+        if (u->status != UNIT_DONE)
+            nfailed++;
+        dmr_session_destroy(u->session);
+    }
+    fleet_free(fleet, fleet_size);
+    fleet = 0;
+    fleet_size = 0;
+    return nfailed;
+}
+
+//
+// Station mode: program radios as they are attached.
+//
+#define STATION_MAXRADIOS   32      // Radios programmed at the same time
+#define STATION_HOLDOFF     15      // Seconds to ignore the port after programming
+
+static fleet_unit_t *station[STATION_MAXRADIOS];
+static struct {
+    char where[32];                 // Physical USB port
+    time_t finished;                // Time when programming completed
+} station_recent[STATION_MAXRADIOS];
+
+//
+// Start programming the attached radio.
+//
+static void station_attach(hotplug_event_t *ev)
+{
+    time_t now = time(0);
+    int i, slot = -1;
+
+    for (i=0; i<STATION_MAXRADIOS; i++) {
+        if (station[i] && strcmp(station[i]->where, ev->port) == 0) {
+            // Already in progress.
+            return;
+        }
+        // The radio reboots after programming and appears again.
+        if (strcmp(station_recent[i].where, ev->port) == 0 &&
+            now - station_recent[i].finished < STATION_HOLDOFF) {
+            if (trace_flag)
+                printf("Port %s: ignore radio reattached after programming.\n", ev->port);
+            return;
+        }
+        if (! station[i] && slot < 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        fprintf(stderr, "Port %s: too many radios at once, ignored.\n", ev->port);
+        return;
+    }
+
+    fleet_unit_t *u = fleet_alloc(1);
+
+    u->port = ev->type;
+    u->location = ev->location;
+    strcpy(u->where, ev->port);
+    u->session = dmr_session_create(dmr_session);
+    station[slot] = u;
+
+    fprintf(stderr, "Port %s: radio attached.\n", u->where);
+    fleet_start(u);
+}
+
+//
+// Report radios completed.
+//
+static void station_collect()
+{
+    int i, j, k;
+
+    for (i=0; i<STATION_MAXRADIOS; i++) {
+        fleet_unit_t *u = station[i];
+
+        if (! u || ! fleet_finished(u, 0))
+            continue;
+
+        if (u->status == UNIT_DONE) {
+            fprintf(stderr, "\nPort %s: %s programmed in %.1f seconds.\n",
+                u->where, u->name, u->seconds);
+        } else {
+            fprintf(stderr, "\nPort %s: %s FAILED, %s.\n", u->where,
+                u->name ? u->name : "radio", u->error);
+        }
+
+        // Remember the port, replacing the oldest record.
+        k = 0;
+        for (j=1; j<STATION_MAXRADIOS; j++) {
+            if (station_recent[j].finished < station_recent[k].finished)
+                k = j;
+        }
+        strcpy(station_recent[k].where, u->where);
+        station_recent[k].finished = time(0);
+
+        dmr_session_destroy(u->session);
+        fleet_free(u, 1);
+        station[i] = 0;
+    }
+}
+
+//
+// Start monitoring for radios of all types.
+//
+static void station_hotplug_init()
+{
+    unsigned vid[NPORTS], pid[NPORTS];
+    int port, nports = NPORTS;
+
+    for (port=0; port<NPORTS; port++) {
+        vid[port] = port_tab[port].vid;
+        pid[port] = port_tab[port].pid;
+    }
+
+    // Serial radios are reported by udev when the tty device is ready.
+    // Otherwise they are detected by libusb, like the others.
+    if (serial_hotplug_init(vid[PORT_SERIAL], pid[PORT_SERIAL]) >= 0)
+        nports = PORT_SERIAL;
+
+    if (usb_hotplug_init(nports, vid, pid) < 0) {
+        fprintf(stderr, "USB hotplug is not supported on this system.\n");
+        exit(-1);
+    }
+    fprintf(stderr, "Waiting for radios. Press Ctrl-C to stop.\n");
+}
+
+//
+// Wait up to msec milliseconds for a radio to be attached.
+// Return 1 when the event is available, 0 on timeout.
+//
+static int station_hotplug_wait(hotplug_event_t *ev, int msec)
+{
+    if (serial_hotplug_poll(ev)) {
+        ev->type = PORT_SERIAL;
+        return 1;
+    }
+    return usb_hotplug_wait(ev, msec);
+}
+
+#ifdef FLEET_FORK
+//
+// Start the process, which monitors for radios and passes
+// the events through a pipe.  The hotplug contexts of libusb
+// and udev live in this process only, so that the workers,
+// forked by the station, start with a clean state.
+// Return the read end of the pipe.
+//
+static int station_monitor()
+{
+    hotplug_event_t ev;
+    pid_t parent = getpid(), pid;
+    int fd[2];
+
+    if (pipe(fd) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid > 0) {
+        close(fd[1]);
+        return fd[0];
+    }
+
+    // Monitor: stop when the station has gone.
+    close(fd[0]);
+    station_hotplug_init();
+    while (getppid() == parent) {
+        if (station_hotplug_wait(&ev, 100) &&
+            write(fd[1], &ev, sizeof(ev)) != sizeof(ev))
+            break;
+    }
+    exit(0);
+}
+#endif
+
+//
+// Wait for radios to be attached, and write the image to every one.
+// The image must be loaded by radio_read_image() in advance.
+// Never returns.
+//
+void radio_station()
+{
+    hotplug_event_t ev;
+
+    fleet_write = 1;
+#ifdef FLEET_FORK
+    struct pollfd monitor = { station_monitor(), POLLIN };
+
+    for (;;) {
+        if (poll(&monitor, 1, 100) > 0) {
+            if (read(monitor.fd, &ev, sizeof(ev)) != sizeof(ev)) {
+                fprintf(stderr, "Hotplug monitor has stopped.\n");
+                exit(-1);
+            }
+            station_attach(&ev);
+        }
+        station_collect();
+    }
+#else
+    station_hotplug_init();
+    for (;;) {
+        while (station_hotplug_wait(&ev, 100))
+            station_attach(&ev);
+        station_collect();
+    }
+#endif
+}
+
+//
+// Batch mode: apply configuration scripts to codeplug images,
+// on a pool of worker threads.
+//
+#define BATCH_MAXTHREADS    64      // Limit of worker threads
+
+typedef struct {
+    char *image;                            // Template image file
+    char *config;                           // Configuration script
+    char *output;                           // Resulting image file
+    dmr_session_t *template;                // Loaded template
+    dmr_session_t *session;                 // Session of the worker
+    int status;                             // UNIT_xxx
+    double seconds;                         // Time of processing
+} batch_job_t;
+
+static batch_job_t *batch;                  // Array of jobs
+static int batch_size;                      // Number of jobs
+static int batch_next;                      // Next job to start
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Worker thread: process jobs until none are left.
+// The session is reused: every job starts with a fresh copy of the template.
+//
+static void *batch_worker(void *arg)
+{
+    dmr_session_t *s = dmr_session_create(0);
+    struct timeval t0, t1;
+    batch_job_t *job;
+
+    dmr_session_select(s);
+    for (;;) {
+        pthread_mutex_lock(&batch_lock);
+        job = (batch_next < batch_size) ? &batch[batch_next++] : 0;
+        pthread_mutex_unlock(&batch_lock);
+        if (! job)
+            break;
+
+        gettimeofday(&t0, 0);
+        job->session = s;
+        job->status = UNIT_BUSY;
+        s->device = job->template->device;
+        memcpy(s->mem, job->template->mem, RADIO_MEMSZ);
+
+        radio_parse_config(job->config);
+        radio_verify_config();
+        radio_save_image(job->output);
+
+        gettimeofday(&t1, 0);
+        job->seconds = t1.tv_sec - t0.tv_sec + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+        job->status = UNIT_DONE;
+    }
+    dmr_session_destroy(s);
+    return 0;
+}
+
+//
+// Print status of all jobs.
+//
+static void batch_report()
+{
+    static const char *status_name[] = {
+        "not started", "interrupted", "done", "FAILED",
+    };
+    int i;
+
+    if (! batch)
+        return;
+
+    fprintf(stderr, "\n");
+    for (i=0; i<batch_size; i++) {
+        batch_job_t *job = &batch[i];
+
+        // Job, which called exit() on fatal error.
+        if (job->session == dmr_session && job->status == UNIT_BUSY)
+            job->status = UNIT_FAILED;
+
+        fprintf(stderr, "Job %d: %s - %s", i+1, job->output, status_name[job->status]);
+        if (job->status == UNIT_DONE)
+            fprintf(stderr, ", %.1f msec", job->seconds * 1000);
+        fprintf(stderr, ".\n");
+    }
+}
+
+//
+// Read the manifest: every line has a template image,
+// a configuration script and an output image file.
+// Load every template once.
+//
+static void batch_read_manifest(const char *filename)
+{
+    FILE *manifest;
+    char line[1024], image[256], config[256], output[256], *p;
+    int lineno = 0, i;
+
+    manifest = fopen(filename, "r");
+    if (! manifest) {
+        perror(filename);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), manifest)) {
+        lineno++;
+
+        // Strip comments.
+        p = strchr(line, '#');
+        if (p)
+            *p = 0;
+
+        if (sscanf(line, "%255s %255s %255s", image, config, output) != 3) {
+            if (sscanf(line, "%1s", image) != 1)
+                continue;
+            fprintf(stderr, "%s:%d: Expected: template.img file.conf output.img\n",
+                filename, lineno);
+            exit(-1);
+        }
+        batch = realloc(batch, (batch_size + 1) * sizeof(batch_job_t));
+        if (! batch) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        batch_job_t *job = &batch[batch_size++];
+
+        memset(job, 0, sizeof(*job));
+        job->image = strdup(image);
+        job->config = strdup(config);
+        job->output = strdup(output);
+        if (! job->image || ! job->config || ! job->output) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+
+        // Same template as in one of previous jobs?
+        for (i=0; i<batch_size-1; i++) {
+            if (strcmp(batch[i].image, image) == 0) {
+                job->template = batch[i].template;
+                break;
+            }
+        }
+        if (! job->template) {
+            dmr_session_t *current = dmr_session;
+
+            job->template = dmr_session_create(0);
+            dmr_session_select(job->template);
+            radio_read_image(image);
+            dmr_session_select(current);
+        }
+    }
+    fclose(manifest);
+}
+
+//
+// Apply configuration scripts to codeplug images, as listed in the manifest.
+// Return the number of failed jobs.
+//
+int radio_batch(const char *manifest)
+{
+    pthread_t thread[BATCH_MAXTHREADS];
+    int nthreads = 4, i, j, nfailed = 0;
+
+    batch_read_manifest(manifest);
+    if (batch_size == 0) {
+        fprintf(stderr, "%s: No jobs.\n", manifest);
+        exit(-1);
+    }
+#ifdef _SC_NPROCESSORS_ONLN
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (nthreads > BATCH_MAXTHREADS)
+        nthreads = BATCH_MAXTHREADS;
+    if (nthreads > batch_size)
+        nthreads = batch_size;
+    if (nthreads < 1)
+        nthreads = 1;
+    if (trace_flag)
+        printf("Batch: %d jobs, %d threads.\n", batch_size, nthreads);
+
+    // Report status when any of the jobs fails fatally.
+    atexit(batch_report);
+
+    batch_next = 0;
+    for (i=0; i<nthreads; i++) {
+        if (pthread_create(&thread[i], 0, batch_worker, 0) != 0) {
+            fprintf(stderr, "Cannot start thread!\n");
+            exit(-1);
+        }
+    }
+    for (i=0; i<nthreads; i++) {
+        pthread_join(thread[i], 0);
+    }
+    batch_report();
+
+    for (i=0; i<batch_size; i++) {
+        batch_job_t *job = &batch[i];
+
+        if (job->status != UNIT_DONE)
+            nfailed++;
+
+        // Destroy the template after its last job.
+        for (j=i+1; j<batch_size; j++) {
+            if (batch[j].template == job->template)
+                break;
+        }
+        if (j == batch_size)
+            dmr_session_destroy(job->template);
+        free(job->image);
+        free(job->config);
+        free(job->output);
+    }
+    free(batch);
+    batch = 0;
+    batch_size = 0;
+    return nfailed;
+}
+
+//
+// List all supported radios.
+//
+void radio_list()
+{
+    int i;
+
+    printf("Supported radios:\n");
+    for (i=0; radio_tab[i].ident; i++) {
+        printf("    %s\n", radio_tab[i].device->name);
+    }
+}
+
+//
+// Size of image file contents in memory of the current session.
+//
+static __thread unsigned image_size;
+
+//
+// Radio name from the header of the archive, or empty for a plain image.
+//
+static __thread char image_ident[32];
+
+//
+// Codeplug archive: compressed image file.
+// Header: magic, radio name, image size and block size, little endian.
+// The image is split into blocks.  A run of blocks filled with
+// the same byte (erased 0xff or 0x00) is stored as one record;
+// other blocks are compressed, or stored as is when incompressible.
+//
+#define ARCHIVE_MAGIC       "DMRCFGZ\032"
+#define ARCHIVE_HDRSZ       48          // Magic 8, name 32, size 4, block size 4
+#define ARCHIVE_BLKSZ       4096
+
+enum {
+    ARCHIVE_FILL = 1,                   // Byte value, number of blocks (4 bytes)
+    ARCHIVE_LZ,                         // Compressed length (2 bytes), data
+    ARCHIVE_RAW,                        // Data
+};
+
+static void put_u32(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static unsigned get_u32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+//
+// Check whether the block is filled with one byte value.
+//
+static int block_filled(const unsigned char *data, unsigned len)
+{
+    return len > 0 && data[0] == data[len-1] && memcmp(data, data + 1, len - 1) == 0;
+}
 
 //
-// Close the serial port.
+// Write the image to a file as archive.
 //
-void radio_disconnect()
+static void archive_write(FILE *img, const unsigned char *data, unsigned size)
 {
-    fprintf(stderr, "Close device.\n");
+    unsigned char hdr[ARCHIVE_HDRSZ], buf[8 + ARCHIVE_BLKSZ];
+    unsigned offset, len, nblocks;
+    int n;
 
-    // Restore the normal radio mode.
-    dfu_reboot();
-    dfu_close();
-    hid_close();
-    serial_close();
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, ARCHIVE_MAGIC, 8);
+    strncpy((char*) hdr + 8, dmr_session->device->name, 31);
+    put_u32(hdr + 40, size);
+    put_u32(hdr + 44, ARCHIVE_BLKSZ);
+    fwrite(hdr, 1, ARCHIVE_HDRSZ, img);
+
+    for (offset = 0; offset < size; offset += len) {
+        len = (size - offset < ARCHIVE_BLKSZ) ? size - offset : ARCHIVE_BLKSZ;
+
+        if (block_filled(&data[offset], len)) {
+            // Count blocks with the same contents.
+            nblocks = 1;
+            while (offset + len < size) {
+                unsigned next = (size - offset - len < ARCHIVE_BLKSZ) ?
+                    size - offset - len : ARCHIVE_BLKSZ;
+
+                if (data[offset + len] != data[offset] ||
+                    ! block_filled(&data[offset + len], next))
+                    break;
+                len += next;
+                nblocks++;
+            }
+            buf[0] = ARCHIVE_FILL;
+            buf[1] = data[offset];
+            put_u32(buf + 2, nblocks);
+            fwrite(buf, 1, 6, img);
+            continue;
+        }
+
+        n = lz_compress(buf + 3, len - 1, &data[offset], len);
+        if (n > 0) {
+            buf[0] = ARCHIVE_LZ;
+            buf[1] = n;
+            buf[2] = n >> 8;
+            fwrite(buf, 1, n + 3, img);
+        } else {
+            buf[0] = ARCHIVE_RAW;
+            fwrite(buf, 1, 1, img);
+            fwrite(&data[offset], 1, len, img);
+        }
+    }
 }
 
 //
-// Print a generic information about the device.
+// Unpack the archive into memory of the session.
+// Return the image size, or -1 on invalid data.
 //
-void radio_print_version(FILE *out)
+static int archive_unpack(const unsigned char *ar, unsigned arsize, unsigned char *mem)
 {
-    device->print_version(device, out);
+    const unsigned char *p = ar + ARCHIVE_HDRSZ, *end = ar + arsize;
+    unsigned size = get_u32(ar + 40);
+    unsigned blksz = get_u32(ar + 44);
+    unsigned offset, len, nblocks;
+    int n;
+
+    if (size > RADIO_MEMSZ || blksz == 0 || blksz > ARCHIVE_BLKSZ)
+        return -1;
+
+    for (offset = 0; offset < size; offset += len) {
+        len = (size - offset < blksz) ? size - offset : blksz;
+        if (p >= end)
+            return -1;
+
+        switch (*p++) {
+        case ARCHIVE_FILL:
+            if (end - p < 5)
+                return -1;
+            nblocks = get_u32(p + 1);
+            if (nblocks == 0 || nblocks > (size - offset + blksz - 1) / blksz)
+                return -1;
+            len = (nblocks * blksz < size - offset) ? nblocks * blksz : size - offset;
+            memset(&mem[offset], p[0], len);
+            p += 5;
+            break;
+        case ARCHIVE_LZ:
+            if (end - p < 2)
+                return -1;
+            n = p[0] | p[1] << 8;
+            p += 2;
+            if (n > end - p ||
+                lz_decompress(&mem[offset], len, p, n) != (int) len)
+                return -1;
+            p += n;
+            break;
+        case ARCHIVE_RAW:
+            if (len > end - p)
+                return -1;
+            memcpy(&mem[offset], p, len);
+            p += len;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return size;
 }
 
 //
-// Connect to the radio and identify the type of device.
+// Allocate memory buffer of the session.
+// Bytes past the image contents are cleared.
 //
-void radio_connect()
+static void session_alloc(dmr_session_t *s, unsigned size)
 {
-    const char *ident;
-    int i;
+    s->mem = (s == &default_session) ? default_mem : malloc(RADIO_MEMSZ);
+    if (! s->mem) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    memset(s->mem + size, 0, RADIO_MEMSZ - size);
+}
 
-    // Try TYT MD family.
-    ident = dfu_init(0x0483, 0xdf11);
-    if (! ident) {
-        // Try RD-5R, DM-1801 and GD-77.
-        if (hid_init(0x15a2, 0x0073) >= 0)
-            ident = hid_identify();
+//
+// Load the archive into memory of the session.
+// Return the image size.
+//
+static int archive_load(const char *filename, FILE *img, unsigned arsize)
+{
+    unsigned char *ar = malloc(arsize);
+    int size;
+
+    if (! ar) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
     }
-    if (! ident) {
-        // Try AT-D868UV.
-        if (serial_init(0x28e9, 0x018a) >= 0)
-            ident = serial_identify();
+    rewind(img);
+    if (fread(ar, 1, arsize, img) != arsize) {
+        fprintf(stderr, "%s: Error reading image data.\n", filename);
+        exit(-1);
     }
-    if (! ident) {
-        fprintf(stderr, "No radio detected.\n");
-        fprintf(stderr, "Check your USB cable!\n");
+    fclose(img);
+
+    size = get_u32(ar + 40);
+    session_alloc(dmr_session, (size < RADIO_MEMSZ) ? size : RADIO_MEMSZ);
+    size = archive_unpack(ar, arsize, radio_mem);
+    if (size < 0) {
+        fprintf(stderr, "%s: Corrupted archive.\n", filename);
         exit(-1);
     }
+    memcpy(image_ident, ar + 8, 31);
+    image_ident[31] = 0;
+    free(ar);
+    image_size = size;
+    return size;
+}
 
-    for (i=0; radio_tab[i].ident; i++) {
-        if (strcasecmp(ident, radio_tab[i].ident) == 0) {
-            device = radio_tab[i].device;
-            break;
+//
+// Load the image file into memory of the current session.
+// The file is mapped privately: pages are copied only when modified,
+// and the rest of the RADIO_MEMSZ buffer reads as zeros.
+// When mapping is not possible, the file is read.
+// Return the file size, or -1 when the file cannot be opened.
+//
+static int image_map(const char *filename)
+{
+    dmr_session_t *s = dmr_session;
+    struct stat st;
+    FILE *img;
+
+    img = fopen(filename, "rb");
+    if (! img)
+        return -1;
+    if (fstat(fileno(img), &st) < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    session_release(s);
+    image_size = (st.st_size < RADIO_MEMSZ) ? st.st_size : RADIO_MEMSZ;
+    image_ident[0] = 0;
+
+    // Archive is recognized by the magic.
+    char magic[8];
+    if (st.st_size >= ARCHIVE_HDRSZ && fread(magic, 1, 8, img) == 8 &&
+        memcmp(magic, ARCHIVE_MAGIC, 8) == 0)
+        return archive_load(filename, img, st.st_size);
+    rewind(img);
+
+#if ! defined(__WIN32__) && ! defined(WIN32)
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = (st.st_size + page - 1) / page * page + RADIO_MEMSZ;
+    unsigned char *p;
+
+    // Reserve zero pages for the whole buffer, and map the file over them.
+    // Data may start at a header offset, so reserve space past the file.
+    p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+        if (st.st_size == 0 ||
+            mmap(p, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fileno(img), 0) != MAP_FAILED) {
+            fclose(img);
+            s->mem = p;
+            s->map = p;
+            s->map_size = len;
+            return st.st_size;
         }
+        munmap(p, len);
     }
-    if (! device) {
-        fprintf(stderr, "Unrecognized radio '%s'.\n", ident);
+#endif
+    session_alloc(s, image_size);
+    if (fread(s->mem, 1, image_size, img) != image_size) {
+        fprintf(stderr, "%s: Error reading image data.\n", filename);
         exit(-1);
     }
-    fprintf(stderr, "Connect to %s.\n", device->name);
+    fclose(img);
+    return st.st_size;
 }
 
 //
-// List all supported radios.
+// Remove a header or footer from the image file contents.
+// A header of a mapped file is skipped without copying.
 //
-void radio_list()
+void radio_image_skip(unsigned offset, unsigned nbytes)
 {
-    int i;
+    if (offset + nbytes > image_size) {
+        fprintf(stderr, "Bad image layout: %u bytes at offset %u.\n", nbytes, offset);
+        exit(-1);
+    }
+    if (offset == 0 && dmr_session->map) {
+        radio_mem += nbytes;
+    } else {
+        memmove(&radio_mem[offset], &radio_mem[offset + nbytes],
+            image_size - offset - nbytes);
+        memset(&radio_mem[image_size - nbytes], 0, nbytes);
+    }
+    image_size -= nbytes;
+}
 
-    printf("Supported radios:\n");
-    for (i=0; radio_tab[i].ident; i++) {
-        printf("    %s\n", radio_tab[i].device->name);
+//
+// Write the image to a file, plain or as archive.
+// Write to a temporary file with unique name first, and rename it
+// into place, so a partial image never appears, and concurrent
+// saves of the same file do not mix.
+// Return 0 on error.
+//
+static int image_save(const char *filename)
+{
+    char tmp[1040];
+    FILE *img;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename);
+#if defined(__WIN32__) || defined(WIN32)
+    if (! _mktemp(tmp))
+        return 0;
+    img = fopen(tmp, archive_flag ? "w+b" : "wb");
+    if (! img)
+        return 0;
+#else
+    int fd = mkstemp(tmp);
+    mode_t mask;
+
+    if (fd < 0)
+        return 0;
+
+    // Mkstemp() creates the file private: give it usual permissions.
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    img = fdopen(fd, archive_flag ? "w+b" : "wb");
+    if (! img) {
+        close(fd);
+        unlink(tmp);
+        return 0;
+    }
+#endif
+
+    dmr_session->device->save_image(dmr_session->device, img);
+    if (archive_flag && ! ferror(img)) {
+        // The file layout belongs to the driver: read back
+        // the bytes it produced, and pack them instead.
+        long size = ftell(img);
+        unsigned char *data = malloc(size > 0 ? size : 1);
+
+        if (! data) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+        }
+        rewind(img);
+        if (fread(data, 1, size, img) != size ||
+            ! (img = freopen(tmp, "wb", img))) {
+            free(data);
+            if (img)
+                fclose(img);
+            unlink(tmp);
+            return 0;
+        }
+        archive_write(img, data, size);
+        free(data);
+    }
+    if (fflush(img) != 0 || ferror(img)) {
+        fclose(img);
+        unlink(tmp);
+        return 0;
+    }
+    if (fclose(img) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+#if defined(__WIN32__) || defined(WIN32)
+    unlink(filename);
+#endif
+    if (rename(tmp, filename) < 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Get name of a file in the cache directory: $XDG_CACHE_HOME/dmrconfig/radio-suffix.
+// Create the directory when needed.
+// Return 0 when no cache directory is available.
+//
+static int cache_filename(char *path, int size, const char *suffix)
+{
+    const char *dir = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *p;
+    int len;
+
+    if (dir && *dir) {
+        len = snprintf(path, size, "%s/dmrconfig", dir);
+    } else if (home && *home) {
+        len = snprintf(path, size, "%s/.cache", home);
+#if defined(__WIN32__) || defined(WIN32)
+        mkdir(path);
+#else
+        mkdir(path, 0700);
+#endif
+        len = snprintf(path, size, "%s/.cache/dmrconfig", home);
+    } else {
+        return 0;
+    }
+#if defined(__WIN32__) || defined(WIN32)
+    mkdir(path);
+#else
+    mkdir(path, 0700);
+#endif
+    snprintf(path + len, size - len, "/%s-%s",
+        dmr_session->device->name, suffix);
+
+    // Replace spaces in radio name.
+    for (p=path+len; *p; p++) {
+        if (*p == ' ')
+            *p = '_';
+    }
+    return 1;
+}
+
+//
+// Load the image from cache.
+// Return 0 when not found.
+//
+static int cache_load(unsigned long long hash)
+{
+    char path[1024], suffix[32];
+    int size;
+
+    sprintf(suffix, "%016llx.img", hash);
+    if (! cache_filename(path, sizeof(path), suffix))
+        return 0;
+
+    size = image_map(path);
+    if (size < 0)
+        return 0;
+
+    dmr_session->device->read_image(dmr_session->device, size);
+    if (trace_flag)
+        printf("Cache hit: %s\n", path);
+    return 1;
+}
+
+//
+// Exchange memory contents of the session with the contents
+// as read from the radio.
+//
+static void swap_orig()
+{
+    unsigned char *mem = dmr_session->mem;
+
+    dmr_session->mem = dmr_session->orig;
+    dmr_session->orig = mem;
+}
+
+//
+// Compute fingerprint of the radio contents, kept in radio_orig[].
+// With read_flag, read the fingerprint regions from the radio first.
+//
+static unsigned long long cache_fingerprint(int read_flag)
+{
+    radio_device_t *device = dmr_session->device;
+    unsigned long long hash;
+
+    swap_orig();
+    hash = device->fingerprint(device, read_flag);
+    swap_orig();
+    return hash;
+}
+
+//
+// Save the radio contents to cache.
+// Only radio_orig[] is saved: it holds the data read from the radio,
+// updated by radio_written() with the data written since.
+//
+static void cache_save(unsigned long long hash)
+{
+    char path[1024], suffix[32];
+    int ok;
+
+    sprintf(suffix, "%016llx.img", hash);
+    if (! cache_filename(path, sizeof(path), suffix))
+        return;
+
+    swap_orig();
+    ok = image_save(path);
+    swap_orig();
+    if (! ok)
+        return;
+    if (trace_flag)
+        printf("Save to cache: %s\n", path);
+}
+
+//
+// Remove the image from cache.
+//
+static void cache_remove(unsigned long long hash)
+{
+    char path[1024], suffix[32];
+
+    sprintf(suffix, "%016llx.img", hash);
+    if (! cache_filename(path, sizeof(path), suffix))
+        return;
+
+    if (unlink(path) == 0 && trace_flag)
+        printf("Remove from cache: %s\n", path);
+}
+
+//
+// Data have been written to the radio: keep radio_orig[] equal
+// to the radio contents.  Data outside of the memory image are ignored.
+//
+void radio_written(const unsigned char *data, int nbytes)
+{
+    size_t offset = data - radio_mem;
+
+    if (offset < RADIO_MEMSZ && nbytes <= RADIO_MEMSZ - offset)
+        memcpy(&radio_orig[offset], data, nbytes);
+}
+
+//
+// Upload journal: the radio's image hash and the number of steps
+// (blocks or sectors, depending on the driver) written so far.
+// The radio is identified by its USB serial number or port,
+// and every step is recorded with the fingerprint of the radio after it,
+// kept up to date in radio_orig[] by radio_written().
+// When the upload is interrupted, it can be resumed from the last step,
+// on the same radio only.  A radio without identity is written from start.
+//
+static __thread FILE *journal;              // Journal of the current upload
+static __thread int journal_done;           // Steps completed before resume
+
+//
+// Start the journal.  With resume_flag, continue the previous upload
+// of the same image to the radio with given fingerprint.
+//
+static void journal_open(unsigned long long radio_hash)
+{
+    char path[1024], line[128], old_identity[sizeof(device_identity)] = "";
+    unsigned long long hash, old_hash = 0, old_radio = 0, step_radio;
+    int done;
+    FILE *old;
+
+    journal_done = 0;
+    if (! cache_filename(path, sizeof(path), "journal"))
+        return;
+
+    hash = hash_fnv(0, radio_mem, RADIO_MEMSZ);
+    if (resume_flag) {
+        old = fopen(path, "r");
+        if (old) {
+            while (fgets(line, sizeof(line), old)) {
+                if (sscanf(line, "image %llx", &old_hash) == 1)
+                    continue;
+                if (strncmp(line, "radio ", 6) == 0) {
+                    strncpy(old_identity, line + 6, sizeof(old_identity) - 1);
+                    old_identity[strcspn(old_identity, "\r\n")] = 0;
+                    continue;
+                }
+                if (sscanf(line, "done %d radio %llx", &done, &step_radio) == 2 &&
+                    done > journal_done) {
+                    journal_done = done;
+                    old_radio = step_radio;
+                }
+            }
+            fclose(old);
+        }
+        if (old_hash != hash) {
+            fprintf(stderr, "No interrupted upload of this image, write from start.\n");
+            journal_done = 0;
+        } else if (journal_done > 0 && ! device_identity[0]) {
+            fprintf(stderr, "Cannot identify the radio, write from start.\n");
+            journal_done = 0;
+        } else if (journal_done > 0 && (old_radio != radio_hash ||
+                   strcmp(old_identity, device_identity) != 0)) {
+            fprintf(stderr, "Radio differs from the interrupted upload, write from start.\n");
+            journal_done = 0;
+        } else if (journal_done > 0) {
+            fprintf(stderr, "Resume upload after step %d.\n", journal_done);
+        }
+    }
+
+    if (journal_done > 0) {
+        journal = fopen(path, "a");
+    } else {
+        journal = fopen(path, "w");
+        if (journal) {
+            fprintf(journal, "image %016llx\n", hash);
+            fprintf(journal, "radio %s\n", device_identity);
+        }
+    }
+    if (! journal) {
+        perror(path);
+        journal_done = 0;
+    } else if (trace_flag) {
+        printf("Upload journal: %s\n", path);
+    }
+}
+
+//
+// Upload completed: remove the journal.
+//
+static void journal_close()
+{
+    char path[1024];
+
+    if (! journal)
+        return;
+    fclose(journal);
+    journal = 0;
+    journal_done = 0;
+    if (cache_filename(path, sizeof(path), "journal"))
+        unlink(path);
+}
+
+//
+// Check whether the upload step still needs to be done.
+//
+int radio_journal_pending(int step)
+{
+    return step >= journal_done;
+}
+
+//
+// Record the upload step as completed.
+// Steps must be committed in increasing order.
+//
+void radio_journal_commit(int step)
+{
+    radio_device_t *device = dmr_session->device;
+
+    if (journal) {
+        fprintf(journal, "done %d radio %016llx\n", step + 1,
+            device->fingerprint ? cache_fingerprint(0) : 0ULL);
+        fflush(journal);
+    }
+}
+
+//
+// Check whether the current upload continues an interrupted one.
+//
+int radio_journal_resumed()
+{
+    return journal_done > 0;
+}
+
+//
+// Write to DFU device (MD-380 or MD-UV380 family) only those 64-kbyte
+// sectors, which differ from the image read by radio_download().
+// Without cont_flag, write all sectors not yet recorded in the upload journal.
+// Image offsets above 256 kbytes are mapped to flash at 0x110000.
+//
+void dfu_upload_changed_sectors(unsigned memsz, int cont_flag)
+{
+    unsigned offset, addr;
+    int bno, count, nsectors = 0, nerased = 0, nwritten = 0, nskipped = 0;
+
+    for (offset = 0; offset < memsz; offset += 0x10000) {
+        nsectors++;
+        if ((cont_flag && memcmp(&radio_mem[offset], &radio_orig[offset], 0x10000) == 0) ||
+            ! radio_journal_pending(offset / 0x10000)) {
+            if (trace_flag)
+                printf("Sector 0x%x %s.\n", offset, cont_flag ? "unchanged" : "already written");
+            radio_progress += 0x10000 / 1024;
+            fprintf(stderr, "##");
+            fflush(stderr);
+            continue;
+        }
+
+        // Erase the sector.
+        addr = (offset < 0x40000) ? offset : offset + 0xd0000;
+        dfu_erase_sector(addr);
+        nerased++;
+
+        // Write non-blank blocks.
+        count = 0;
+        for (bno = offset/1024; bno < (offset + 0x10000)/1024; bno++) {
+            if (dfu_write_erased_block(bno, &radio_mem[bno*1024], 1024))
+                count++;
+            else
+                nskipped++;
+
+            ++radio_progress;
+            if (radio_progress % 32 == 0) {
+                fprintf(stderr, "#");
+                fflush(stderr);
+            }
+        }
+        if (count > 0)
+            nwritten++;
+        radio_journal_commit(offset / 0x10000);
     }
+    fprintf(stderr, " %d of %d sectors erased, %d written, %d blank blocks skipped,",
+        nerased, nsectors, nwritten, nskipped);
 }
 
 //
 // Read firmware image from the device.
+// With --cache, when the fingerprint of the radio (timestamp and a few
+// sampled blocks) matches an image in the cache, use the cached image instead.
+// The fingerprint misses changes made from the front panel, so the cached
+// image is never used to upload only the changes.
 //
 void radio_download()
 {
+    radio_device_t *device = dmr_session->device;
+    unsigned long long hash = 0;
+
     radio_progress = 0;
     if (! trace_flag) {
         fprintf(stderr, "Read device: ");
         fflush(stderr);
     }
 
+    if (cache_flag && device->fingerprint) {
+        hash = device->fingerprint(device, 1);
+        if (cache_load(hash)) {
+            memcpy(radio_orig, radio_mem, RADIO_MEMSZ);
+            dmr_session->orig_read = 1;
+            dmr_session->orig_cached = 1;
+            if (! trace_flag)
+                fprintf(stderr, " done (cached).\n");
+            return;
+        }
+        if (trace_flag)
+            printf("Cache miss: fingerprint %016llx\n", hash);
+    }
+
     device->download(device);
 
+    // Keep the original contents, to upload only the changes.
+    memcpy(radio_orig, radio_mem, RADIO_MEMSZ);
+    dmr_session->orig_read = 1;
+
+    if (hash != 0)
+        cache_save(hash);
+
     if (! trace_flag)
         fprintf(stderr, " done.\n");
 }
@@ -159,64 +1770,127 @@ void radio_download()
 //
 void radio_upload(int cont_flag)
 {
+    radio_device_t *device = dmr_session->device;
+    int cache_used = cache_flag && device->fingerprint;
+    unsigned long long radio_hash = 0;
+
+    // A journal is kept for full uploads of a single radio only:
+    // after -c, a repeated run reads the radio and writes only
+    // what is still different.
+    int journal_used = ! cont_flag && ! dmr_session->shared;
+
     // Check for compatibility.
     if (! device->is_compatible(device)) {
         fprintf(stderr, "Incompatible image - cannot upload.\n");
         exit(-1);
     }
+
+    // The cached image was not verified against the radio:
+    // the changes cannot be computed from it.
+    if (cont_flag && dmr_session->orig_cached) {
+        fprintf(stderr, "Codeplug was taken from cache, write it as a whole.\n");
+        cont_flag = 0;
+        journal_used = ! dmr_session->shared;
+    }
+
+    // Fingerprint of the radio before the upload: the journal
+    // uses it to recognize the radio, and the cached image of the radio
+    // becomes stale as soon as the first block is written.
+    // When the radio was not read, get the fingerprint from the radio.
+    if (device->fingerprint && (cache_used || journal_used))
+        radio_hash = cache_fingerprint(! dmr_session->orig_read);
+    if (cache_used)
+        cache_remove(radio_hash);
+
+    if (journal_used)
+        journal_open(radio_hash);
+
     radio_progress = 0;
     if (! trace_flag) {
         fprintf(stderr, "Write device: ");
         fflush(stderr);
     }
     device->upload(device, cont_flag);
+    journal_close();
+
+    // The radio contents are known only when the radio was read
+    // before the upload: otherwise the blocks never written are unknown.
+    if (cache_used && dmr_session->orig_read)
+        cache_save(cache_fingerprint(0));
 
     if (! trace_flag)
         fprintf(stderr, " done.\n");
 }
 
+//
+// Print what radio_upload() would write, without writing.
+//
+void radio_print_plan(int cont_flag)
+{
+    radio_device_t *dev = dmr_session->device;
+
+    if (! dev->is_compatible(dev)) {
+        fprintf(stderr, "Incompatible image - cannot upload.\n");
+        exit(-1);
+    }
+    if (dmr_session->orig_cached)
+        cont_flag = 0;
+    if (! dev->print_plan) {
+        fprintf(stderr, "Option --dry-run is not supported for %s.\n", dev->name);
+        exit(-1);
+    }
+    dev->print_plan(dev, cont_flag);
+}
+
 //
 // Read firmware image from the binary file.
 //
 void radio_read_image(const char *filename)
 {
-    FILE *img;
-    struct stat st;
-    char ident[8];
+    const char *ident;
+    int size, i;
 
     fprintf(stderr, "Read codeplug from file '%s'.\n", filename);
-    img = fopen(filename, "rb");
-    if (! img) {
+    size = image_map(filename);
+    if (size < 0) {
         perror(filename);
         exit(-1);
     }
+    ident = (const char*) radio_mem;
 
-    // Guess device type by file size.
-    if (stat(filename, &st) < 0) {
-        perror(filename);
-        exit(-1);
+    if (image_ident[0]) {
+        // Archive: radio type is stored in the header.
+        for (i=0; radio_tab[i].ident; i++) {
+            if (strcmp(radio_tab[i].device->name, image_ident) == 0)
+                break;
+        }
+        if (! radio_tab[i].ident) {
+            fprintf(stderr, "%s: Unknown radio '%s' in archive.\n",
+                filename, image_ident);
+            exit(-1);
+        }
+        dmr_session->device = radio_tab[i].device;
+        dmr_session->device->read_image(dmr_session->device, size);
+        return;
     }
-    switch (st.st_size) {
+
+    // Guess device type by file size.
+    switch (size) {
     case 851968:
     case 852533:
-        device = &radio_uv380;
+        dmr_session->device = &radio_uv380;
         break;
     case 262144:
     case 262709:
-        device = &radio_md380;
+        dmr_session->device = &radio_md380;
         break;
     case 1606528:
-        if (fread(ident, 1, 8, img) != 8) {
-            fprintf(stderr, "%s: Cannot read header.\n", filename);
-            exit(-1);
-        }
-        fseek(img, 0, SEEK_SET);
         if (memcmp(ident, "D868UVE", 7) == 0) {
-            device = &radio_d868uv;
+            dmr_session->device = &radio_d868uv;
         } else if (memcmp(ident, "D878UV", 6) == 0) {
-            device = &radio_d878uv;
+            dmr_session->device = &radio_d878uv;
         } else if (memcmp(ident, "D6X2UV", 6) == 0) {
-            device = &radio_dmr6x2;
+            dmr_session->device = &radio_dmr6x2;
         } else {
             fprintf(stderr, "%s: Unrecognized header '%.6s'\n",
                 filename, ident);
@@ -224,16 +1898,12 @@ void radio_read_image(const char *filename)
         }
         break;
     case 131072:
-        if (fread(ident, 1, 8, img) != 8) {
-            fprintf(stderr, "%s: Cannot read header.\n", filename);
-            exit(-1);
-        }
         if (memcmp(ident, "BF-5R", 5) == 0) {
-            device = &radio_rd5r;
+            dmr_session->device = &radio_rd5r;
         } else if (memcmp(ident, "MD-760P", 7) == 0) {
-            device = &radio_gd77;
+            dmr_session->device = &radio_gd77;
         } else if (memcmp(ident, "1801", 4) == 0) {
-            device = &radio_dm1801;
+            dmr_session->device = &radio_dm1801;
         } else if (memcmp(ident, "MD-760", 6) == 0) {
             fprintf(stderr, "Old Radioddity GD-77 v2.6 image not supported!\n");
             exit(-1);
@@ -242,16 +1912,14 @@ void radio_read_image(const char *filename)
                 filename, ident);
             exit(-1);
         }
-        fseek(img, 0, SEEK_SET);
         break;
     default:
-        fprintf(stderr, "%s: Unrecognized file size %u bytes.\n",
-            filename, (int) st.st_size);
+        fprintf(stderr, "%s: Unrecognized file size %d bytes.\n",
+            filename, size);
         exit(-1);
     }
 
-    device->read_image(device, img);
-    fclose(img);
+    dmr_session->device->read_image(dmr_session->device, size);
 }
 
 //
@@ -259,16 +1927,11 @@ void radio_read_image(const char *filename)
 //
 void radio_save_image(const char *filename)
 {
-    FILE *img;
-
     fprintf(stderr, "Write codeplug to file '%s'.\n", filename);
-    img = fopen(filename, "wb");
-    if (! img) {
+    if (! image_save(filename)) {
         perror(filename);
         exit(-1);
     }
-    device->save_image(device, img);
-    fclose(img);
 }
 
 //
@@ -287,7 +1950,7 @@ void radio_parse_config(const char *filename)
         exit(-1);
     }
 
-    device->channel_count = 0;
+    radio_channel_count = 0;
     while (fgets(line, sizeof(line), conf)) {
         line[sizeof(line)-1] = 0;
 
@@ -314,7 +1977,7 @@ void radio_parse_config(const char *filename)
             v = strchr(p, ':');
             if (! v) {
                 // Table header: get table type.
-                table_id = device->parse_header(device, p);
+                table_id = dmr_session->device->parse_header(dmr_session->device, p);
                 if (! table_id) {
 badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
                     exit(-1);
@@ -330,7 +1993,7 @@ badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
             while (*v == ' ' || *v == '\t')
                 v++;
 
-            device->parse_parameter(device, p, v);
+            dmr_session->device->parse_parameter(dmr_session->device, p, v);
 
         } else {
             // Table row or comment.
@@ -344,14 +2007,14 @@ badline:            fprintf(stderr, "Invalid line: '%s'\n", line);
                 goto badline;
             }
 
-            if (! device->parse_row(device, table_id, ! table_dirty, p)) {
+            if (! dmr_session->device->parse_row(dmr_session->device, table_id, ! table_dirty, p)) {
                 goto badline;
             }
             table_dirty = 1;
         }
     }
     fclose(conf);
-    device->update_timestamp(device);
+    dmr_session->device->update_timestamp(dmr_session->device);
 }
 
 //
@@ -373,7 +2036,7 @@ void radio_print_config(FILE *out, int verbose)
             buf, version);
         fprintf(out, "#\n");
     }
-    device->print_config(device, out, verbose);
+    dmr_session->device->print_config(dmr_session->device, out, verbose);
 }
 
 //
@@ -381,7 +2044,7 @@ void radio_print_config(FILE *out, int verbose)
 //
 void radio_verify_config()
 {
-    if (!device->verify_config(device)) {
+    if (!dmr_session->device->verify_config(dmr_session->device)) {
         // Message should be already printed.
         exit(-1);
     }
@@ -394,8 +2057,8 @@ void radio_write_csv(const char *filename)
 {
     FILE *csv;
 
-    if (!device->write_csv) {
-        fprintf(stderr, "%s does not support CSV database.\n", device->name);
+    if (!dmr_session->device->write_csv) {
+        fprintf(stderr, "%s does not support CSV database.\n", dmr_session->device->name);
         return;
     }
 
@@ -406,7 +2069,7 @@ void radio_write_csv(const char *filename)
     }
     fprintf(stderr, "Read file '%s'.\n", filename);
 
-    device->write_csv(device, csv);
+    dmr_session->device->write_csv(dmr_session->device, csv);
     fclose(csv);
 }
 
@@ -419,7 +2082,7 @@ int radio_is_compatible(const char *name)
 
     for (i=0; radio_tab[i].ident; i++) {
         // Radio is compatible when it has the same parse routine.
-        if (device->parse_parameter == radio_tab[i].device->parse_parameter &&
+        if (dmr_session->device->parse_parameter == radio_tab[i].device->parse_parameter &&
             strcasecmp(name, radio_tab[i].device->name) == 0) {
             return 1;
         }
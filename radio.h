@@ -37,6 +37,25 @@ void radio_connect(void);
 //
 void radio_disconnect(void);
 
+//
+// Read or write all attached radios in parallel.
+// Return the number of failed radios.
+//
+int radio_fleet(int write_flag);
+
+//
+// Write the image to every radio, as it is attached.
+// Never returns.
+//
+void radio_station(void);
+
+//
+// Apply configuration scripts to codeplug images in parallel.
+// Every line of the manifest has a template image, a configuration
+// script and an output file.  Return the number of failed jobs.
+//
+int radio_batch(const char *manifest);
+
 //
 // Read firmware image from the device.
 //
@@ -44,9 +63,16 @@ void radio_download(void);
 
 //
 // Write firmware image to the device.
+// Set cont_flag when the image was just read by radio_download():
+// then only the changes against radio_orig[] need to be written.
 //
 void radio_upload(int cont_flag);
 
+//
+// Print the list of regions which radio_upload() would write.
+//
+void radio_print_plan(int cont_flag);
+
 //
 // Print a generic information about the device.
 //
@@ -67,6 +93,12 @@ void radio_read_image(const char *filename);
 //
 void radio_save_image(const char *filename);
 
+//
+// Remove a header or footer from the image file contents,
+// when reading an image.  Used by drivers.
+//
+void radio_image_skip(unsigned offset, unsigned nbytes);
+
 //
 // Read the configuration from text file, and modify the firmware.
 //
@@ -101,7 +133,7 @@ struct _radio_device_t {
     void (*download)(radio_device_t *radio);
     void (*upload)(radio_device_t *radio, int cont_flag);
     int (*is_compatible)(radio_device_t *radio);
-    void (*read_image)(radio_device_t *radio, FILE *img);
+    void (*read_image)(radio_device_t *radio, unsigned size);
     void (*save_image)(radio_device_t *radio, FILE *img);
     void (*print_version)(radio_device_t *radio, FILE *out);
     void (*print_config)(radio_device_t *radio, FILE *out, int verbose);
@@ -110,8 +142,9 @@ struct _radio_device_t {
     int (*parse_header)(radio_device_t *radio, char *line);
     int (*parse_row)(radio_device_t *radio, int table_id, int first_row, char *line);
     void (*update_timestamp)(radio_device_t *radio);
+    unsigned long long (*fingerprint)(radio_device_t *radio, int read_flag);
     void (*write_csv)(radio_device_t *radio, FILE *csv);
-    int channel_count;
+    void (*print_plan)(radio_device_t *radio, int cont_flag);
 };
 
 extern radio_device_t radio_md380;      // TYT MD-380
@@ -131,17 +164,92 @@ extern radio_device_t radio_d878uv;     // Anytone AT-D878UV
 extern radio_device_t radio_dmr6x2;     // BTECH DMR-6x2
 extern radio_device_t radio_rt84;       // Baofeng DM-1701, Retevis RT84
 
+//
+// Programming session: state of one radio.
+// Every thread works with its own current session;
+// the main thread starts with a default one.
+//
+#define RADIO_MEMSZ (1024*1024*2)            // Up to 2 Mbytes
+
+typedef struct {
+    radio_device_t *device;                 // Device-dependent interface
+    unsigned char *mem;                     // Radio memory contents
+    unsigned char *orig;                    // Memory contents as read from the radio
+    int orig_read;                          // Contents of orig were read from the radio
+    int orig_cached;                        // Contents of orig were taken from cache
+    int progress;                           // Read/write progress counter
+    int shared;                             // Memory contents belong to another session
+    unsigned char *map;                     // Mapped image file, or 0
+    size_t map_size;                        // Size of mapped region
+    int channel_count;                      // Channels parsed from config file
+} dmr_session_t;
+
+extern __thread dmr_session_t *dmr_session;
+
+//
+// Create a session.  With non-zero parent, the memory contents
+// and device type of the parent are shared (read only, for upload).
+//
+dmr_session_t *dmr_session_create(dmr_session_t *parent);
+void dmr_session_destroy(dmr_session_t *s);
+void dmr_session_select(dmr_session_t *s);
+
 //
 // Radio: memory contents.
 //
-extern unsigned char radio_mem[];
+#define radio_mem (dmr_session->mem)
+
+//
+// Radio: memory contents as read from the device.
+//
+#define radio_orig (dmr_session->orig)
+
+//
+// Radio: number of channels parsed from the config file.
+//
+#define radio_channel_count (dmr_session->channel_count)
 
 //
 // File descriptor of serial port with programming cable attached.
 //
 extern int radio_port;
 
+//
+// Keep downloaded images in the cache directory.
+//
+extern int cache_flag;
+
+//
+// Continue an interrupted upload.
+//
+extern int resume_flag;
+
+//
+// Save codeplug images in compressed archive format.
+//
+extern int archive_flag;
+
+//
+// Print what would be written to the radio, without writing.
+//
+extern int dry_run_flag;
+
+//
+// Upload journal, used by drivers.  Before writing a block or sector,
+// check radio_journal_pending(step); after it is written,
+// call radio_journal_commit(step).  Steps are numbered in increasing order.
+//
+int radio_journal_pending(int step);
+void radio_journal_commit(int step);
+int radio_journal_resumed(void);
+
+//
+// Write only changed sectors of the image to DFU device,
+// or with cont_flag=0, sectors not yet recorded in the journal.
+//
+void dfu_upload_changed_sectors(unsigned memsz, int cont_flag);
+
 //
 // Read/write progress counter.
 //
-extern int radio_progress;
+#define radio_progress (dmr_session->progress)
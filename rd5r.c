@@ -30,7 +30,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/stat.h>
 #include "radio.h"
 #include "util.h"
 
@@ -339,27 +338,97 @@ static void rd5r_print_version(radio_device_t *radio, FILE *out)
     }
 }
 
+static bank_t *get_bank(int i);
+static void erase_channel(int i);
+static void erase_zone(int index);
+
 //
-// Read memory image from the device.
+// Mark memory of unused channels, zones and contacts.
+// Bitmaps of channel banks and zones, and the contacts, must be read already.
 //
-static void download(radio_device_t *radio)
+static void mark_unused(uint8_t *unused)
 {
-    int bno;
+    zonetab_t *zt = GET_ZONETAB();
+    int i;
 
-    // Read range 0x80...0x1e29f.
-    for (bno=1; bno<966; bno++) {
-        if (bno >= 248 && bno < 256) {
-            // Skip range 0x7c00...0x8000.
-            continue;
-        }
-        hid_read_block(bno, &radio_mem[bno*128], 128);
+    for (i=0; i<NCHAN; i++) {
+        bank_t *b = get_bank(i >> 7);
 
-        ++radio_progress;
-        if (radio_progress % 32 == 0) {
-            fprintf(stderr, "#");
-            fflush(stderr);
-        }
+        if (! ((b->bitmap[i % 128 / 8] >> (i & 7)) & 1))
+            memset(&unused[(uint8_t*) &b->chan[i % 128] - radio_mem], 1, sizeof(channel_t));
+    }
+    for (i=0; i<NZONES; i++) {
+        if (! ((zt->bitmap[i / 8] >> (i & 7)) & 1))
+            memset(&unused[(uint8_t*) &zt->zone[i] - radio_mem], 1, sizeof(zone_t));
+    }
+    for (i=0; i<NCONTACTS; i++) {
+        contact_t *ct = GET_CONTACT(i);
+
+        if (! VALID_CONTACT(ct))
+            memset(&unused[(uint8_t*) ct - radio_mem], 1, sizeof(contact_t));
+    }
+}
+
+//
+// Fill unused channels and zones in skipped blocks, as erased.
+//
+static void erase_unused(const uint8_t *state)
+{
+    zonetab_t *zt = GET_ZONETAB();
+    int i;
+
+    for (i=0; i<NCHAN; i++) {
+        bank_t *b = get_bank(i >> 7);
+        channel_t *ch = &b->chan[i % 128];
+
+        if (! ((b->bitmap[i % 128 / 8] >> (i & 7)) & 1) &&
+            hid_is_skipped(state, ch, sizeof(*ch)))
+            erase_channel(i);
     }
+    for (i=0; i<NZONES; i++) {
+        zone_t *z = &zt->zone[i];
+
+        if (! ((zt->bitmap[i / 8] >> (i & 7)) & 1) &&
+            hid_is_skipped(state, z, sizeof(*z)))
+            erase_zone(i);
+    }
+}
+
+//
+// Read blocks first...last-1 from the device, except range 0x7c00...0x8000.
+// Bitmaps of channel banks and zones are read first; blocks which
+// contain only unused channels and zones are skipped.
+// Contacts have no bitmap: the contact area is read together with
+// the bitmaps, and contacts with empty names are treated as unused.
+//
+static void read_used_blocks(int first, int last)
+{
+    hid_range_t headers[NCHAN/128 + 3];
+    zonetab_t *zt = GET_ZONETAB();
+    int i;
+
+    for (i=0; i<NCHAN/128; i++) {
+        headers[i].offset = get_bank(i)->bitmap - radio_mem;
+        headers[i].length = sizeof(get_bank(i)->bitmap);
+    }
+    headers[i].offset = zt->bitmap - radio_mem;
+    headers[i].length = sizeof(zt->bitmap);
+    i++;
+    headers[i].offset = OFFSET_CONTACTS;
+    headers[i].length = NCONTACTS * sizeof(contact_t);
+    i++;
+    headers[i].length = 0;
+
+    hid_read_used_blocks(first, last, headers, mark_unused, erase_unused);
+}
+
+//
+// Read memory image from the device.
+//
+static void download(radio_device_t *radio)
+{
+    // Read range 0x80...0x1e29f.
+    read_used_blocks(1, 966);
     //hid_read_finish();
 
     // Clear header and footer.
@@ -381,10 +450,12 @@ static void rd5r_download(radio_device_t *radio)
 
 //
 // Write memory image to the device.
+// When the image was just read from the device,
+// only the changed blocks are written.
 //
 static void rd5r_upload(radio_device_t *radio, int cont_flag)
 {
-    int bno;
+    int bno, nblocks = 0, nwritten = 0;
 
     // Write range 0x80...0x1e29f.
     for (bno=1; bno<966; bno++) {
@@ -392,7 +463,14 @@ static void rd5r_upload(radio_device_t *radio, int cont_flag)
             // Skip range 0x7c00...0x8000.
             continue;
         }
-        hid_write_block(bno, &radio_mem[bno*128], 128);
+        nblocks++;
+        if ((! cont_flag ||
+             memcmp(&radio_mem[bno*128], &radio_orig[bno*128], 128) != 0) &&
+            radio_journal_pending(bno)) {
+            hid_write_block(bno, &radio_mem[bno*128], 128);
+            radio_journal_commit(bno);
+            nwritten++;
+        }
 
         ++radio_progress;
         if (radio_progress % 32 == 0) {
@@ -401,6 +479,9 @@ static void rd5r_upload(radio_device_t *radio, int cont_flag)
         }
     }
     hid_write_finish();
+
+    if (cont_flag || radio_journal_resumed())
+        fprintf(stderr, " %d of %d blocks written,", nwritten, nblocks);
 }
 
 //
@@ -1384,26 +1465,16 @@ static void rd5r_print_config(radio_device_t *radio, FILE *out, int verbose)
 
 //
 // Read memory image from the binary file.
+// File contents are already loaded into radio_mem.
 //
-static void rd5r_read_image(radio_device_t *radio, FILE *img)
+static void rd5r_read_image(radio_device_t *radio, unsigned size)
 {
-    struct stat st;
-
-    // Guess device type by file size.
-    if (fstat(fileno(img), &st) < 0) {
-        fprintf(stderr, "Cannot get file size.\n");
-        exit(-1);
-    }
-    switch (st.st_size) {
+    switch (size) {
     case MEMSZ:
         // IMG file.
-        if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
         break;
     default:
-        fprintf(stderr, "Unrecognized file size %u bytes.\n", (int) st.st_size);
+        fprintf(stderr, "Unrecognized file size %u bytes.\n", size);
         exit(-1);
     }
 }
@@ -1632,7 +1703,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         }
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
         erase_zones();
@@ -1643,7 +1714,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, 5, tot, rxonly, admit,
         colorcode, timeslot, grouplist, contact, 0xffff, 0xffff, BW_12_5_KHZ);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -1759,7 +1830,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
         erase_zones();
@@ -1770,7 +1841,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, squelch, tot, rxonly, admit,
         0, 1, 0, 0, rxtone, txtone, width);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -2191,6 +2262,28 @@ static void rd5r_update_timestamp(radio_device_t *radio)
     timestamp[5] = ((p[10] & 0xf) << 4) | (p[11] & 0xf); // minute
 }
 
+//
+// Compute fingerprint of the codeplug: timestamp and a few sampled blocks.
+// With read_flag, read these blocks from the radio first.
+//
+static unsigned long long rd5r_fingerprint(radio_device_t *radio, int read_flag)
+{
+    static const unsigned sample[] = {
+        OFFSET_TIMESTMP, OFFSET_BANK_0, OFFSET_ZONETAB, OFFSET_BANK_1, OFFSET_GROUPTAB,
+    };
+    unsigned long long hash = 0;
+    int i;
+
+    for (i=0; i<sizeof(sample)/sizeof(sample[0]); i++) {
+        int bno = sample[i] / 128;
+
+        if (read_flag)
+            hid_read_block(bno, &radio_mem[bno*128], 128);
+        hash = hash_fnv(hash, &radio_mem[bno*128], 128);
+    }
+    return hash;
+}
+
 //
 // Check that configuration is correct.
 // Return 0 on error.
@@ -2338,4 +2431,5 @@ radio_device_t radio_rd5r = {
     rd5r_parse_header,
     rd5r_parse_row,
     rd5r_update_timestamp,
+    rd5r_fingerprint,
 };
@@ -37,12 +37,12 @@
     #include <windows.h>
     #include <setupapi.h>
     #include <malloc.h>
-    static void *fd = INVALID_HANDLE_VALUE;
-    static DCB saved_mode;
+    static __thread void *fd = INVALID_HANDLE_VALUE;
+    static __thread DCB saved_mode;
 #else
     #include <termios.h>
-    static int fd = -1;
-    static struct termios saved_mode;
+    static __thread int fd = -1;
+    static __thread struct termios saved_mode;
 #endif
 
 #ifdef __linux__
@@ -55,7 +55,9 @@
 #   include <IOKit/serial/IOSerialKeys.h>
 #endif
 
-static char *dev_path;
+static __thread char *dev_path;
+
+const char *serial_port;                // Port given by user, or 0
 
 static const unsigned char CMD_PRG[]   = "PROGRAM";
 static const unsigned char CMD_PRG2[]  = "\2";
@@ -356,8 +358,10 @@ int serial_open(const char *devname, int baud_rate)
 
 //
 // Find a device path by vid/pid.
+// Skip the first `skip' matching devices.
+// Return the path (dynamically allocated).
 //
-static char *find_path(int vid, int pid)
+static char *find_path(int vid, int pid, int skip)
 {
     char *result = 0;
 
@@ -421,6 +425,29 @@ static char *find_path(int vid, int pid)
         //printf("vendor = %s\n", vendor);
         //printf("product = %s\n", product);
 
+        if (device_location != 0) {
+            // Select by USB bus and address.
+            const char *busnum = udev_device_get_sysattr_value(parent, "busnum");
+            const char *devnum = udev_device_get_sysattr_value(parent, "devnum");
+            if (! busnum || ! devnum ||
+                (strtoul(busnum, 0, 10) << 8 | strtoul(devnum, 0, 10)) != device_location)
+                continue;
+        } else if (skip-- > 0) {
+            // Another radio of the same type.
+            continue;
+        }
+
+        // Identify the radio by serial number, or by USB port.
+        const char *serial  = udev_device_get_sysattr_value(parent, "serial");
+        const char *busnum  = udev_device_get_sysattr_value(parent, "busnum");
+        const char *usbpath = udev_device_get_sysattr_value(parent, "devpath");
+        if (serial && *serial)
+            snprintf(device_identity, sizeof(device_identity), "serial %s", serial);
+        else if (busnum && usbpath)
+            snprintf(device_identity, sizeof(device_identity), "port %s-%s", busnum, usbpath);
+        else
+            device_identity[0] = 0;
+
         // Return result.
         udev_device_unref(parent);
         result = strdup(devpath);
@@ -498,6 +525,11 @@ static char *find_path(int vid, int pid)
             continue;
         }
 
+        if (skip-- > 0) {
+            // Another radio of the same type.
+            continue;
+        }
+
         result = strdup(devname);
         break;
     }
@@ -551,7 +583,7 @@ static char *find_path(int vid, int pid)
 
         // Figure out the COM port name.
         HKEY key = SetupDiOpenDevRegKey(devinfo, &did, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_READ);
-        static char comname[128];
+        static __thread char comname[128];
         DWORD size = sizeof(comname), type = REG_SZ;
         if (ERROR_SUCCESS != RegQueryValueEx(key, "PortName",
             NULL, &type, (LPBYTE)comname, &size)) {
@@ -562,8 +594,13 @@ static char *find_path(int vid, int pid)
         RegCloseKey(key);
         //printf("COM port: %s\n", comname);
 
+        if (skip-- > 0) {
+            // Another radio of the same type.
+            continue;
+        }
+
         // Required device found.
-        result = comname;
+        result = strdup(comname);
         break;
     }
     SetupDiDestroyDeviceInfoList(devinfo);
@@ -578,7 +615,11 @@ static char *find_path(int vid, int pid)
 //
 int serial_init(int vid, int pid)
 {
-    dev_path = find_path(vid, pid);
+    device_identity[0] = 0;
+    if (serial_port)
+        dev_path = strdup(serial_port);
+    else
+        dev_path = find_path(vid, pid, device_index);
     if (!dev_path) {
         if (trace_flag) {
             fprintf(stderr, "Cannot find USB device %04x:%04x\n",
@@ -593,17 +634,105 @@ int serial_init(int vid, int pid)
 }
 
 //
-// Send the command sequence and get back a response.
+// Get the number of attached radios with given vid:pid.
 //
-static int send_recv(const unsigned char *cmd, int cmdlen,
-    unsigned char *response, int reply_len)
+int serial_count(int vid, int pid)
 {
-    unsigned char *p;
-    int len, i, got;
+    char *path;
+    int n = 0;
+
+    if (serial_port)
+        return 1;
+    while ((path = find_path(vid, pid, n)) != 0) {
+        free(path);
+        n++;
+    }
+    return n;
+}
+
+#if defined(__linux__)
+static struct udev *hotplug_udev;
+static struct udev_monitor *hotplug_monitor;
+static int hotplug_vid, hotplug_pid;
+#endif
+
+//
+// Start monitoring for serial radios with given vid:pid.
+// Return -1 when not supported.
+//
+int serial_hotplug_init(int vid, int pid)
+{
+#if defined(__linux__)
+    hotplug_udev = udev_new();
+    if (! hotplug_udev)
+        return -1;
+
+    hotplug_monitor = udev_monitor_new_from_netlink(hotplug_udev, "udev");
+    if (! hotplug_monitor) {
+        udev_unref(hotplug_udev);
+        hotplug_udev = 0;
+        return -1;
+    }
+    udev_monitor_filter_add_match_subsystem_devtype(hotplug_monitor, "tty", NULL);
+    udev_monitor_enable_receiving(hotplug_monitor);
+    hotplug_vid = vid;
+    hotplug_pid = pid;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+//
+// Check for a serial radio attached, without waiting.
+// Return 1 when the event is available.
+//
+int serial_hotplug_poll(hotplug_event_t *ev)
+{
+#if defined(__linux__)
+    struct udev_device *tty;
+    int found = 0;
+
+    if (! hotplug_monitor)
+        return 0;
+
+    // The monitor socket is non-blocking.
+    while (! found && (tty = udev_monitor_receive_device(hotplug_monitor)) != 0) {
+        const char *action = udev_device_get_action(tty);
+        struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(tty,
+               "usb", "usb_device");
+
+        if (action && strcmp(action, "add") == 0 && parent) {
+            const char *idVendor  = udev_device_get_sysattr_value(parent, "idVendor");
+            const char *idProduct = udev_device_get_sysattr_value(parent, "idProduct");
+            const char *busnum    = udev_device_get_sysattr_value(parent, "busnum");
+            const char *devnum    = udev_device_get_sysattr_value(parent, "devnum");
+            const char *devpath   = udev_device_get_sysattr_value(parent, "devpath");
+
+            if (idVendor && idProduct && busnum && devnum && devpath &&
+                strtoul(idVendor, 0, 16) == hotplug_vid &&
+                strtoul(idProduct, 0, 16) == hotplug_pid) {
+                ev->type = 0;
+                ev->location = strtoul(busnum, 0, 10) << 8 | strtoul(devnum, 0, 10);
+                snprintf(ev->port, sizeof(ev->port), "%s-%s", busnum, devpath);
+                found = 1;
+            }
+        }
+        udev_device_unref(tty);
+    }
+    return found;
+#else
+    return 0;
+#endif
+}
+
+//
+// Send the command sequence.
+//
+static void send_cmd(const unsigned char *cmd, int cmdlen)
+{
+    int i;
 
-    //
-    // Send command.
-    //
     if (trace_flag > 0) {
         fprintf(stderr, "----Send [%d] %02x", cmdlen, cmd[0]);
         for (i=1; i<cmdlen; ++i)
@@ -615,10 +744,17 @@ static int send_recv(const unsigned char *cmd, int cmdlen,
         fprintf(stderr, "%s: write error\n", dev_path);
         exit(-1);
     }
+}
+
+//
+// Get a response of given length.
+// Return 0 on timeout.
+//
+static int recv_reply(unsigned char *response, int reply_len)
+{
+    unsigned char *p;
+    int len, i, got;
 
-    //
-    // Get response.
-    //
     p = response;
     len = 0;
     while (len < reply_len) {
@@ -639,6 +775,28 @@ static int send_recv(const unsigned char *cmd, int cmdlen,
     return 1;
 }
 
+//
+// Send the command sequence and get back a response.
+//
+static int send_recv(const unsigned char *cmd, int cmdlen,
+    unsigned char *response, int reply_len)
+{
+    send_cmd(cmd, cmdlen);
+    return recv_reply(response, reply_len);
+}
+
+//
+// Discard any pending input.
+//
+static void flush_input()
+{
+#if defined(__WIN32__) || defined(WIN32)
+    PurgeComm(fd, PURGE_RXCLEAR);
+#else
+    tcflush(fd, TCIFLUSH);
+#endif
+}
+
 //
 // Close the serial port.
 //
@@ -673,7 +831,7 @@ void serial_close()
 //
 const char *serial_identify()
 {
-    static unsigned char reply[16];
+    static __thread unsigned char reply[16];
     unsigned char ack[3];
     int retry = 0;
 
@@ -717,26 +875,84 @@ again:
     return (char*)&reply[1];
 }
 
+//
+// Maximum number of read requests kept in flight.
+// Reduced automatically when the radio fails to keep up.
+//
+#define READ_WINDOW     8
+#define READ_WINDOW_MAX 64
+
+int serial_window = READ_WINDOW;        // Window size requested by user
+
+static __thread int read_window;        // Current window size, or 0 when not set yet
+
+//
+// Send a read request for one data block.
+//
+static void send_read_cmd(unsigned addr, int datasz)
+{
+    unsigned char cmd[6];
+
+    // Read command: 52 aa aa aa aa 10
+    cmd[0] = CMD_READ[0];
+    cmd[1] = addr >> 24;
+    cmd[2] = addr >> 16;
+    cmd[3] = addr >> 8;
+    cmd[4] = addr;
+    cmd[5] = datasz;
+    send_cmd(cmd, 6);
+}
+
+//
+// Read a region of radio memory.
+// Up to read_window requests are sent ahead of the replies,
+// to hide the USB turnaround latency.
+// Replies are matched by the echoed address.
+// On error, the pending input is discarded and only the blocks
+// not yet received are requested again, with a smaller window.
+//
 void serial_read_region(int addr, unsigned char *data, int nbytes)
 {
     static const int DATASZ = 64;
-    unsigned char cmd[6], reply[8 + DATASZ];
-    int n, i, retry = 0;
-
-    for (n=0; n<nbytes; n+=DATASZ) {
-        // Read command: 52 aa aa aa aa 10
-        cmd[0] = CMD_READ[0];
-        cmd[1] = (addr + n) >> 24;
-        cmd[2] = (addr + n) >> 16;
-        cmd[3] = (addr + n) >> 8;
-        cmd[4] = addr + n;
-        cmd[5] = DATASZ;
-again:
-        send_recv(cmd, 6, reply, sizeof(reply));
+    unsigned char reply[8 + DATASZ];
+    int nblocks = (nbytes + DATASZ - 1) / DATASZ;
+    int pending[READ_WINDOW_MAX];
+    int npending = 0, first = 0, next = 0, retry = 0;
+    int i, k;
+
+    if (read_window <= 0) {
+        read_window = serial_window;
+        if (read_window < 1)
+            read_window = 1;
+        if (read_window > READ_WINDOW_MAX)
+            read_window = READ_WINDOW_MAX;
+    }
+
+    char *done = calloc(nblocks, 1);
+    if (!done) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+
+    while (first < nblocks) {
+        // Fill the window with requests.
+        while (npending < read_window && next < nblocks) {
+            if (! done[next]) {
+                send_read_cmd(addr + next*DATASZ, DATASZ);
+                pending[npending++] = next;
+            }
+            next++;
+        }
+
+        if (! recv_reply(reply, sizeof(reply))) {
+            fprintf(stderr, "%s: No reply at address %08x\n",
+                __func__, addr + pending[0]*DATASZ);
+            goto failed;
+        }
         if (reply[0] != CMD_WRITE[0] || reply[7+DATASZ] != CMD_ACK[0]) {
             fprintf(stderr, "%s: Wrong read reply %02x-...-%02x, expected %02x-...-%02x\n",
                 __func__, reply[0], reply[7+DATASZ], CMD_WRITE[0], CMD_ACK[0]);
-            exit(-1);
+            goto failed;
         }
 
         // Compute checksum.
@@ -746,45 +962,170 @@ again:
         if (reply[6+DATASZ] != sum) {
             fprintf(stderr, "%s: Wrong read checksum %02x, expected %02x\n",
                 __func__, sum, reply[6+DATASZ]);
-            if (retry++ < 3)
-                goto again;
+            goto failed;
+        }
+
+        // Find the request by address.
+        unsigned raddr = reply[1] << 24 | reply[2] << 16 | reply[3] << 8 | reply[4];
+        for (k=0; k<npending; k++) {
+            if (addr + pending[k]*DATASZ == raddr)
+                break;
+        }
+        if (k >= npending) {
+            fprintf(stderr, "%s: Unexpected reply address %08x\n",
+                __func__, raddr);
+            goto failed;
+        }
+
+        // Store data, remove the request from the window.
+        int bno = pending[k];
+        int n = nbytes - bno*DATASZ;
+        if (n > DATASZ)
+            n = DATASZ;
+        memcpy(data + bno*DATASZ, reply + 6, n);
+        done[bno] = 1;
+        retry = 0;
+        npending--;
+        memmove(&pending[k], &pending[k+1], (npending - k) * sizeof(pending[0]));
+        while (first < nblocks && done[first])
+            first++;
+        continue;
+failed:
+        if (retry++ >= 3) {
             exit(-1);
         }
 
-        memcpy(data + n, reply + 6, DATASZ);
+        // Drop stale replies and restart from the first missing block.
+        mdelay(100);
+        flush_input();
+        npending = 0;
+        next = first;
+        if (read_window > 1) {
+            read_window /= 2;
+            if (trace_flag)
+                fprintf(stderr, "%s: Reduce read window to %d\n",
+                    __func__, read_window);
+        }
     }
+    free(done);
 }
 
-void serial_write_region(int addr, unsigned char *data, int nbytes)
-{
-    //static const int DATASZ = 64;
-    static const int DATASZ = 16;
-    unsigned char ack, cmd[8 + DATASZ];
-    int n, i;
-
-    for (n=0; n<nbytes; n+=DATASZ) {
-        // Write command: 57 aa aa aa aa 10 .. .. ss nn
-        cmd[0] = CMD_WRITE[0];
-        cmd[1] = (addr + n) >> 24;
-        cmd[2] = (addr + n) >> 16;
-        cmd[3] = (addr + n) >> 8;
-        cmd[4] = addr + n;
-        cmd[5] = DATASZ;
-        memcpy(cmd + 6, data + n, DATASZ);
-
-        // Compute checksum.
-        unsigned char sum = cmd[1];
-        for (i=2; i<6+DATASZ; i++)
-            sum += cmd[i];
+//
+// Sizes of write chunks, largest first.
+// Only 16 bytes are known to work on all radios.
+// A larger size is adopted only after the first chunk of that size
+// has been read back and compared, and is dropped when the radio
+// rejects a chunk or stores it incompletely.
+//
+static const int WRITE_SIZES[] = { 128, 64, 32, 16 };
+#define NWRITE_SIZES    (sizeof(WRITE_SIZES) / sizeof(WRITE_SIZES[0]))
 
-        cmd[6 + DATASZ] = sum;
-        cmd[7 + DATASZ] = CMD_ACK[0];
+static __thread unsigned write_size_index;                      // Index of largest size to try
+static __thread unsigned write_size_verified = NWRITE_SIZES-1;  // Index of largest verified size
 
-        send_recv(cmd, 8 + DATASZ, &ack, 1);
-        if (ack != CMD_ACK[0]) {
+//
+// Write one chunk of data.
+// Return 1 when acknowledged by the radio.
+//
+static int write_chunk(unsigned addr, const unsigned char *data, int datasz)
+{
+    unsigned char ack, cmd[8 + 128];
+    int i;
+
+    // Write command: 57 aa aa aa aa 10 .. .. ss nn
+    cmd[0] = CMD_WRITE[0];
+    cmd[1] = addr >> 24;
+    cmd[2] = addr >> 16;
+    cmd[3] = addr >> 8;
+    cmd[4] = addr;
+    cmd[5] = datasz;
+    memcpy(cmd + 6, data, datasz);
+
+    // Compute checksum.
+    unsigned char sum = cmd[1];
+    for (i=2; i<6+datasz; i++)
+        sum += cmd[i];
+
+    cmd[6 + datasz] = sum;
+    cmd[7 + datasz] = CMD_ACK[0];
+
+    ack = 0;
+    if (! send_recv(cmd, 8 + datasz, &ack, 1) || ack != CMD_ACK[0]) {
+        if (trace_flag)
             fprintf(stderr, "%s: Wrong acknowledge %#x, expected %#x\n",
                 __func__, ack, CMD_ACK[0]);
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Compare radio memory with the given data.
+// Return 1 when they match.
+//
+static int compare_chunk(unsigned addr, const unsigned char *data, int datasz)
+{
+    unsigned char buf[128];
+
+    serial_read_region(addr, buf, datasz);
+    return memcmp(buf, data, datasz) == 0;
+}
+
+void serial_write_region(int addr, unsigned char *data, int nbytes)
+{
+    int n, datasz, k, retry = 0;
+
+    for (n=0; n<nbytes; n+=datasz) {
+        // Use the largest size which fits into the rest.
+        // Odd tails, less than 16 bytes, are written as is.
+        k = write_size_index;
+        while (k < NWRITE_SIZES-1 && WRITE_SIZES[k] > nbytes - n)
+            k++;
+        datasz = WRITE_SIZES[k];
+        if (datasz > nbytes - n)
+            datasz = nbytes - n;
+
+        if (k >= write_size_verified) {
+            if (write_chunk(addr + n, data + n, datasz)) {
+                retry = 0;
+                continue;
+            }
+        } else {
+            // New size: make sure the radio took the whole chunk.
+            // A chunk which is already in place proves nothing,
+            // so try the next one.
+            if (compare_chunk(addr + n, data + n, datasz))
+                continue;
+
+            if (write_chunk(addr + n, data + n, datasz) &&
+                compare_chunk(addr + n, data + n, datasz)) {
+                write_size_verified = k;
+                if (trace_flag)
+                    fprintf(stderr, "%s: Write chunk size %d bytes\n",
+                        __func__, datasz);
+                retry = 0;
+                continue;
+            }
+            if (trace_flag)
+                fprintf(stderr, "%s: Chunk of %d bytes not stored at address %08x\n",
+                    __func__, datasz, addr + n);
+        }
+
+        // Chunk rejected: drop stale input.
+        mdelay(100);
+        flush_input();
+        if (k < write_size_verified) {
+            // Fall back to a smaller chunk size, and write this chunk again.
+            write_size_index = k + 1;
+            if (trace_flag)
+                fprintf(stderr, "%s: Reduce write chunk size to %d bytes\n",
+                    __func__, WRITE_SIZES[write_size_index]);
+        } else if (retry++ >= 3) {
+            fprintf(stderr, "%s: Cannot write at address %08x\n",
+                __func__, addr + n);
             exit(-1);
         }
+        datasz = 0;
     }
+    radio_written(data, nbytes);
 }
@@ -0,0 +1,145 @@
+/*
+ * Compare the sort of the contact ID map in D868UV driver with
+ * the insertion into a sorted array, used before, and print the time
+ * of both.  The maps must have the same entries, sorted by ID.
+ * The insertion does not keep contacts with the same ID in index order,
+ * so only the order of such contacts may differ.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "../d868uv.c"
+#include <time.h>
+
+//
+// Environment of the driver.
+//
+int trace_flag;
+int verify_blank_flag;
+__thread dmr_session_t *dmr_session;
+
+void serial_read_region(int addr, unsigned char *data, int nbytes) {}
+void serial_write_region(int addr, unsigned char *data, int nbytes) {}
+int radio_journal_pending(int step) { return 1; }
+void radio_journal_commit(int step) {}
+int radio_is_compatible(const char *ident) { return 1; }
+void radio_written(const unsigned char *data, int nbytes) {}
+void dfu_read_block(int bno, unsigned char *data, int nbytes) {}
+void dfu_write_block(int bno, unsigned char *data, int nbytes) {}
+
+//
+// The map as built before: insert every item into the sorted array,
+// shifting the rest.  The array must be filled with 0xff.
+//
+static void insertion_sort(uint64_t *map, const uint64_t *items, int n)
+{
+    int index, k;
+
+    for (index=0; index<n; index++) {
+        uint64_t item = items[index];
+
+        for (k=0; k<NCONTACTS; k++) {
+            if (map[k] == item) {
+                // The item is already in the list.
+                break;
+            }
+            if (map[k] == 0xffffffffffffffff) {
+                // Append to the end of the list.
+                map[k] = item;
+                break;
+            }
+            if ((uint32_t)map[k] > (uint32_t)item) {
+                // Insert item there and shift the rest.
+                uint64_t prev = map[k];
+                map[k] = item;
+                item = prev;
+            }
+        }
+    }
+}
+
+static double msec(clock_t t0, clock_t t1)
+{
+    return (t1 - t0) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+//
+// Build the map of n contacts both ways, and compare.
+// IDs are taken from a range of n/2 values, so that many repeat,
+// and some contacts are groups.
+// Return 1 on success.
+//
+static int benchmark(int n)
+{
+    static uint64_t items[NCONTACTS], old_map[NCONTACTS], new_map[NCONTACTS];
+    const int N = 5;
+    clock_t t0, t1, t2;
+    int i, index, nswapped = 0;
+
+    srandom(n);
+    for (index=0; index<n; index++) {
+        uint64_t id = 1 + random() % (n/2 + 1);
+
+        items[index] = id << 1 | (random() % 4 == 0) | (uint64_t) index << 32;
+    }
+
+    t0 = clock();
+    for (i=0; i<N; i++) {
+        memset(old_map, 0xff, sizeof(old_map));
+        insertion_sort(old_map, items, n);
+    }
+    t1 = clock();
+    for (i=0; i<N; i++) {
+        memcpy(new_map, items, n * sizeof(items[0]));
+        qsort(new_map, n, sizeof(new_map[0]), compare_contact_map);
+    }
+    t2 = clock();
+
+    for (i=0; i<n; i++) {
+        if ((uint32_t) old_map[i] != (uint32_t) new_map[i]) {
+            printf("FAIL: %d contacts: wrong ID at entry %d\n", n, i);
+            return 0;
+        }
+        if (old_map[i] != new_map[i])
+            nswapped++;
+    }
+    qsort(old_map, n, sizeof(old_map[0]), compare_contact_map);
+    if (memcmp(old_map, new_map, n * sizeof(items[0])) != 0) {
+        printf("FAIL: %d contacts: entries differ\n", n);
+        return 0;
+    }
+    printf("%5d contacts: insertion %8.2f msec, qsort %6.2f msec, %d entries in other order\n",
+        n, msec(t0, t1) / N, msec(t1, t2) / N, nswapped);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    static const int size[] = { 1000, 2500, 5000, NCONTACTS, 0 };
+    int i, ok = 1;
+
+    for (i=0; size[i]; i++)
+        ok &= benchmark(size[i]);
+    return ok ? 0 : 1;
+}
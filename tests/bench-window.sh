@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Measure the time to read the codeplug from a simulated D868UV radio,
+# with different sizes of the read window.
+#
+# Usage: bench-window.sh [path/to/dmrconfig] [latency-usec]
+#
+dmrconfig=$(realpath ${1:-../dmrconfig})
+latency=${2:-1000}
+fake=$(realpath ./fake-d868uv)
+conf=$(realpath ../examples/d868uv-rmham-2018-10-20.conf)
+work=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; wait; rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+#
+# Start the simulator with given options, set $pid and $port.
+#
+start() {
+    rm -f port.txt
+    $fake "$@" > port.txt &
+    pid=$!
+    while [ ! -s port.txt ]; do sleep 0.1; done
+    port=$(cat port.txt)
+}
+
+stop() {
+    kill $pid
+    wait $pid
+}
+
+# Prepare the contents of radio memory.
+start -o radio.img
+$dmrconfig --port $port -c $conf > config.log 2>&1 || {
+    echo "Cannot configure the radio"
+    tail -1 config.log
+    exit 1
+}
+stop
+
+echo "Reply latency $latency usec"
+for window in 1 2 4 8 16 32; do
+    start -i radio.img -l $latency
+    t0=$(date +%s.%N)
+    $dmrconfig --port $port --window $window -r > read.log 2>&1 || {
+        echo "Window $window: read failed"
+        tail -1 read.log
+        exit 1
+    }
+    t1=$(date +%s.%N)
+    stop
+    echo "$window $t0 $t1" | awk '{ printf "Window %2d: %.2f sec\n", $1, $3 - $2 }'
+done
@@ -0,0 +1,397 @@
+/*
+ * Simulator of Anytone D868UV radio on a pseudo-terminal.
+ * Used for testing the serial protocol without real hardware.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/time.h>
+
+//
+// Address map of the radio memory, same as in dmrconfig.
+//
+typedef struct {
+    unsigned address;
+    unsigned length;
+    unsigned offset;
+} fragment_t;
+
+static fragment_t region_map[] = {
+#include "../d868uv-map.h"
+};
+
+#define ACK             0x06
+#define NAK             0x15
+
+//
+// Reply, delayed by the simulated latency.
+//
+typedef struct {
+    long long       due;            // Time to send, in microseconds
+    int             len;
+    unsigned char   data[8 + 255];
+} reply_t;
+
+#define MAXQUEUE        256
+
+static reply_t queue[MAXQUEUE];
+static int queue_first, queue_count;
+
+static unsigned char *mem;          // Contents of radio memory
+static unsigned memsz;              // Size of radio memory
+static unsigned *file_offset;       // File offset of every fragment
+static int nfragments;
+
+static int latency;                 // Reply latency in microseconds
+static int max_write = 255;         // Largest write chunk accepted
+static int store_write = 255;       // Number of bytes stored from write chunk
+static const char *ident = "D868UVE";
+static const char *dump_file;
+static volatile sig_atomic_t done;
+
+static void usage()
+{
+    fprintf(stderr, "Simulator of D868UV radio on a pseudo-terminal.\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    fake-d868uv [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -i file.img  Initial contents of radio memory.\n");
+    fprintf(stderr, "    -r seed      Fill radio memory with pseudo-random data.\n");
+    fprintf(stderr, "    -o file.img  Save radio memory after every session.\n");
+    fprintf(stderr, "    -l usec      Delay every reply by given time.\n");
+    fprintf(stderr, "    -m nbytes    Reject write chunks larger than given size.\n");
+    fprintf(stderr, "    -s nbytes    Store only first bytes of every write chunk.\n");
+    fprintf(stderr, "    -n ident     Radio identifier, default D868UVE.\n");
+    fprintf(stderr, "The name of pseudo-terminal is printed on stdout.\n");
+    exit(-1);
+}
+
+static long long now()
+{
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static void on_signal(int sig)
+{
+    done = 1;
+}
+
+//
+// Find a byte of radio memory by address.
+// Return 0 when the address is not mapped.
+//
+static unsigned char *lookup(unsigned addr)
+{
+    static int last;
+    int i;
+
+    if (addr - region_map[last].address < region_map[last].length)
+        return &mem[file_offset[last] + addr - region_map[last].address];
+
+    for (i=0; i<nfragments; i++) {
+        if (addr - region_map[i].address < region_map[i].length) {
+            last = i;
+            return &mem[file_offset[i] + addr - region_map[i].address];
+        }
+    }
+    return 0;
+}
+
+static void save_memory()
+{
+    FILE *f;
+
+    if (! dump_file)
+        return;
+    f = fopen(dump_file, "w");
+    if (! f) {
+        perror(dump_file);
+        return;
+    }
+    fwrite(mem, 1, memsz, f);
+    fclose(f);
+}
+
+//
+// Put a reply into the queue.
+//
+static void reply(const unsigned char *data, int len)
+{
+    reply_t *r;
+
+    if (queue_count >= MAXQUEUE) {
+        fprintf(stderr, "fake-d868uv: Reply queue overflow\n");
+        return;
+    }
+    r = &queue[(queue_first + queue_count) % MAXQUEUE];
+    r->due = now() + latency;
+    r->len = len;
+    memcpy(r->data, data, len);
+    queue_count++;
+}
+
+static void reply_byte(int c)
+{
+    unsigned char b = c;
+
+    reply(&b, 1);
+}
+
+//
+// Process one command from the input buffer.
+// Return the number of bytes consumed, or 0 when the command is not complete.
+//
+static int process(const unsigned char *buf, int len)
+{
+    unsigned char data[8 + 255], sum;
+    unsigned addr;
+    int n, i;
+
+    switch (buf[0]) {
+    case 'P':
+        if (len < 7)
+            return 0;
+        if (memcmp(buf, "PROGRAM", 7) != 0)
+            return 1;
+        reply((const unsigned char*) "QX\6", 3);
+        return 7;
+
+    case 2:
+        memset(data, 0, 16);
+        strncpy((char*) data + 1, ident, 7);
+        data[0] = 'I';
+        memcpy(data + 9, "V102", 4);
+        data[15] = ACK;
+        reply(data, 16);
+        return 1;
+
+    case 'E':
+        if (len < 3)
+            return 0;
+        if (memcmp(buf, "END", 3) != 0)
+            return 1;
+        reply_byte(ACK);
+        save_memory();
+        return 3;
+
+    case 'R':
+        // Read: 52 aa aa aa aa nn
+        if (len < 6)
+            return 0;
+        addr = buf[1] << 24 | buf[2] << 16 | buf[3] << 8 | buf[4];
+        n = buf[5];
+        memcpy(data, buf, 6);
+        data[0] = 'W';
+        for (i=0; i<n; i++) {
+            unsigned char *p = lookup(addr + i);
+            data[6 + i] = p ? *p : 0xff;
+        }
+        sum = 0;
+        for (i=1; i<6+n; i++)
+            sum += data[i];
+        data[6 + n] = sum;
+        data[7 + n] = ACK;
+        reply(data, 8 + n);
+        return 6;
+
+    case 'W':
+        // Write: 57 aa aa aa aa nn .. .. ss 06
+        if (len < 6)
+            return 0;
+        n = buf[5];
+        if (len < 8 + n)
+            return 0;
+        sum = 0;
+        for (i=1; i<6+n; i++)
+            sum += buf[i];
+        if (sum != buf[6 + n] || buf[7 + n] != ACK || n > max_write) {
+            reply_byte(NAK);
+            return 8 + n;
+        }
+        addr = buf[1] << 24 | buf[2] << 16 | buf[3] << 8 | buf[4];
+        for (i=0; i<n && i<store_write; i++) {
+            unsigned char *p = lookup(addr + i);
+            if (p)
+                *p = buf[6 + i];
+        }
+        reply_byte(ACK);
+        return 8 + n;
+
+    default:
+        // Unknown byte: ignore.
+        return 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *image_file = 0;
+    unsigned char buf[4096];
+    int master, slave, len, i, n;
+    unsigned seed = 0;
+    struct termios mode;
+
+    for (;;) {
+        switch (getopt(argc, argv, "i:r:o:l:m:s:n:")) {
+        case 'i': image_file = optarg;            continue;
+        case 'r': seed = strtoul(optarg, 0, 0);   continue;
+        case 'o': dump_file = optarg;             continue;
+        case 'l': latency = strtol(optarg, 0, 0); continue;
+        case 'm': max_write = strtol(optarg, 0, 0); continue;
+        case 's': store_write = strtol(optarg, 0, 0); continue;
+        case 'n': ident = optarg;                 continue;
+        case -1:
+            break;
+        default:
+            usage();
+        }
+        break;
+    }
+    if (optind != argc)
+        usage();
+
+    // Compute file offsets of memory fragments.
+    nfragments = sizeof(region_map) / sizeof(region_map[0]) - 1;
+    file_offset = calloc(nfragments, sizeof(unsigned));
+    for (i=0; i<nfragments; i++) {
+        file_offset[i] = memsz;
+        memsz += region_map[i].length;
+    }
+
+    // Fill memory: from image, random or erased.
+    mem = malloc(memsz);
+    if (! file_offset || ! mem) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    memset(mem, 0xff, memsz);
+    if (image_file) {
+        FILE *f = fopen(image_file, "r");
+        if (! f) {
+            perror(image_file);
+            exit(-1);
+        }
+        if (fread(mem, 1, memsz, f) != memsz) {
+            fprintf(stderr, "%s: Image too short, need %u bytes\n", image_file, memsz);
+            exit(-1);
+        }
+        fclose(f);
+    } else if (seed) {
+        srandom(seed);
+        for (i=0; i<memsz; i++)
+            mem[i] = random();
+    }
+    if (! image_file) {
+        // Model name at 0x02fa0010, as on a real radio.
+        memset(mem, 0, 16);
+        strncpy((char*) mem, ident, 16);
+    }
+
+    // Create pseudo-terminal.
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        exit(-1);
+    }
+
+    // Keep the slave side open, so that the master survives
+    // the close by dmrconfig.
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror(ptsname(master));
+        exit(-1);
+    }
+    tcgetattr(slave, &mode);
+    cfmakeraw(&mode);
+    tcsetattr(slave, TCSANOW, &mode);
+
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    len = 0;
+    while (! done) {
+        struct pollfd p;
+        int timeout = 100;          // Check for signals periodically
+
+        // Send the replies which are due.
+        while (queue_count > 0) {
+            reply_t *r = &queue[queue_first];
+            long long delay = r->due - now();
+
+            if (delay > 0) {
+                if (delay < 100000)
+                    timeout = (delay + 999) / 1000;
+                break;
+            }
+            if (write(master, r->data, r->len) != r->len) {
+                perror("write");
+                exit(-1);
+            }
+            queue_first = (queue_first + 1) % MAXQUEUE;
+            queue_count--;
+        }
+
+        p.fd = master;
+        p.events = POLLIN;
+        if (poll(&p, 1, timeout) <= 0)
+            continue;
+
+        n = read(master, buf + len, sizeof(buf) - len);
+        if (n <= 0) {
+            if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EIO) {
+                perror("read");
+                exit(-1);
+            }
+            continue;
+        }
+        len += n;
+
+        // Parse received commands.
+        while (len > 0) {
+            n = process(buf, len);
+            if (n == 0)
+                break;
+            len -= n;
+            memmove(buf, buf + n, len);
+        }
+    }
+    save_memory();
+    return 0;
+}
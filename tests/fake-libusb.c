@@ -0,0 +1,780 @@
+/*
+ * Replacement of libusb library, which simulates several HID radios
+ * (Radioddity GD-77, Baofeng RD-5R or DM-1801) for testing fleet and
+ * station modes, and DFU radios (TYT MD-380) for testing the DFU protocol.
+ *
+ * Radios are given by environment variable FAKE_RADIOS, as a comma
+ * separated list of image files: 128 kbytes for HID radio, or 256 kbytes
+ * of flash memory for DFU radio.  Images are mapped into memory,
+ * so the radio memory is shared between processes, and changes
+ * made by dmrconfig go directly to the files.
+ * The base name of the image file is reported as the USB serial number.
+ *
+ * Other variables:
+ *  FAKE_LATENCY=usec   Delay every reply by given time, default 200.
+ *  FAKE_FAIL=n:count   Radio n stops responding after count requests.
+ *  FAKE_HOTPLUG=file   Radios are attached and detached by lines "+n"
+ *                      and "-n", appended to the file.  Initially
+ *                      all radios are detached.
+ *  FAKE_DFU_BUSY=n:ms  After every DNLOAD request, DFU radio reports
+ *                      dfuDNBUSY state to n status requests, with poll
+ *                      timeout of given msec.
+ *  FAKE_DFU_FAIL=n     The n-th UPLOAD request of data stalls.
+ *  FAKE_DFU_STATS=1    Print statistics of DFU status polls on exit.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// Prototype of this function differs between libusb versions.
+#define libusb_hotplug_register_callback libusb_hotplug_register_callback_unused
+#include <libusb.h>
+#undef libusb_hotplug_register_callback
+
+#define HID_VID         0x15a2
+#define HID_PID         0x0073
+#define HID_MEMSZ       0x20000
+#define DFU_VID         0x0483
+#define DFU_PID         0xdf11
+#define DFU_MEMSZ       0x40000
+#define MAXRADIOS       32
+#define MAXREPLIES      16
+#define MAXCALLBACKS    8
+
+//
+// Simulated radio.
+//
+struct libusb_device {
+    unsigned char   *mem;                   // Radio memory, mapped from file
+    unsigned        memsz;                  // Size of memory
+    unsigned        vid, pid;               // USB vendor and product ID
+    const char      *serial;                // Serial number
+    int             present;                // Radio is attached
+    int             address;                // USB address
+    unsigned        bank;                   // Offset of selected memory bank
+    int             nrequests;              // Number of requests received
+    int             fail_after;             // Stop responding after that many requests
+
+    unsigned char   reply[MAXREPLIES][42];  // Replies not yet received
+    long long       due[MAXREPLIES];        // Time when reply is ready, usec
+    int             nreplies;
+
+    struct libusb_transfer *pending[MAXREPLIES]; // Submitted receive transfers
+    int             npending;
+
+    int             dfu_state;              // DFU state
+    int             dfu_status;             // DFU status
+    int             dfu_busy;               // Status polls left in dfuDNBUSY
+    long long       dfu_poll_due;           // Time of the next status poll, usec
+    unsigned        dfu_addr;               // Address set by command 0x21
+    int             dfu_nuploads;           // Number of UPLOAD requests of data
+};
+
+//
+// DFU requests and states.
+//
+enum {
+    DFU_DETACH, DFU_DNLOAD, DFU_UPLOAD, DFU_GETSTATUS,
+    DFU_CLRSTATUS, DFU_GETSTATE, DFU_ABORT,
+};
+
+enum {
+    appIDLE, appDETACH, dfuIDLE, dfuDNLOAD_SYNC, dfuDNBUSY, dfuDNLOAD_IDLE,
+    dfuMANIFEST_SYNC, dfuMANIFEST, dfuMANIFEST_WAIT_RESET, dfuUPLOAD_IDLE,
+    dfuERROR,
+};
+
+#define errSTALLEDPKT   0x0f
+
+struct libusb_context {
+    int             unused;
+};
+
+static libusb_device radio[MAXRADIOS];
+static int nradios;
+static int latency = 200;
+
+static int dfu_busy_polls;                  // Polls in dfuDNBUSY after DNLOAD
+static int dfu_poll_msec;                   // Poll timeout in dfuDNBUSY
+static int dfu_fail_upload;                 // UPLOAD request to stall
+static int dfu_ndownloads;                  // Statistics: DNLOAD requests
+static int dfu_npolls;                      // Statistics: polls in dfuDNBUSY
+static int dfu_nearly;                      // Statistics: polls before timeout
+
+//
+// Hotplug callback, registered by dmrconfig.
+//
+static struct {
+    int             events;
+    int             vendor_id, product_id;
+    libusb_hotplug_callback_fn cb_fn;
+    void            *user_data;
+} callback[MAXCALLBACKS];
+static int ncallbacks;
+static const char *hotplug_file;            // File with attach/detach events
+static off_t hotplug_size;                  // Size of the file already seen
+
+static int update_hotplug(void);
+
+static long long now()
+{
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+//
+// Map the images of radios, given by FAKE_RADIOS.
+//
+static void setup()
+{
+    static int done;
+    char *list, *name, *env;
+
+    if (done)
+        return;
+    done = 1;
+
+    env = getenv("FAKE_LATENCY");
+    if (env)
+        latency = strtol(env, 0, 0);
+
+    env = getenv("FAKE_RADIOS");
+    if (! env)
+        return;
+    list = strdup(env);
+    for (name = strtok(list, ","); name && nradios < MAXRADIOS; name = strtok(0, ",")) {
+        libusb_device *r = &radio[nradios];
+        int fd = open(name, O_RDWR);
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(name);
+            exit(-1);
+        }
+        if (st.st_size == DFU_MEMSZ) {
+            r->memsz = DFU_MEMSZ;
+            r->vid = DFU_VID;
+            r->pid = DFU_PID;
+            r->dfu_state = dfuIDLE;
+        } else {
+            r->memsz = HID_MEMSZ;
+            r->vid = HID_VID;
+            r->pid = HID_PID;
+        }
+        r->mem = mmap(0, r->memsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (r->mem == MAP_FAILED) {
+            perror(name);
+            exit(-1);
+        }
+        close(fd);
+        r->serial = strdup(strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+        r->present = 1;
+        r->address = ++nradios;
+    }
+    free(list);
+
+    env = getenv("FAKE_FAIL");
+    if (env) {
+        int n = strtol(env, &env, 0);
+
+        if (n >= 1 && n <= nradios && *env == ':')
+            radio[n-1].fail_after = strtol(env+1, 0, 0);
+    }
+
+    env = getenv("FAKE_DFU_BUSY");
+    if (env) {
+        dfu_busy_polls = strtol(env, &env, 0);
+        if (*env == ':')
+            dfu_poll_msec = strtol(env+1, 0, 0);
+    }
+    env = getenv("FAKE_DFU_FAIL");
+    if (env)
+        dfu_fail_upload = strtol(env, 0, 0);
+
+    hotplug_file = getenv("FAKE_HOTPLUG");
+    if (hotplug_file) {
+        int i;
+
+        for (i=0; i<nradios; i++)
+            radio[i].present = 0;
+        hotplug_size = -1;
+        update_hotplug();
+    }
+}
+
+//
+// Call the registered callbacks for the radio.
+//
+static void notify(libusb_device *r, int event)
+{
+    int k;
+
+    for (k=0; k<ncallbacks; k++) {
+        if ((callback[k].events & event) &&
+            (callback[k].vendor_id == LIBUSB_HOTPLUG_MATCH_ANY ||
+             callback[k].vendor_id == r->vid) &&
+            (callback[k].product_id == LIBUSB_HOTPLUG_MATCH_ANY ||
+             callback[k].product_id == r->pid))
+            callback[k].cb_fn(0, r, event, callback[k].user_data);
+    }
+}
+
+//
+// When the hotplug file has changed, replay it to get the radios
+// attached now, and report the changes.
+// Return the number of changes.
+//
+static int update_hotplug()
+{
+    int present[MAXRADIOS] = {0}, i, n, nchanges = 0;
+    char line[32];
+    struct stat st;
+    FILE *f;
+
+    if (! hotplug_file || stat(hotplug_file, &st) < 0 ||
+        st.st_size == hotplug_size)
+        return 0;
+    hotplug_size = st.st_size;
+
+    f = fopen(hotplug_file, "r");
+    if (! f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        n = atoi(line + 1);
+        if (n >= 1 && n <= nradios)
+            present[n-1] = (line[0] == '+');
+    }
+    fclose(f);
+
+    for (i=0; i<nradios; i++) {
+        if (radio[i].present != present[i]) {
+            radio[i].present = present[i];
+            notify(&radio[i], present[i] ? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED :
+                                           LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+            nchanges++;
+        }
+    }
+    return nchanges;
+}
+
+//
+// Process a request, and queue the reply.
+// Request format: 01 00 nn 00 data...
+// Reply format:   03 00 nn 00 data...
+//
+static void process(libusb_device *r, const unsigned char *req)
+{
+    const unsigned char *cmd = req + 4;
+    unsigned char *reply;
+    unsigned addr;
+    int len = req[2];
+
+    if (r->nreplies >= MAXREPLIES) {
+        fprintf(stderr, "fake-libusb: Reply queue overflow\n");
+        return;
+    }
+    reply = r->reply[r->nreplies];
+    memset(reply, 0, 42);
+    reply[0] = 3;
+
+    if (len == 2 && cmd[0] == 'M' && cmd[1] == 2) {
+        // Identifier.
+        reply[2] = 16;
+        memcpy(reply + 4, r->mem, 16);
+
+    } else if (len == 8 && memcmp(cmd, "CWB", 3) == 0) {
+        // Select memory bank.
+        r->bank = cmd[5] << 16;
+        reply[2] = 1;
+        reply[4] = 'A';
+
+    } else if (cmd[0] == 'R') {
+        // Read 32 bytes.
+        addr = r->bank + (cmd[1] << 8 | cmd[2]);
+        reply[2] = 36;
+        reply[4] = 'W';
+        memcpy(reply + 5, cmd + 1, 3);
+        memcpy(reply + 8, &r->mem[addr % HID_MEMSZ], 32);
+
+    } else if (cmd[0] == 'W') {
+        // Write 32 bytes.
+        addr = r->bank + (cmd[1] << 8 | cmd[2]);
+        memcpy(&r->mem[addr % HID_MEMSZ], cmd + 4, 32);
+        reply[2] = 1;
+        reply[4] = 'A';
+
+    } else {
+        // PROGRA, acknowledge, ENDR, ENDW.
+        reply[2] = 1;
+        reply[4] = 'A';
+    }
+    r->due[r->nreplies++] = now() + latency;
+}
+
+//
+// DFU radio: get pointer to flash memory at given address.
+// Configuration memory is at 0...0x40000, extended memory from 0x110000.
+// Return 0 when out of range.
+//
+static unsigned char *dfu_memory(libusb_device *r, unsigned addr, unsigned nbytes)
+{
+    if (addr >= 0x110000)
+        addr -= 0xd0000;
+    if (addr + nbytes > r->memsz)
+        return 0;
+    return &r->mem[addr];
+}
+
+//
+// DFU radio: the request is not allowed in the current state.
+//
+static int dfu_stall(libusb_device *r)
+{
+    r->dfu_state = dfuERROR;
+    r->dfu_status = errSTALLEDPKT;
+    return LIBUSB_ERROR_PIPE;
+}
+
+//
+// DFU radio: execute the command, sent by DNLOAD request with block 0.
+//
+static void dfu_command(libusb_device *r, const unsigned char *cmd, int len)
+{
+    unsigned addr = (len == 5) ? cmd[1] | cmd[2] << 8 | cmd[3] << 16 | cmd[4] << 24 : 0;
+    unsigned char *mem;
+
+    if (len == 5 && cmd[0] == 0x21) {
+        // Set address.
+        r->dfu_addr = addr;
+    } else if (len == 5 && cmd[0] == 0x41) {
+        // Erase 64-kbyte sector.
+        mem = dfu_memory(r, addr, 0x10000);
+        if (mem)
+            memset(mem, 0xff, 0x10000);
+    }
+    // Otherwise: enter programming mode, identify, reboot.
+}
+
+//
+// DFU radio: process the request.
+// Return the number of bytes transferred, or negative error code.
+//
+static int dfu_request(libusb_device *r, uint8_t bRequest, uint16_t wValue,
+    unsigned char *data, uint16_t wLength)
+{
+    unsigned char *mem;
+    unsigned timeout = 0;
+
+    switch (bRequest) {
+    case DFU_DETACH:
+        r->dfu_state = dfuIDLE;
+        return 0;
+
+    case DFU_DNLOAD:
+        // Commands are accepted after upload, data are not.
+        if (r->dfu_state != dfuIDLE && r->dfu_state != dfuDNLOAD_IDLE &&
+            ! (r->dfu_state == dfuUPLOAD_IDLE && wValue == 0))
+            return dfu_stall(r);
+        if (wValue == 0) {
+            dfu_command(r, data, wLength);
+        } else {
+            mem = dfu_memory(r, r->dfu_addr + (wValue - 2) * wLength, wLength);
+            if (mem)
+                memcpy(mem, data, wLength);
+        }
+        r->dfu_state = dfuDNLOAD_SYNC;
+        r->dfu_busy = dfu_busy_polls;
+        dfu_ndownloads++;
+        return wLength;
+
+    case DFU_UPLOAD:
+        if (r->dfu_state != dfuIDLE && r->dfu_state != dfuUPLOAD_IDLE)
+            return dfu_stall(r);
+        if (wValue == 0) {
+            // Identifier of the radio.
+            memset(data, 0, wLength);
+            strncpy((char*) data, "DR780", wLength);
+        } else {
+            if (++r->dfu_nuploads == dfu_fail_upload)
+                return dfu_stall(r);
+            mem = dfu_memory(r, r->dfu_addr + (wValue - 2) * wLength, wLength);
+            if (mem)
+                memcpy(data, mem, wLength);
+            else
+                memset(data, 0xff, wLength);
+        }
+        r->dfu_state = dfuUPLOAD_IDLE;
+        return wLength;
+
+    case DFU_GETSTATUS:
+        if (r->dfu_state == dfuDNBUSY && now() < r->dfu_poll_due)
+            dfu_nearly++;
+        if (r->dfu_state == dfuDNLOAD_SYNC || r->dfu_state == dfuDNBUSY) {
+            if (r->dfu_busy > 0) {
+                // Still busy: ask to poll again later.
+                r->dfu_busy--;
+                r->dfu_state = dfuDNBUSY;
+                r->dfu_poll_due = now() + dfu_poll_msec * 1000LL;
+                timeout = dfu_poll_msec;
+                dfu_npolls++;
+            } else {
+                r->dfu_state = dfuDNLOAD_IDLE;
+            }
+        }
+        data[0] = r->dfu_status;
+        data[1] = timeout;
+        data[2] = timeout >> 8;
+        data[3] = timeout >> 16;
+        data[4] = r->dfu_state;
+        data[5] = 0;
+        return 6;
+
+    case DFU_CLRSTATUS:
+        if (r->dfu_state == dfuERROR) {
+            r->dfu_state = dfuIDLE;
+            r->dfu_status = 0;
+        }
+        return 0;
+
+    case DFU_GETSTATE:
+        data[0] = r->dfu_state;
+        return 1;
+
+    case DFU_ABORT:
+        if (r->dfu_state == dfuERROR)
+            return dfu_stall(r);
+        r->dfu_state = dfuIDLE;
+        return 0;
+    }
+    return dfu_stall(r);
+}
+
+//
+// Remove the oldest reply from the queue.
+//
+static void drop_reply(libusb_device *r)
+{
+    r->nreplies--;
+    memmove(r->reply[0], r->reply[1], r->nreplies * 42);
+    memmove(&r->due[0], &r->due[1], r->nreplies * sizeof(r->due[0]));
+}
+
+//
+// Complete the oldest receive transfer.
+//
+static void complete(libusb_device *r, int status)
+{
+    struct libusb_transfer *t = r->pending[0];
+
+    r->npending--;
+    memmove(&r->pending[0], &r->pending[1], r->npending * sizeof(t));
+    if (status == LIBUSB_TRANSFER_COMPLETED) {
+        memcpy(t->buffer, r->reply[0], 42);
+        t->actual_length = 42;
+        drop_reply(r);
+    } else {
+        t->actual_length = 0;
+    }
+    t->status = status;
+    t->callback(t);
+}
+
+int libusb_init(libusb_context **ctx)
+{
+    static libusb_context context;
+
+    setup();
+    *ctx = &context;
+    return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+    if (dfu_ndownloads > 0 && getenv("FAKE_DFU_STATS")) {
+        fprintf(stderr, "fake-libusb: %d downloads, %d busy polls, %d early polls\n",
+            dfu_ndownloads, dfu_npolls, dfu_nearly);
+        dfu_ndownloads = dfu_npolls = dfu_nearly = 0;
+    }
+}
+
+const char *libusb_strerror(int errcode)
+{
+    return "Simulated error";
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    int i, n = 0;
+
+    update_hotplug();
+    *list = calloc(nradios + 1, sizeof(libusb_device*));
+    if (! *list)
+        return LIBUSB_ERROR_NO_MEM;
+    for (i=0; i<nradios; i++) {
+        if (radio[i].present)
+            (*list)[n++] = &radio[i];
+    }
+    return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->idVendor = dev->vid;
+    desc->idProduct = dev->pid;
+    desc->iSerialNumber = 3;
+    return 0;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
+    uint8_t desc_index, unsigned char *data, int length)
+{
+    libusb_device *r = (libusb_device*) dev_handle;
+
+    if (desc_index != 3)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    snprintf((char*) data, length, "%s", r->serial);
+    return strlen((char*) data);
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+    return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+    return dev->address;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+    port_numbers[0] = dev->address;
+    return 1;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    if (! dev->present)
+        return LIBUSB_ERROR_NO_DEVICE;
+    *dev_handle = (libusb_device_handle*) dev;
+    dev->bank = 0;
+    dev->nreplies = 0;
+    dev->npending = 0;
+    return 0;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number)
+{
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+    return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+    return 0;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    libusb_device *r = (libusb_device*) transfer->dev_handle;
+
+    if (r->npending >= MAXREPLIES)
+        return LIBUSB_ERROR_BUSY;
+    r->pending[r->npending++] = transfer;
+    return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    libusb_device *r = (libusb_device*) transfer->dev_handle;
+    int i;
+
+    for (i=0; i<r->npending; i++) {
+        if (r->pending[i] == transfer) {
+            r->npending--;
+            memmove(&r->pending[i], &r->pending[i+1], (r->npending - i) * sizeof(transfer));
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+            transfer->callback(transfer);
+            return 0;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type,
+    uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data,
+    uint16_t wLength, unsigned int timeout)
+{
+    libusb_device *r = (libusb_device*) dev_handle;
+
+    update_hotplug();
+    if (! r->present)
+        return LIBUSB_ERROR_NO_DEVICE;
+    r->nrequests++;
+    if (r->fail_after && r->nrequests > r->fail_after)
+        return LIBUSB_ERROR_IO;
+    if (r->vid == DFU_VID)
+        return dfu_request(r, bRequest, wValue, data, wLength);
+    process(r, data);
+    return wLength;
+}
+
+//
+// Complete the oldest receive transfer of the opened radio,
+// when a reply is ready, or on timeout.
+//
+int libusb_handle_events(libusb_context *ctx)
+{
+    int i;
+
+    update_hotplug();
+    for (i=0; i<nradios; i++) {
+        libusb_device *r = &radio[i];
+        long long delay;
+
+        if (r->npending == 0)
+            continue;
+        if (! r->present) {
+            complete(r, LIBUSB_TRANSFER_NO_DEVICE);
+            return 0;
+        }
+        if (r->nreplies == 0) {
+            usleep(r->pending[0]->timeout * 1000);
+            complete(r, LIBUSB_TRANSFER_TIMED_OUT);
+            return 0;
+        }
+        delay = r->due[0] - now();
+        if (delay > 0)
+            usleep(delay);
+        complete(r, LIBUSB_TRANSFER_COMPLETED);
+        return 0;
+    }
+    usleep(1000);
+    return 0;
+}
+
+//
+// Wait for radios to be attached or detached.
+//
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    if (! update_hotplug()) {
+        usleep(tv->tv_sec * 1000000 + tv->tv_usec);
+        update_hotplug();
+    }
+    return 0;
+}
+
+int libusb_interrupt_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+    unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+    libusb_device *r = (libusb_device*) dev_handle;
+
+    if (! r->present)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (r->nreplies == 0) {
+        usleep(timeout * 1000);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    memcpy(data, r->reply[0], 42);
+    *actual_length = 42;
+    drop_reply(r);
+    return 0;
+}
+
+//
+// Hotplug is supported with FAKE_HOTPLUG only.
+//
+int libusb_has_capability(uint32_t capability)
+{
+    setup();
+    return capability == LIBUSB_CAP_HAS_HOTPLUG && hotplug_file != 0;
+}
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+    int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn,
+    void *user_data, libusb_hotplug_callback_handle *callback_handle)
+{
+    int i;
+
+    if (ncallbacks >= MAXCALLBACKS)
+        return LIBUSB_ERROR_NO_MEM;
+    callback[ncallbacks].events = events;
+    callback[ncallbacks].vendor_id = vendor_id;
+    callback[ncallbacks].product_id = product_id;
+    callback[ncallbacks].cb_fn = cb_fn;
+    callback[ncallbacks].user_data = user_data;
+    if (callback_handle)
+        *callback_handle = ncallbacks;
+    ncallbacks++;
+
+    // Attached radios are reported on request only.
+    if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
+        for (i=0; i<nradios; i++) {
+            if (radio[i].present)
+                notify(&radio[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+        }
+    }
+    return 0;
+}
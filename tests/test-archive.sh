@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# Save configured codeplugs of several radios with --archive,
+# and unpack them back.  The unpacked image must be the same
+# as the plain one, byte for byte.
+#
+# Usage: test-archive.sh [path/to/dmrconfig]
+#
+dmrconfig=$(realpath ${1:-../dmrconfig})
+examples=$(realpath ../examples)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio of given size with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $(($2 - ${#1})) /dev/zero | tr '\0' '\377') > $3
+}
+
+#
+# Compare two images.  MD-380 and MD-UV380 keep at 0x2001 the time
+# of the last configuration, which is updated by every script:
+# with option -t, these bytes are ignored.
+#
+same() {
+    if [ "$1" = -t ]; then
+        shift
+        cp $1 a.tmp
+        cp $2 b.tmp
+        for f in a.tmp b.tmp; do
+            head -c 7 /dev/zero | dd of=$f bs=1 seek=$((0x2001)) conv=notrunc 2>/dev/null
+        done
+        set -- a.tmp b.tmp
+    fi
+    cmp -s $1 $2
+}
+
+#
+# Configure the blank image, pack it into archive and unpack back.
+# The script is applied on every step: the configuration is repeatable,
+# so all images must be the same.
+#
+roundtrip() {
+    name=$1
+    conf=$examples/$2
+    opt=$3
+
+    $dmrconfig -c blank.img $conf > config.log 2>&1 || fail "$name: configure: $(tail -1 config.log)"
+    mv device.img plain.img
+    $dmrconfig -c plain.img $conf > config.log 2>&1 || fail "$name: configure again: $(tail -1 config.log)"
+    same $opt device.img plain.img || fail "$name: configuration is not repeatable"
+
+    $dmrconfig --archive -c plain.img $conf > config.log 2>&1 || fail "$name: pack: $(tail -1 config.log)"
+    mv device.img packed.img
+    [ $(wc -c < packed.img) -lt $(wc -c < plain.img) ] || fail "$name: archive is not smaller"
+    cmp -s packed.img plain.img && fail "$name: image is not packed"
+
+    $dmrconfig -c packed.img $conf > config.log 2>&1 || fail "$name: unpack: $(tail -1 config.log)"
+    same $opt device.img plain.img || fail "$name: unpacked image differs"
+
+    $dmrconfig plain.img 2>/dev/null | grep -v "^Last Programmed Date" > plain.conf
+    $dmrconfig packed.img 2>/dev/null | grep -v "^Last Programmed Date" > packed.conf
+    cmp -s packed.conf plain.conf || fail "$name: configuration of archive differs"
+
+    echo "PASS: archive of $name, $(wc -c < packed.img) bytes instead of $(wc -c < plain.img)"
+}
+
+blank MD-760P 131072 blank.img
+roundtrip GD-77 gd77-south-bay-area.conf
+
+blank BF-5R 131072 blank.img
+roundtrip RD-5R rd5r-south-bay-area.conf
+
+blank "" 262144 blank.img
+roundtrip MD-380 md380-south-bay-area.conf -t
+
+blank "" 851968 blank.img
+roundtrip MD-UV380 md-uv380_bm_2018-08-07.conf -t
+
+blank D868UVE 1606528 blank.img
+roundtrip D868UV d868uv-rmham-2018-10-20.conf
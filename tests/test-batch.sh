@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Apply configuration scripts to codeplug images of several radios
+# in batch mode.  Every output image must be the same as the one
+# made by -c alone.
+#
+# Usage: test-batch.sh [path/to/dmrconfig]
+#
+dmrconfig=$(realpath ${1:-../dmrconfig})
+examples=$(realpath ../examples)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio of given size with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $(($2 - ${#1})) /dev/zero | tr '\0' '\377') > $3
+}
+
+#
+# Compare two images.  MD-380 and MD-UV380 keep at 0x2001 the time
+# of the last configuration, which is updated by every script:
+# with option -t, these bytes are ignored.
+#
+same() {
+    if [ "$1" = -t ]; then
+        shift
+        cp $1 a.tmp
+        cp $2 b.tmp
+        for f in a.tmp b.tmp; do
+            head -c 7 /dev/zero | dd of=$f bs=1 seek=$((0x2001)) conv=notrunc 2>/dev/null
+        done
+        set -- a.tmp b.tmp
+    fi
+    cmp -s $1 $2
+}
+
+blank MD-760P 131072 gd77.img
+blank BF-5R 131072 rd5r.img
+blank 1801 131072 dm1801.img
+blank "" 262144 md380.img
+blank "" 851968 uv380.img
+blank D868UVE 1606528 d868uv.img
+
+# Jobs of different radios follow each other, so the workers
+# switch between them.  There are more jobs than processors.
+n=0
+for round in 1 2 3; do
+    for job in \
+        "gd77.img gd77-south-bay-area.conf" \
+        "md380.img md380-south-bay-area.conf" \
+        "d868uv.img d868uv-rmham-2018-10-20.conf" \
+        "rd5r.img rd5r-south-bay-area.conf" \
+        "uv380.img md-uv380_bm_2018-08-07.conf" \
+        "gd77.img gd77-ver311-W5NOR-Oklahoma.conf" \
+        "dm1801.img dm1801-south-bay-area.conf" \
+        "md380.img md380-norcal-brandmeister.conf" \
+        "d868uv.img d868uv-norcal-ka7qqv-2017-11-04.conf" \
+        "rd5r.img rd5r-bayern-codeplug-v3.conf"
+    do
+        set -- $job
+        n=$((n + 1))
+        echo "$1 $examples/$2 out$n.img" >> manifest
+    done
+done
+
+$dmrconfig -B manifest > batch.log 2>&1 || fail "batch: $(grep -v ' - done' batch.log | tail -1)"
+[ $(grep -c ' - done' batch.log) = $n ] || fail "batch: not all jobs done"
+
+i=0
+while read image conf output; do
+    i=$((i + 1))
+    $dmrconfig -c $image $conf > config.log 2>&1 || fail "job $i: configure: $(tail -1 config.log)"
+    case $image in
+    md380.img | uv380.img) opt=-t ;;
+    *) opt= ;;
+    esac
+    same $opt device.img $output || fail "job $i: $output differs from $(basename $conf) applied to $image"
+done < manifest
+echo "PASS: batch of $n jobs"
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Read a simulated HID radio with --cache, and configure it.
+# A cached codeplug must not be used to write only the changes.
+#
+# Usage: test-cache.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/gd77-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+mkdir cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $((131072 - ${#1})) /dev/zero | tr '\0' '\377') > $2
+}
+
+# Prepare the codeplug.
+blank MD-760P gd77.img
+$dmrconfig -c gd77.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+cp codeplug.img radio.img
+export FAKE_RADIOS=radio.img
+
+# Without --cache, nothing is cached.
+$dmrconfig -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+[ -z "$(ls cache)" ] || fail "read: cached without --cache"
+$dmrconfig --cache -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+grep -q "done\.$" read.log || fail "read: cache used before saved"
+$dmrconfig --cache -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+grep -q "done (cached)" read.log || fail "read: cache not used"
+echo "PASS: cache"
+
+# Configure the radio from cache: the whole codeplug is written.
+$dmrconfig --cache -c $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+grep -q "write it as a whole" config.log || fail "configure: only changes written"
+grep -q "blocks written" config.log && fail "configure: only changes written"
+echo "PASS: configure from cache"
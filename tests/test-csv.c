@@ -0,0 +1,356 @@
+/*
+ * Check the parser of CSV callsign databases on quoted fields,
+ * CRLF line ends and a missing newline at the end of file,
+ * and compare its speed with the line-by-line parser used before.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "../util.h"
+
+//
+// Environment of the parser.
+//
+int trace_flag;
+int verify_blank_flag;
+
+void radio_written(const unsigned char *data, int nbytes) {}
+void dfu_read_block(int bno, unsigned char *data, int nbytes) {}
+void dfu_write_block(int bno, unsigned char *data, int nbytes) {}
+
+//
+// Records of the test files, as they must be returned by csv_read().
+//
+static const struct {
+    const char *name;
+    const char *text;
+    const char *want;
+} tests[] = {
+    { "plain",
+        "Radio ID,Callsign,Name,City,State,Country,Remarks\n"
+        "1023001,VE3THW,Wayne,Toronto,Ontario,Canada,DMR\n"
+        "1023002,VA3BOC,Bob,Ottawa,Ontario,Canada,\n",
+        "1023001|VE3THW|Wayne|Toronto|Ontario|Canada|DMR\n"
+        "1023002|VA3BOC|Bob|Ottawa|Ontario|Canada|\n" },
+    { "CRLF",
+        "RADIO_ID,CALLSIGN,FIRST_NAME,LAST_NAME,CITY,STATE,COUNTRY,REMARKS\r\n"
+        "1023001,VE3THW,Wayne,Smith,Toronto,Ontario,Canada,\r\n"
+        "3100001,K1ABC,Al,,Boston,MA,United States,Club\r\n",
+        "1023001|VE3THW|Wayne Smith|Toronto|Ontario|Canada|\n"
+        "3100001|K1ABC|Al|Boston|MA|United States|Club\n" },
+    { "quoted",
+        "\"No.\",\"Radio ID\",\"Callsign\",\"Name\",\"City\",\"State\",\"Country\",\"Remarks\"\n"
+        "\"1\",\"2345001\",\"DL1ABC\",\"Hans, Jr.\",\"Berlin\",\"\",\"Germany\",\"says \"\"hi\"\"\"\n"
+        "\"2\",\"2345002\",\"DL2XYZ\",\"Eva\",\"Bonn\",\"NRW\",\"Germany\",\"two\nlines\"\n",
+        "2345001|DL1ABC|Hans, Jr.|Berlin||Germany|says \"hi\"\n"
+        "2345002|DL2XYZ|Eva|Bonn|NRW|Germany|two\nlines\n" },
+    { "no newline at end",
+        "Radio ID,Callsign,Name,City,State,Country,Remarks\n"
+        "1023001,VE3THW,Wayne,Toronto,Ontario,Canada,DMR",
+        "1023001|VE3THW|Wayne|Toronto|Ontario|Canada|DMR\n" },
+    { "quoted, no newline at end",
+        "Radio ID,Callsign,Name,City,State,Country,Remarks\r\n"
+        "1023001,\"VE3THW\",\"Wayne\",Toronto,Ontario,Canada,\"DMR, \"\"club\"\"\"",
+        "1023001|VE3THW|Wayne|Toronto|Ontario|Canada|DMR, \"club\"\n" },
+    { "short lines and non-ASCII",
+        "Radio ID,Callsign,Name,City,State,Country,Remarks\n"
+        "\n"
+        "1023001,VE3THW\n"
+        "2621001,DB1XY,J\303\266rg,M\303\274nchen,Bayern,Germany\n",
+        "2621001|DB1XY|J??rg|M??nchen|Bayern|Germany|\n" },
+};
+
+//
+// Parse the CSV file, and append all records to the buffer.
+// Return 0 when the header is not recognized.
+//
+static int parse(FILE *csv, char *out, int nbytes)
+{
+    char *radioid, *callsign, *name, *city, *state, *country, *remarks;
+    int len = 0;
+
+    *out = 0;
+    if (csv_init(csv) < 0)
+        return 0;
+    while (csv_read(csv, &radioid, &callsign, &name, &city, &state, &country, &remarks)) {
+        len += snprintf(out + len, nbytes - len, "%s|%s|%s|%s|%s|%s|%s\n",
+            radioid, callsign, name, city, state, country, remarks);
+        if (len >= nbytes)
+            return 0;
+    }
+    return 1;
+}
+
+//
+// Parse the text from a regular file, which is mapped into memory,
+// and from a stream, which is read.  Compare the records with
+// the expected ones.
+// Return 1 on success.
+//
+static int check(const char *name, const char *text, const char *want)
+{
+    static char got[4096];
+    int len = strlen(text);
+    FILE *csv;
+
+    csv = tmpfile();
+    if (! csv) {
+        perror("tmpfile");
+        exit(-1);
+    }
+    fwrite(text, 1, len, csv);
+    rewind(csv);
+    if (! parse(csv, got, sizeof(got)) || strcmp(got, want) != 0) {
+        printf("FAIL: %s, mapped file:\n%s", name, got);
+        return 0;
+    }
+    fclose(csv);
+
+    csv = fmemopen((void*) text, len, "r");
+    if (! csv) {
+        perror("fmemopen");
+        exit(-1);
+    }
+    if (! parse(csv, got, sizeof(got)) || strcmp(got, want) != 0) {
+        printf("FAIL: %s, stream:\n%s", name, got);
+        return 0;
+    }
+    fclose(csv);
+    printf("PASS: %s\n", name);
+    return 1;
+}
+
+//
+// The parser used before: one line at a time through a 256-byte buffer.
+//
+static int old_skip_field1;
+static int old_join_fields34;
+
+static int old_csv_init(FILE *csv)
+{
+    char line[256];
+
+    if (!fgets(line, sizeof(line), csv))
+        return -1;
+
+    char *field1 = line;
+    char *field2 = strchr(field1,      ','); if (! field2) return -1; *field2++ = 0;
+    char *field3 = strchr(field2,      ','); if (! field3) return -1; *field3++ = 0;
+    char *field4 = strchr(field3,      ','); if (! field4) return -1; *field4++ = 0;
+
+    field1 = trim_quotes(field1);
+    field2 = trim_quotes(field2);
+    field3 = trim_quotes(field3);
+
+    if (strcasecmp(field1, "Radio ID") == 0 &&
+        strcasecmp(field2, "Callsign") == 0) {
+        old_skip_field1 = 0;
+        old_join_fields34 = 0;
+        return 0;
+    }
+    if (strcasecmp(field1, "RADIO_ID") == 0 &&
+        strcasecmp(field2, "CALLSIGN") == 0 &&
+        strcasecmp(field3, "FIRST_NAME") == 0) {
+        old_skip_field1 = 0;
+        old_join_fields34 = 1;
+        return 0;
+    }
+    if (strcasecmp(field2, "Radio ID") == 0 &&
+        strcasecmp(field3, "Callsign") == 0) {
+        old_skip_field1 = 1;
+        old_join_fields34 = 0;
+        return 0;
+    }
+    return -1;
+}
+
+static int old_csv_read(FILE *csv, char **radioid, char **callsign, char **name,
+    char **city, char **state, char **country, char **remarks)
+{
+    static char line[256];
+
+again:
+    if (!fgets(line, sizeof(line), csv))
+        return 0;
+
+    char *p;
+    for (p=line; *p; p++) {
+        if ((uint8_t)*p > '~')
+            *p = '?';
+    }
+
+    if (old_skip_field1) {
+        *radioid = strchr(line, ',');
+        if (! *radioid)
+            return 0;
+        *(*radioid)++ = 0;
+    } else
+        *radioid = line;
+
+    *callsign = strchr(*radioid,  ','); if (! *callsign) return 0; *(*callsign)++ = 0;
+    *name     = strchr(*callsign, ','); if (! *name)     return 0; *(*name)++     = 0;
+    *city     = strchr(*name,     ','); if (! *city)     return 0; *(*city)++     = 0;
+    *state    = strchr(*city,     ','); if (! *state)    return 0; *(*state)++    = 0;
+    *country  = strchr(*state,    ','); if (! *country)  return 0; *(*country)++  = 0;
+    *remarks  = strchr(*country,  ','); if (! *remarks)  return 0; *(*remarks)++  = 0;
+    if ((p = strchr(*remarks, ',')) != 0)
+        *p++ = 0;
+
+    if (old_join_fields34) {
+        char *name2 = *city;
+        *city     = *state;
+        *state    = *country;
+        *country  = *remarks;
+        *remarks  = p;
+
+        if ((p = strchr(*remarks, ',')) != 0)
+            *p = 0;
+
+        if (*name2) {
+            static char fullname[256];
+            strcpy(fullname, *name);
+            strcat(fullname, " ");
+            strcat(fullname, name2);
+            *name = fullname;
+        }
+    }
+    *radioid  = trim_spaces(trim_quotes(*radioid),  100);
+    *callsign = trim_spaces(trim_quotes(*callsign), 100);
+    *name     = trim_spaces(trim_quotes(*name),     100);
+    *city     = trim_spaces(trim_quotes(*city),     100);
+    *state    = trim_spaces(trim_quotes(*state),    100);
+    *country  = trim_spaces(trim_quotes(*country),  100);
+    *remarks  = trim_spaces(trim_quotes(*remarks),  100);
+
+    if (**radioid < '1' || **radioid > '9')
+        goto again;
+    return 1;
+}
+
+static double msec(clock_t t0, clock_t t1)
+{
+    return (t1 - t0) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+//
+// Checksum of all fields of the record.
+//
+static unsigned hash_record(unsigned h, char *field[])
+{
+    int i;
+
+    for (i=0; i<7; i++) {
+        const char *p;
+
+        for (p=field[i]; *p; p++)
+            h = (h ^ (uint8_t)*p) * 16777619;
+        h = (h ^ '|') * 16777619;
+    }
+    return h;
+}
+
+//
+// Parse a generated database of given size with both parsers,
+// compare the records and the time.
+// Return 1 on success.
+//
+static int benchmark(int nrecords)
+{
+    const int N = 5;
+    char *f[7];
+    unsigned old_hash = 0, new_hash = 0;
+    int old_count = 0, new_count = 0;
+    clock_t t0, t1, t2;
+    FILE *csv;
+    int i;
+
+    csv = tmpfile();
+    if (! csv) {
+        perror("tmpfile");
+        exit(-1);
+    }
+    srandom(nrecords);
+    fprintf(csv, "Radio ID,Callsign,Name,City,State,Country,Remarks\r\n");
+    for (i=0; i<nrecords; i++) {
+        fprintf(csv, "%d,K%dX%c%c,Operator %d,%s%s %d%s,State %ld,United States,%s\r\n",
+            3100000 + i, i % 10, 'A' + i % 26, 'A' + (i / 26) % 26, i,
+            (i % 10) ? "" : "\"", "City", (int) (random() % 1000),
+            (i % 10) ? "" : "\"", random() % 50,
+            (i % 3) ? "" : "Club station");
+    }
+
+    t0 = clock();
+    for (i=0; i<N; i++) {
+        rewind(csv);
+        old_count = 0;
+        old_hash = 0;
+        if (old_csv_init(csv) < 0)
+            break;
+        while (old_csv_read(csv, &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6])) {
+            old_hash = hash_record(old_hash, f);
+            old_count++;
+        }
+    }
+    t1 = clock();
+    for (i=0; i<N; i++) {
+        rewind(csv);
+        new_count = 0;
+        new_hash = 0;
+        if (csv_init(csv) < 0)
+            break;
+        while (csv_read(csv, &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6])) {
+            new_hash = hash_record(new_hash, f);
+            new_count++;
+        }
+    }
+    t2 = clock();
+    fclose(csv);
+
+    printf("%d records: line by line %7.2f msec, mapped %7.2f msec\n",
+        nrecords, msec(t0, t1) / N, msec(t1, t2) / N);
+    if (old_count != nrecords || new_count != nrecords || old_hash != new_hash) {
+        printf("FAIL: %d records: parsers differ, %d and %d records\n",
+            nrecords, old_count, new_count);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int i, ok = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+        return ! benchmark(250000);
+
+    for (i=0; i<sizeof(tests)/sizeof(tests[0]); i++)
+        ok &= check(tests[i].name, tests[i].text, tests[i].want);
+    return ! ok;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Write a simulated MD-380 radio over DFU, which keeps every download
+# busy for a while: the status must be polled no sooner than the radio
+# asks, and the write must complete.  Read it back twice, once with
+# an upload request failing between status queries.
+#
+# Usage: test-dfu.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/md380-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased flash memory of MD-380.
+#
+blank() {
+    head -c 262144 /dev/zero | tr '\0' '\377' > $1
+}
+
+# Prepare the codeplug.
+blank md380.img
+$dmrconfig -c md380.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+
+# Every download keeps the radio busy for two status polls, 5 msec each.
+blank radio.img
+FAKE_RADIOS=radio.img FAKE_DFU_BUSY=2:5 FAKE_DFU_STATS=1 \
+    $dmrconfig -t -w codeplug.img > write.log 2>&1 || fail "write: $(tail -1 write.log)"
+cmp -s codeplug.img radio.img || fail "write: image differs"
+
+# The reboot command at the end is polled once.
+set -- $(sed -n 's/^fake-libusb: \([0-9]*\) downloads, \([0-9]*\) busy polls, \([0-9]*\) early.*/\1 \2 \3/p' write.log)
+[ $# = 3 ] || fail "write: no statistics"
+[ $2 = $(($1 * 2 - 1)) ] || fail "write: $2 busy polls for $1 downloads"
+[ $3 = 0 ] || fail "write: $3 polls before timeout"
+
+# Every block write waits for 10 msec at least: none is in buckets <1...<8.
+nwrites=$(grep -c -- "--- Send DNLOAD \[1024\]" write.log)
+set -- $(grep "^Write  *[0-9]" write.log)
+[ $# = 12 ] || fail "write: no histogram"
+[ $(($2 + $3 + $4 + $5)) = 0 ] || fail "write: waits shorter than poll timeout"
+[ $(($6 + $7 + $8 + $9 + ${10} + ${11} + ${12})) = $nwrites ] || fail "write: histogram does not match $nwrites writes"
+echo "PASS: dfu write with poll timeout"
+
+# Read the radio twice: the images must be the same.
+FAKE_RADIOS=radio.img $dmrconfig -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+mv device.img first.img
+cmp -s codeplug.img first.img || fail "read: image differs"
+
+# Upload of block 40 stalls: status was last queried at block 32,
+# so the driver recovers the idle state and reads the block again.
+FAKE_RADIOS=radio.img FAKE_DFU_FAIL=41 $dmrconfig -t -r > read.log 2>&1 || fail "read with failure: $(tail -1 read.log)"
+grep -q -- "--- Send CLRSTATUS" read.log || fail "read with failure: no recovery"
+cmp -s first.img device.img || fail "read with failure: image differs"
+echo "PASS: dfu read with recovery"
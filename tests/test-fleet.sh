@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Write and read several simulated HID radios at once, in fleet mode.
+# One radio stops responding in the middle, another one is of
+# a different type: the rest must be programmed anyway.
+#
+# Usage: test-fleet.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/gd77-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $((131072 - ${#1})) /dev/zero | tr '\0' '\377') > $2
+}
+
+# Prepare the codeplug.
+blank MD-760P gd77.img
+$dmrconfig -c gd77.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+$dmrconfig codeplug.img 2>/dev/null | grep -v "^# Configuration\|^#.*version" > expect.conf
+
+# Three GD-77 radios and one RD-5R.
+for i in 1 2 3; do
+    blank MD-760P radio$i.img
+done
+blank BF-5R radio4.img
+cp radio4.img rd5r.img
+export FAKE_RADIOS=radio1.img,radio2.img,radio3.img,radio4.img
+
+# Radio 2 stops responding in the middle of upload.
+FAKE_FAIL=2:500 $dmrconfig -F -w codeplug.img > write.log 2>&1 && fail "write: no error reported"
+grep -q "^Radio 1: .* - done, [0-9]" write.log || fail "write: radio 1 not done"
+grep -q "^Radio 2: .* - FAILED" write.log || fail "write: radio 2 not failed"
+grep -q "^Radio 3: .* - done, [0-9]" write.log || fail "write: radio 3 not done"
+grep -q "^Radio 4: .* - FAILED, incompatible image" write.log || fail "write: radio 4 not rejected"
+cmp -s radio4.img rd5r.img || fail "write: radio 4 modified"
+echo "PASS: fleet write"
+
+# Read all radios back.
+$dmrconfig -F -r > read.log 2>&1 || fail "read: $(grep FAILED read.log)"
+for i in 1 3; do
+    grep -v "^# Configuration\|^#.*version" device-$i.conf > radio$i.conf
+    cmp -s expect.conf radio$i.conf || fail "read: radio $i differs"
+done
+echo "PASS: fleet read"
@@ -0,0 +1,248 @@
+/*
+ * Check the transfer planner of D868UV driver against
+ * the plain loop over 64-byte blocks, and compare their speed.
+ *
+ * Copyright (C) 2018 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "../d868uv.c"
+#include <time.h>
+
+//
+// Environment of the driver.
+//
+int trace_flag;
+int verify_blank_flag;
+__thread dmr_session_t *dmr_session;
+
+static unsigned char *transferred;  // Bytes passed to serial_*_region()
+static unsigned ncalls;             // Number of serial_*_region() calls
+
+static void transfer(unsigned char *data, int nbytes)
+{
+    memset(&transferred[data - radio_mem], 1, nbytes);
+    ncalls++;
+}
+
+void serial_read_region(int addr, unsigned char *data, int nbytes)
+{
+    transfer(data, nbytes);
+}
+
+void serial_write_region(int addr, unsigned char *data, int nbytes)
+{
+    transfer(data, nbytes);
+}
+
+int radio_journal_pending(int step) { return 1; }
+void radio_journal_commit(int step) {}
+int radio_is_compatible(const char *ident) { return 1; }
+void radio_written(const unsigned char *data, int nbytes) {}
+void dfu_read_block(int bno, unsigned char *data, int nbytes) {}
+void dfu_write_block(int bno, unsigned char *data, int nbytes) {}
+
+//
+// The plain loop: one transfer per 64-byte block, as before the planner.
+// Mark the bytes to transfer; on download, erase the skipped blocks.
+//
+static void plain_loop(unsigned char *want, int download_flag, const uint8_t *orig)
+{
+    fragment_t *f;
+    unsigned file_offset = 0;
+
+    memset(want, 0, MEMSZ);
+    for (f=region_map; f->length; f++) {
+        unsigned addr = f->address;
+        unsigned nbytes = f->length;
+
+        while (nbytes > 0) {
+            unsigned n = (nbytes > 64) ? 64 : nbytes;
+
+            if (download_flag && f->offset != 0) {
+                // Bitmap is read in advance.
+            } else if (skip_region(radio_mem, addr, file_offset,
+                    download_flag ? &radio_mem[file_offset] : 0, n)) {
+                // Unused data.
+            } else if (orig && ! skip_region(orig, addr, file_offset, 0, 0) &&
+                memcmp(&radio_mem[file_offset], &orig[file_offset], n) == 0) {
+                // Not changed.
+            } else {
+                memset(&want[file_offset], 1, n);
+            }
+            file_offset += n;
+            addr += n;
+            nbytes -= n;
+        }
+    }
+}
+
+//
+// Fill the image with random data and bitmaps of given density, in percent.
+//
+static void fill_image(uint8_t *mem, int density)
+{
+    int i;
+
+    for (i=0; i<MEMSZ; i++)
+        mem[i] = random();
+    for (i=0; i<NCHAN; i++)
+        if (random() % 100 >= density)
+            mem[OFFSET_CHAN_MAP + i/8] &= ~(1 << (i & 7));
+    for (i=0; i<NCONTACTS; i++)
+        if (random() % 100 < density)
+            mem[OFFSET_CONTACT_MAP + i/8] &= ~(1 << (i & 7));
+    for (i=0; i<NZONES; i++)
+        if (random() % 100 >= density)
+            mem[OFFSET_ZONE_MAP + i/8] &= ~(1 << (i & 7));
+    for (i=0; i<NSCANL; i++)
+        if (random() % 100 >= density)
+            mem[OFFSET_SCANL_MAP + i/8] &= ~(1 << (i & 7));
+}
+
+//
+// Run the planner and the plain loop on the same image, compare the results.
+// Return 1 on success.
+//
+static int check(const char *name, int download_flag, const uint8_t *orig)
+{
+    static unsigned char want[MEMSZ], erased[MEMSZ];
+    unsigned char *saved = malloc(MEMSZ);
+    transfer_t *plan;
+    int nranges, i;
+
+    memcpy(saved, radio_mem, MEMSZ);
+    plain_loop(want, download_flag, orig);
+    memcpy(erased, radio_mem, MEMSZ);
+    memcpy(radio_mem, saved, MEMSZ);
+
+    nranges = build_plan(&plan, download_flag, orig);
+    memset(transferred, 0, MEMSZ);
+    execute_plan(plan, nranges, ! download_flag);
+
+    for (i=0; i<MEMSZ; i++) {
+        if (transferred[i] != want[i]) {
+            printf("FAIL: %s: byte %06x %s\n", name, i,
+                want[i] ? "not transferred" : "transferred");
+            return 0;
+        }
+    }
+    if (memcmp(radio_mem, erased, MEMSZ) != 0) {
+        printf("FAIL: %s: skipped data differ\n", name);
+        return 0;
+    }
+
+    // Adjacent ranges must be merged.
+    for (i=1; i<nranges; i++) {
+        if (plan[i-1].address + plan[i-1].length == plan[i].address &&
+            plan[i-1].offset + plan[i-1].length == plan[i].offset) {
+            printf("FAIL: %s: ranges %d and %d not merged\n", name, i-1, i);
+            return 0;
+        }
+    }
+    printf("PASS: %s, %d ranges\n", name, nranges);
+    memcpy(radio_mem, saved, MEMSZ);
+    free(saved);
+    free(plan);
+    return 1;
+}
+
+static double msec(clock_t t0, clock_t t1)
+{
+    return (t1 - t0) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+//
+// Compare the time to build a plan, and the number of transfers,
+// with the plain loop.
+//
+static void benchmark(int density)
+{
+    static unsigned char want[MEMSZ];
+    const int N = 20;
+    unsigned nblocks = 0;
+    transfer_t *plan;
+    clock_t t0, t1, t2;
+    int i, nranges = 0;
+
+    srandom(density);
+    fill_image(radio_mem, density);
+
+    t0 = clock();
+    for (i=0; i<N; i++)
+        plain_loop(want, 0, 0);
+    t1 = clock();
+    for (i=0; i<N; i++) {
+        nranges = build_plan(&plan, 0, 0);
+        free(plan);
+    }
+    t2 = clock();
+
+    for (i=0; i<MEMSZ; i+=64)
+        nblocks += want[i];
+    printf("Density %3d%%: plain loop %6.2f msec, %5u transfers; planner %6.2f msec, %4d transfers\n",
+        density, msec(t0, t1) / N, nblocks, msec(t1, t2) / N, nranges);
+}
+
+int main(int argc, char **argv)
+{
+    static dmr_session_t session;
+    static uint8_t orig[MEMSZ];
+    int density, i, ok = 1;
+
+    session.mem = calloc(1, MEMSZ);
+    transferred = malloc(MEMSZ);
+    if (! session.mem || ! transferred) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    dmr_session = &session;
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        for (density=0; density<=100; density+=25)
+            benchmark(density);
+        return 0;
+    }
+
+    for (density=0; density<=100; density+=25) {
+        char name[64];
+
+        srandom(density + 1);
+        fill_image(radio_mem, density);
+
+        sprintf(name, "download, density %d%%", density);
+        ok &= check(name, 1, 0);
+
+        sprintf(name, "upload, density %d%%", density);
+        ok &= check(name, 0, 0);
+
+        // Change some blocks and some bits of the maps.
+        memcpy(orig, radio_mem, MEMSZ);
+        for (i=0; i<200; i++)
+            orig[random() % MEMSZ] ^= 1 << (random() & 7);
+
+        sprintf(name, "upload of changes, density %d%%", density);
+        ok &= check(name, 0, orig);
+    }
+    return ok ? 0 : 1;
+}
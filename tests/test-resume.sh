@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Interrupt the write of a simulated HID radio, and resume it.
+# The upload must not be resumed on a different radio,
+# even with the same contents.
+#
+# Usage: test-resume.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/gd77-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+mkdir cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $((131072 - ${#1})) /dev/zero | tr '\0' '\377') > $2
+}
+
+# Prepare the codeplug, and a radio with the complete write.
+blank MD-760P gd77.img
+$dmrconfig -c gd77.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+blank MD-760P expect.img
+FAKE_RADIOS=expect.img $dmrconfig -w codeplug.img > write.log 2>&1 || fail "write: $(tail -1 write.log)"
+
+# The radio stops responding in the middle of upload.
+blank MD-760P radio1.img
+blank MD-760P radio2.img
+FAKE_RADIOS=radio1.img FAKE_FAIL=1:500 $dmrconfig -w codeplug.img > write.log 2>&1 && fail "interrupt: no error reported"
+journal=$(ls cache/dmrconfig/*journal) || fail "interrupt: no journal"
+cp $journal journal.saved
+echo "PASS: interrupt"
+
+# Another radio: write from start.
+FAKE_RADIOS=radio2.img $dmrconfig -w --resume codeplug.img > resume.log 2>&1 || fail "other radio: $(tail -1 resume.log)"
+grep -q "^Radio differs" resume.log || fail "other radio: resumed"
+cmp -s expect.img radio2.img || fail "other radio: image differs"
+echo "PASS: resume on other radio"
+
+# A copy of the interrupted radio, with another serial number:
+# the fingerprint matches, but the radio differs.
+cp radio1.img radio3.img
+cp journal.saved $journal
+FAKE_RADIOS=radio3.img $dmrconfig -w --resume codeplug.img > resume.log 2>&1 || fail "copy of radio: $(tail -1 resume.log)"
+grep -q "^Radio differs" resume.log || fail "copy of radio: resumed"
+echo "PASS: resume on copy of radio"
+
+# Same radio: continue from the last completed block.
+cp journal.saved $journal
+FAKE_RADIOS=radio1.img $dmrconfig -w --resume codeplug.img > resume.log 2>&1 || fail "resume: $(tail -1 resume.log)"
+grep -q "^Resume upload after step" resume.log || fail "resume: not resumed"
+cmp -s expect.img radio1.img || fail "resume: image differs"
+echo "PASS: resume"
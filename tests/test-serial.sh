@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Read and write the codeplug of a simulated D868UV radio,
+# and compare the results.  Write a callsign database to it.
+#
+# Usage: test-serial.sh [path/to/dmrconfig]
+#
+dmrconfig=$(realpath ${1:-../dmrconfig})
+fake=$(realpath ./fake-d868uv)
+conf=$(realpath ../examples/d868uv-rmham-2018-10-20.conf)
+work=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; wait; rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+#
+# Start the simulator with given options, set $pid and $port.
+#
+start() {
+    rm -f port.txt
+    $fake "$@" > port.txt &
+    pid=$!
+    while [ ! -s port.txt ]; do sleep 0.1; done
+    port=$(cat port.txt)
+}
+
+stop() {
+    kill $pid
+    wait $pid
+}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Configure an erased radio from a script, then read the codeplug back.
+start -l 500 -o radio.img
+$dmrconfig --port $port -c $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+$dmrconfig --port $port -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+stop
+cmp -s device.img radio.img || fail "read: image differs"
+echo "PASS: configure and read"
+
+# Write it to an erased radio, which rejects large chunks
+# or stores them only partially.
+for opt in "" "-m 64" "-m 32" "-s 64" "-s 16"; do
+    start -o written.img $opt
+    $dmrconfig --port $port -w device.img > write.log 2>&1 || fail "write $opt: $(tail -1 write.log)"
+    stop
+    cmp -s device.img written.img || fail "write $opt: image differs"
+    echo "PASS: write $opt"
+done
+
+# Write a callsign database: the parser runs in a separate thread.
+cat > calldb.csv <<END
+Radio ID,Callsign,Name,City,State,Country,Remarks
+3125001,KK6ABQ,Serge,Palo Alto,California,United States,
+3125002,K6ABC,John,San Jose,California,United States,DMR
+3125003,N0CALL,Jane,Denver,Colorado,United States,
+END
+start
+$dmrconfig --port $port -u calldb.csv > csv.log 2>&1 || fail "write csv: $(tail -1 csv.log)"
+stop
+grep -q "^Total 3 contacts" csv.log || fail "write csv: $(grep Total csv.log)"
+echo "PASS: write callsign database"
+
+# A bad record stops the parser: the command fails without summary.
+cat > baddb.csv <<END
+Radio ID,Callsign,Name,City,State,Country,Remarks
+3125001,KK6ABQ,Serge,Palo Alto,California,United States,
+99999999,BAD,Nobody,Nowhere,California,United States,
+END
+start
+$dmrconfig --port $port -u baddb.csv > csv.log 2>&1 && fail "bad csv: no error reported"
+stop
+grep -q "Bad id" csv.log || fail "bad csv: $(tail -1 csv.log)"
+grep -q "^Total" csv.log && fail "bad csv: summary printed"
+echo "PASS: bad callsign database"
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Read a simulated GD-77 radio, skipping the blocks of unused
+# channels and zones.  The sparse image must give the same
+# configuration as the full memory of the radio.
+#
+# Usage: test-sparse.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/gd77-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $((131072 - ${#1})) /dev/zero | tr '\0' '\377') > $2
+}
+
+# Prepare the codeplug.
+blank MD-760P gd77.img
+$dmrconfig -c gd77.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+
+# The radio has garbage instead of erased blocks: the sparse read
+# must not show it.  Blocks 1...965 are read by the driver.
+cp codeplug.img radio.img
+bno=1
+while [ $bno -lt 966 ]; do
+    if [ $(dd if=codeplug.img bs=128 skip=$bno count=1 2>/dev/null | tr -d '\377' | wc -c) = 0 ]; then
+        head -c 128 /dev/zero | tr '\0' '\125' |
+            dd of=radio.img bs=128 seek=$bno conv=notrunc 2>/dev/null
+    fi
+    bno=$((bno + 1))
+done
+
+FAKE_RADIOS=radio.img $dmrconfig -t -r > read.log 2>&1 || fail "read: $(tail -1 read.log)"
+grep -q "^Skipped [1-9][0-9]* unused blocks" read.log || fail "read: no blocks skipped"
+$dmrconfig radio.img 2>/dev/null | grep -v "^# Configuration\|^#.*version" > full.conf
+$dmrconfig device.img 2>/dev/null | grep -v "^# Configuration\|^#.*version" > sparse.conf
+cmp -s full.conf sparse.conf || fail "read: configuration differs"
+echo "PASS: sparse read"
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Program simulated HID radios in station mode, as they are attached.
+# A radio reattached after programming is ignored; a radio detached
+# in the middle of write fails, and the next one is programmed anyway.
+#
+# Usage: test-station.sh [path/to/dmrconfig-fake]
+#
+dmrconfig=$(realpath ${1:-./dmrconfig-fake})
+conf=$(realpath ../examples/gd77-south-bay-area.conf)
+work=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; wait; rm -rf $work' EXIT
+cd $work
+export HOME=$work XDG_CACHE_HOME=$work/cache
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+#
+# Create image of erased radio with given identifier.
+#
+blank() {
+    (printf "$1"; head -c $((131072 - ${#1})) /dev/zero | tr '\0' '\377') > $2
+}
+
+#
+# Wait up to 30 seconds for a line in the station log.
+#
+expect() {
+    n=0
+    while ! grep -q "$1" station.log; do
+        [ $n -lt 300 ] || fail "$2: timeout"
+        sleep 0.1
+        n=$((n + 1))
+    done
+}
+
+# Prepare the codeplug.
+blank MD-760P gd77.img
+$dmrconfig -c gd77.img $conf > config.log 2>&1 || fail "configure: $(tail -1 config.log)"
+mv device.img codeplug.img
+$dmrconfig codeplug.img 2>/dev/null | grep -v "^# Configuration\|^#.*version" > expect.conf
+
+for i in 1 2 3; do
+    blank MD-760P radio$i.img
+done
+: > hotplug
+export FAKE_RADIOS=radio1.img,radio2.img,radio3.img FAKE_HOTPLUG=hotplug FAKE_LATENCY=500
+$dmrconfig --station codeplug.img > station.log 2>&1 &
+pid=$!
+expect "^Waiting for radios" "start"
+
+# Radio 1 is programmed.
+echo +1 >> hotplug
+expect "^Port 1-1: .* programmed" "radio 1"
+$dmrconfig radio1.img 2>/dev/null | grep -v "^# Configuration\|^#.*version" > radio1.conf
+cmp -s expect.conf radio1.conf || fail "radio 1: configuration differs"
+echo "PASS: station write"
+
+# Radio 2 is detached in the middle of write.
+echo +2 >> hotplug
+expect "^Port 1-2: radio attached" "radio 2"
+sleep 0.5
+echo -2 >> hotplug
+expect "^Port 1-2: .* FAILED" "radio 2"
+echo "PASS: station radio detached"
+
+# Radio 1 reboots and appears again: ignored.  Radio 3 is programmed.
+echo -1 >> hotplug
+echo +1 >> hotplug
+echo +3 >> hotplug
+expect "^Port 1-3: .* programmed" "radio 3"
+[ $(grep -c "^Port 1-1: radio attached" station.log) = 1 ] || fail "radio 1: programmed again"
+echo "PASS: station radio reattached"
+
+# The monitor of radios stops together with the station.
+kill $pid
+wait $pid 2>/dev/null
+sleep 0.5
+ps -e -o args | grep -q "^$dmrconfig --station" && fail "stop: monitor still running"
+echo "PASS: station stop"
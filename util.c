@@ -32,13 +32,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
 #ifdef MINGW32
 #   include <windows.h>
 #else
 #   include <sys/stat.h>
 #endif
+#if ! defined(__WIN32__) && ! defined(WIN32)
+#   include <sys/mman.h>
+#endif
 #include "util.h"
 
+__thread int device_index;              // Which of same-type radios to open
+__thread unsigned device_location;      // Bus and address of radio to open
+__thread char device_identity[64];      // Serial number or port of opened radio
+
 //
 // CTCSS tones, Hz*10.
 //
@@ -119,6 +128,192 @@ void print_hex_addr_data(unsigned addr, const unsigned char *data, int len)
     }
 }
 
+//
+// Compute 64-bit FNV-1a hash of the data, continuing from previous value.
+//
+unsigned long long hash_fnv(unsigned long long hash, const unsigned char *data, int len)
+{
+    if (hash == 0)
+        hash = 0xcbf29ce484222325ULL;
+    while (len-- > 0) {
+        hash ^= *data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+//
+// Block compression: LZ77 with byte-aligned sequences.
+// Every sequence has a token byte (literal count in high 4 bits,
+// match length minus 4 in low 4 bits), extra length bytes when a count
+// is 15 or more, the literals, and a 16-bit match offset.
+// The last sequence has literals only.
+//
+#define LZ_MINMATCH     4
+#define LZ_HASHBITS     12
+
+//
+// Write a length extension: bytes of 255, and the remainder.
+//
+static unsigned char *lz_put_length(unsigned char *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+//
+// Write one sequence.  Return 0 when the output buffer is too small.
+//
+static int lz_sequence(unsigned char **opp, unsigned char *oend,
+    const unsigned char *lit, int nlit, int offset, int mlen)
+{
+    unsigned char *op = *opp;
+    int lcode = (nlit < 15) ? nlit : 15;
+    int mcode = (mlen == 0) ? 0 : (mlen - LZ_MINMATCH < 15) ? mlen - LZ_MINMATCH : 15;
+
+    if (oend - op < 5 + nlit + nlit/255 + mlen/255)
+        return 0;
+    *op++ = lcode << 4 | mcode;
+    if (lcode == 15)
+        op = lz_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen > 0) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (mcode == 15)
+            op = lz_put_length(op, mlen - LZ_MINMATCH - 15);
+    }
+    *opp = op;
+    return 1;
+}
+
+//
+// Compress the data.
+// Return the compressed size, or 0 when it does not fit into dst.
+//
+int lz_compress(unsigned char *dst, int dstsz, const unsigned char *src, int n)
+{
+    int table[1 << LZ_HASHBITS];
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst;
+
+    memset(table, 0xff, sizeof(table));
+    while (end - ip >= LZ_MINMATCH) {
+        uint32_t seq;
+        int ref, len;
+
+        memcpy(&seq, ip, 4);
+        unsigned h = (seq * 2654435761u) >> (32 - LZ_HASHBITS);
+        ref = table[h];
+        table[h] = ip - src;
+        if (ref < 0 || (ip - src) - ref > 0xffff ||
+            memcmp(src + ref, ip, LZ_MINMATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // Extend the match.  It may overlap the current position.
+        len = LZ_MINMATCH;
+        while (ip + len < end && src[ref + len] == ip[len])
+            len++;
+
+        if (! lz_sequence(&op, dst + dstsz, anchor, ip - anchor, (ip - src) - ref, len))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    // Last literals.
+    if (! lz_sequence(&op, dst + dstsz, anchor, end - anchor, 0, 0))
+        return 0;
+    return op - dst;
+}
+
+//
+// Get a length extension.  Return -1 on end of data.
+//
+static int lz_get_length(const unsigned char **ipp, const unsigned char *iend)
+{
+    const unsigned char *ip = *ipp;
+    int len = 0, c;
+
+    do {
+        if (ip >= iend)
+            return -1;
+        c = *ip++;
+        len += c;
+    } while (c == 255);
+    *ipp = ip;
+    return len;
+}
+
+//
+// Decompress the data.
+// Return the decompressed size, or -1 on invalid data.
+//
+int lz_decompress(unsigned char *dst, int dstsz, const unsigned char *src, int n)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + dstsz;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int len = token >> 4, offset, ext;
+
+        // Literals.
+        if (len == 15) {
+            ext = lz_get_length(&ip, iend);
+            if (ext < 0)
+                return -1;
+            len += ext;
+        }
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= iend)
+            break;
+
+        // Match.
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+        len = (token & 15) + LZ_MINMATCH;
+        if ((token & 15) == 15) {
+            ext = lz_get_length(&ip, iend);
+            if (ext < 0)
+                return -1;
+            len += ext;
+        }
+        if (len > oend - op)
+            return -1;
+        if (offset == 1) {
+            // Run of one byte.
+            memset(op, op[-1], len);
+            op += len;
+        } else {
+            // Overlapping match repeats the pattern: copy by pieces.
+            while (len > 0) {
+                int n = (len < offset) ? len : offset;
+
+                memcpy(op, op - offset, n);
+                op += n;
+                len -= n;
+            }
+        }
+    }
+    return op - dst;
+}
+
 //
 // Strip trailing spaces and newline.
 // Shorten the string in place to a specified limit.
@@ -339,7 +534,12 @@ void print_ascii(FILE *out, const unsigned char *text, unsigned nchars, int fill
 void get_timestamp(char p[16])
 {
     time_t now = time(NULL);
+#if defined(__WIN32__) || defined(WIN32)
+    // Windows keeps the result of localtime() per thread.
     struct tm *local = localtime(&now);
+#else
+    struct tm result, *local = localtime_r(&now, &result);
+#endif
 
     if (! local) {
         perror("localtime");
@@ -747,21 +947,217 @@ void print_tone(FILE *out, unsigned data)
 static int csv_skip_field1;
 static int csv_join_fields34;
 
-int csv_init(FILE *csv)
+//
+// Contents of CSV file, mapped into memory (or read, when mapping
+// is not possible). Records are split in place: fields are returned
+// as pointers into this buffer, without copying.
+// Not per-thread: csv_init() is called by the writer,
+// and csv_read() by the parser thread.
+//
+static char *csv_data;          // File contents
+static size_t csv_size;         // Size of contents
+static size_t csv_pos;          // Offset of next record
+static int csv_mapped;          // Contents are mapped by mmap()
+static char *csv_tail;          // Copy of last record, when not terminated by newline
+
+#define CSV_MAXFIELDS   16
+
+//
+// Release memory of CSV file.
+//
+static void csv_release()
 {
-    char line[256];
+    if (csv_data) {
+#if ! defined(__WIN32__) && ! defined(WIN32)
+        if (csv_mapped)
+            munmap(csv_data, csv_size);
+        else
+#endif
+            free(csv_data);
+    }
+    free(csv_tail);
+    csv_data = 0;
+    csv_tail = 0;
+    csv_size = 0;
+    csv_pos = 0;
+    csv_mapped = 0;
+}
 
-    if (!fgets(line, sizeof(line), csv))
+//
+// Map the file into memory.
+// When the file is not a regular one, read it.
+// Return -1 on error.
+//
+static int csv_load(FILE *csv)
+{
+    long start = ftell(csv);
+
+    csv_release();
+    if (start < 0)
+        start = 0;
+#if ! defined(__WIN32__) && ! defined(WIN32)
+    struct stat st;
+    int fd = fileno(csv);
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            csv_data = p;
+            csv_size = st.st_size;
+            csv_pos = start;
+            csv_mapped = 1;
+            return 0;
+        }
+    }
+#endif
+    size_t nalloc = 0;
+    for (;;) {
+        if (csv_size == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 1024*1024;
+            char *p = realloc(csv_data, nalloc);
+            if (!p) {
+                fprintf(stderr, "Out of memory!\n");
+                csv_release();
+                return -1;
+            }
+            csv_data = p;
+        }
+        size_t n = fread(csv_data + csv_size, 1, nalloc - csv_size, csv);
+        if (n == 0)
+            break;
+        csv_size += n;
+    }
+    return 0;
+}
+
+//
+// Check a word of text for characters above '~'.
+//
+static inline int has_non_ascii(uint64_t w)
+{
+    return ((w | (w + 0x0101010101010101ULL)) & 0x8080808080808080ULL) != 0;
+}
+
+//
+// Replace non-ASCII characters with '?'.
+// Whole words are checked first, so plain ASCII text is skipped quickly.
+//
+static void csv_fix_ascii(char *p, char *end)
+{
+    while (end - p >= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        if (has_non_ascii(w))
+            break;
+        p += 8;
+    }
+    for (; p < end; p++) {
+        if ((uint8_t)*p > '~')
+            *p = '?';
+    }
+}
+
+//
+// Split next record of CSV file into fields.
+// Fields are terminated in place, quotes are removed.
+// Quoted fields may contain commas, newlines and doubled quotes.
+// Return the number of fields, or -1 at end of file.
+//
+static int csv_next_record(char *field[])
+{
+    char *limit = csv_data + csv_size;
+    char *p, *end;
+    int nfields = 0;
+
+    if (csv_pos >= csv_size)
         return -1;
+    p = csv_data + csv_pos;
+    end = memchr(p, '\n', limit - p);
+    if (!end)
+        end = limit;
+
+    if (!memchr(p, '"', end - p)) {
+        // No quotes: split at commas.
+        csv_pos = end + 1 - csv_data;
+        if (end == limit) {
+            // Last record without newline: need space for terminator.
+            csv_tail = malloc(end - p + 1);
+            if (!csv_tail) {
+                fprintf(stderr, "Out of memory!\n");
+                return -1;
+            }
+            memcpy(csv_tail, p, end - p);
+            end = csv_tail + (end - p);
+            p = csv_tail;
+        }
+        *end = 0;
+        csv_fix_ascii(p, end);
+        for (;;) {
+            char *comma = memchr(p, ',', end - p);
+
+            if (nfields < CSV_MAXFIELDS)
+                field[nfields++] = p;
+            if (!comma)
+                break;
+            *comma = 0;
+            p = comma + 1;
+        }
+        return nfields;
+    }
+
+    // Quoted fields: unescape in place.
+    // Every removed quote leaves space for the terminator.
+    char *out = p, *q;
+    int quoted = 0;
+
+    field[nfields++] = out;
+    for (q = p; q < limit; q++) {
+        char c = *q;
+
+        if (quoted) {
+            if (c != '"') {
+                *out++ = c;
+            } else if (q+1 < limit && q[1] == '"') {
+                *out++ = '"';
+                q++;
+            } else {
+                quoted = 0;
+            }
+        } else if (c == '"') {
+            quoted = 1;
+        } else if (c == ',') {
+            *out++ = 0;
+            if (nfields < CSV_MAXFIELDS)
+                field[nfields++] = out;
+        } else if (c == '\n') {
+            break;
+        } else {
+            *out++ = c;
+        }
+    }
+    csv_pos = q + 1 - csv_data;
+    *out = 0;
+    csv_fix_ascii(p, out);
+    return nfields;
+}
 
-    char *field1 = line;
-    char *field2 = strchr(field1,      ','); if (! field2) return -1; *field2++ = 0;
-    char *field3 = strchr(field2,      ','); if (! field3) return -1; *field3++ = 0;
-    char *field4 = strchr(field3,      ','); if (! field4) return -1; *field4++ = 0;
+int csv_init(FILE *csv)
+{
+    char *field[CSV_MAXFIELDS];
 
-    field1 = trim_quotes(field1);
-    field2 = trim_quotes(field2);
-    field3 = trim_quotes(field3);
+    if (csv_load(csv) < 0)
+        return -1;
+    if (csv_next_record(field) < 4) {
+        fprintf(stderr, "Unexpected CSV file format!\n");
+        csv_release();
+        return -1;
+    }
+
+    char *field1 = field[0];
+    char *field2 = field[1];
+    char *field3 = field[2];
     //printf("Line: %s,%s,%s\n", field1, field2, field3);
 
     if (strcasecmp(field1, "Radio ID") == 0 &&
@@ -791,6 +1187,7 @@ int csv_init(FILE *csv)
     }
 
     fprintf(stderr, "Unexpected CSV file format!\n");
+    csv_release();
     return -1;
 }
 
@@ -801,65 +1198,266 @@ int csv_init(FILE *csv)
 int csv_read(FILE *csv, char **radioid, char **callsign, char **name,
     char **city, char **state, char **country, char **remarks)
 {
-    static char line[256];
+    static char fullname[256];
+    static char empty[1];
+    char *field[CSV_MAXFIELDS], **f;
+    int nfields;
 
 again:
-    if (!fgets(line, sizeof(line), csv))
+    nfields = csv_next_record(field);
+    if (nfields < 0) {
+        csv_release();
         return 0;
-    //printf("Line: '%s'\n", line);
-
-    // Replace non-ASCII characters with '?'.
-    char *p;
-    for (p=line; *p; p++) {
-        if ((uint8_t)*p > '~')
-            *p = '?';
     }
 
-    if (csv_skip_field1) {
-        *radioid = strchr(line, ',');
-        if (! *radioid)
-            return 0;
-        *(*radioid)++ = 0;
-    } else
-        *radioid = line;
-
-    *callsign = strchr(*radioid,  ','); if (! *callsign) return 0; *(*callsign)++ = 0;
-    *name     = strchr(*callsign, ','); if (! *name)     return 0; *(*name)++     = 0;
-    *city     = strchr(*name,     ','); if (! *city)     return 0; *(*city)++     = 0;
-    *state    = strchr(*city,     ','); if (! *state)    return 0; *(*state)++    = 0;
-    *country  = strchr(*state,    ','); if (! *country)  return 0; *(*country)++  = 0;
-    *remarks  = strchr(*country,  ','); if (! *remarks)  return 0; *(*remarks)++  = 0;
-    if ((p = strchr(*remarks, ',')) != 0)
-        *p++ = 0;
+    // Skip lines with missing fields; remarks are optional.
+    f = &field[csv_skip_field1];
+    nfields -= csv_skip_field1 + csv_join_fields34;
+    if (nfields < 6)
+        goto again;
 
+    *radioid  = f[0];
+    *callsign = f[1];
+    *name     = f[2];
     if (csv_join_fields34) {
-        char *name2 = *city;
-        *city     = *state;
-        *state    = *country;
-        *country  = *remarks;
-        *remarks  = p;
-
-        if ((p = strchr(*remarks, ',')) != 0)
-            *p = 0;
+        char *name2 = trim_spaces(f[3], 100);
 
+        f++;
         if (*name2) {
-            static char fullname[256];
-            strcpy(fullname, *name);
-            strcat(fullname, " ");
-            strcat(fullname, name2);
+            snprintf(fullname, sizeof(fullname), "%s %s",
+                trim_spaces(*name, 100), name2);
             *name = fullname;
         }
     }
-    *radioid  = trim_spaces(trim_quotes(*radioid),  100);
-    *callsign = trim_spaces(trim_quotes(*callsign), 100);
-    *name     = trim_spaces(trim_quotes(*name),     100);
-    *city     = trim_spaces(trim_quotes(*city),     100);
-    *state    = trim_spaces(trim_quotes(*state),    100);
-    *country  = trim_spaces(trim_quotes(*country),  100);
-    *remarks  = trim_spaces(trim_quotes(*remarks),  100);
+    *city     = f[3];
+    *state    = f[4];
+    *country  = f[5];
+    *remarks  = (nfields > 6) ? f[6] : empty;
+
+    *radioid  = trim_spaces(*radioid,  100);
+    *callsign = trim_spaces(*callsign, 100);
+    *name     = trim_spaces(*name,     100);
+    *city     = trim_spaces(*city,     100);
+    *state    = trim_spaces(*state,    100);
+    *country  = trim_spaces(*country,  100);
+    *remarks  = trim_spaces(*remarks,  100);
     //printf("%s,%s,%s,%s,%s,%s,%s\n", *radioid, *callsign, *name, *city, *state, *country, *remarks);
 
     if (**radioid < '1' || **radioid > '9')
         goto again;
     return 1;
 }
+
+//
+// Bounded queue of data chunks.
+//
+struct _chunk_queue_t {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    chunk_t         *items;         // Circular buffer of chunks
+    int             size;           // Capacity of the buffer
+    int             count;          // Number of queued chunks
+    int             head;           // Index of the first chunk
+    int             closed;         // No more chunks will be added
+    int             failed;         // Producer stopped on error
+    unsigned        nbytes;         // Total bytes passed
+    double          start;          // Time of creation
+    double          put_done;       // Time when the queue was closed
+    double          get_done;       // Time when the last chunk was fetched
+    double          put_wait;       // Time the producer waited for space
+    double          get_wait;       // Time the consumer waited for data
+};
+
+//
+// Get current time in seconds.
+//
+static double current_time()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+chunk_queue_t *queue_create(int size)
+{
+    chunk_queue_t *q = calloc(1, sizeof(chunk_queue_t));
+
+    if (q)
+        q->items = calloc(size, sizeof(chunk_t));
+    if (!q || !q->items) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+    }
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->not_empty, 0);
+    pthread_cond_init(&q->not_full, 0);
+    q->size = size;
+    q->start = current_time();
+    return q;
+}
+
+void queue_destroy(chunk_queue_t *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q);
+}
+
+//
+// Append a chunk to the queue.
+// Wait while the queue is full.
+//
+void queue_put(chunk_queue_t *q, unsigned addr, unsigned char *data, unsigned nbytes)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count >= q->size) {
+        double t0 = current_time();
+
+        while (q->count >= q->size)
+            pthread_cond_wait(&q->not_full, &q->lock);
+        q->put_wait += current_time() - t0;
+    }
+
+    chunk_t *c = &q->items[(q->head + q->count) % q->size];
+    c->addr = addr;
+    c->data = data;
+    c->nbytes = nbytes;
+    q->count++;
+    q->nbytes += nbytes;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Fetch a chunk from the queue.
+// Wait while the queue is empty.
+// Return 0 when the queue is closed and no chunks left.
+//
+int queue_get(chunk_queue_t *q, chunk_t *chunk)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == 0 && !q->closed) {
+        double t0 = current_time();
+
+        while (q->count == 0 && !q->closed)
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        q->get_wait += current_time() - t0;
+    }
+    if (q->count == 0) {
+        q->get_done = current_time();
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+
+    *chunk = q->items[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+//
+// Mark the end of data.
+//
+void queue_close(chunk_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    q->put_done = current_time();
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+//
+// Close the queue on error.
+// The consumer still gets the queued chunks, to release them.
+//
+void queue_fail(chunk_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->failed = 1;
+    pthread_mutex_unlock(&q->lock);
+    queue_close(q);
+}
+
+//
+// Return 1 when the producer has stopped on error.
+//
+int queue_failed(chunk_queue_t *q)
+{
+    int failed;
+
+    pthread_mutex_lock(&q->lock);
+    failed = q->failed;
+    pthread_mutex_unlock(&q->lock);
+    return failed;
+}
+
+//
+// Print throughput of producer and consumer.
+// The stage which waits less is the bottleneck.
+//
+void queue_print_stats(chunk_queue_t *q, const char *producer, const char *consumer)
+{
+    double put_busy = q->put_done - q->start - q->put_wait;
+    double get_busy = q->get_done - q->start - q->get_wait;
+
+    fprintf(stderr, "%s: busy %.2f sec, waited %.2f sec for %s.\n",
+        producer, put_busy, q->put_wait, consumer);
+    fprintf(stderr, "%s: busy %.2f sec, waited %.2f sec for %s, %u bytes",
+        consumer, get_busy, q->get_wait, producer, q->nbytes);
+    if (get_busy > 0)
+        fprintf(stderr, ", %.1f kbytes/sec", q->nbytes / 1024.0 / get_busy);
+    fprintf(stderr, ".\n");
+}
+
+//
+// Check whether the data are all 0xff.
+//
+static int is_blank(const uint8_t *data, int nbytes)
+{
+    int i;
+
+    for (i=0; i<nbytes; i++) {
+        if (data[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+//
+// Write a block to the DFU device, after the sector has been erased.
+// Blank blocks are not sent, as erased flash already reads as 0xff.
+// With verify_blank_flag, every 8th skipped block is read back
+// to make sure it has been erased.
+// Return 1 when the block was written, 0 when skipped.
+//
+int dfu_write_erased_block(int bno, uint8_t *data, int nbytes)
+{
+    static __thread unsigned nskipped;
+    uint8_t check[1024];
+
+    // Either way, the flash now holds the data.
+    radio_written(data, nbytes);
+
+    if (nbytes > (int)sizeof(check) || ! is_blank(data, nbytes)) {
+        dfu_write_block(bno, data, nbytes);
+        return 1;
+    }
+
+    if (verify_blank_flag && nskipped++ % 8 == 0) {
+        dfu_read_block(bno, check, nbytes);
+        if (! is_blank(check, nbytes)) {
+            fprintf(stderr, "\nBlock %d is not blank after erase!\n", bno);
+            exit(-1);
+        }
+        if (trace_flag)
+            printf("Block %d verified blank.\n", bno);
+    }
+    return 0;
+}
@@ -37,12 +37,65 @@ extern const char *copyright;
 //
 extern int trace_flag;
 
+//
+// Read back some of the blank blocks, skipped after erase.
+//
+extern int verify_blank_flag;
+
+//
+// Which of several attached radios with the same USB vid:pid
+// to open by dfu_init(), hid_init() or serial_init().
+// Zero means the first one found.
+//
+extern __thread int device_index;
+
+//
+// USB location of the radio to open, as bus*256 + address.
+// When nonzero, it takes precedence over device_index.
+//
+extern __thread unsigned device_location;
+
+//
+// Identity of the opened radio: USB serial number or port path,
+// set by dfu_init(), hid_init() or serial_init().
+// Empty when the radio cannot be told apart from others of its kind.
+//
+extern __thread char device_identity[64];
+
+//
+// Serial port of the radio, when given explicitly.
+// Zero means find the port by USB vid:pid.
+//
+extern const char *serial_port;
+
+//
+// Maximum number of read requests in flight on the serial port.
+//
+extern int serial_window;
+
 //
 // Print data in hex format.
 //
 void print_hex(const unsigned char *data, int len);
 void print_hex_addr_data(unsigned addr, const unsigned char *data, int len);
 
+//
+// Compute 64-bit FNV-1a hash of the data, continuing from previous value.
+//
+unsigned long long hash_fnv(unsigned long long hash, const unsigned char *data, int len);
+
+//
+// Compress a block of data.  Return the compressed size,
+// or 0 when the result does not fit into dst.
+//
+int lz_compress(unsigned char *dst, int dstsz, const unsigned char *src, int n);
+
+//
+// Decompress a block of data.  Return the decompressed size,
+// or -1 on invalid data.
+//
+int lz_decompress(unsigned char *dst, int dstsz, const unsigned char *src, int n);
+
 //
 // Strip trailing spaces and newline.
 // Shorten the string in place to a specified limit.
@@ -68,32 +121,112 @@ int csv_init(FILE *csv);
 int csv_read(FILE *csv, char **radioid, char **callsign, char **name,
     char **city, char **state, char **country, char **remarks);
 
+//
+// Bounded queue of data chunks, passed from a producer thread
+// to a consumer thread.
+//
+typedef struct {
+    unsigned addr;                  // Destination address
+    unsigned char *data;            // Chunk data
+    unsigned nbytes;                // Size of data
+} chunk_t;
+
+typedef struct _chunk_queue_t chunk_queue_t;
+
+chunk_queue_t *queue_create(int size);
+void queue_destroy(chunk_queue_t *q);
+void queue_put(chunk_queue_t *q, unsigned addr, unsigned char *data, unsigned nbytes);
+int queue_get(chunk_queue_t *q, chunk_t *chunk);
+void queue_close(chunk_queue_t *q);
+void queue_fail(chunk_queue_t *q);
+int queue_failed(chunk_queue_t *q);
+void queue_print_stats(chunk_queue_t *q, const char *producer, const char *consumer);
+
+//
+// Data have been written to the radio memory: update the copy
+// of radio contents, kept for the image cache.  Defined in radio.c.
+//
+void radio_written(const unsigned char *data, int nbytes);
+
 //
 // DFU functions.
 //
 const char *dfu_init(unsigned vid, unsigned pid);
+int dfu_count(unsigned vid, unsigned pid);
+int usb_scan(int ntypes, const unsigned vid[], const unsigned pid[], int count[]);
+
+//
+// Radios on libusb, shared by DFU and HID drivers.
+//
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_device_handle *usb_open(struct libusb_context *ctx, unsigned vid, unsigned pid);
+int usb_count(unsigned vid, unsigned pid);
+
+//
+// Hotplug: notify when a radio is attached.
+//
+typedef struct {
+    int type;                   // Index in the table of vid:pid
+    unsigned location;          // Bus*256 + address
+    char port[32];              // Physical port, like 1-2.3
+} hotplug_event_t;
+
+int usb_hotplug_init(int ntypes, const unsigned vid[], const unsigned pid[]);
+int usb_hotplug_wait(hotplug_event_t *ev, int msec);
 void dfu_close(void);
 void dfu_erase(unsigned start, unsigned finish);
+void dfu_erase_sector(unsigned addr);
 void dfu_read_block(int bno, unsigned char *data, int nbytes);
 void dfu_write_block(int bno, unsigned char *data, int nbytes);
+int dfu_write_erased_block(int bno, unsigned char *data, int nbytes);
 void dfu_reboot(void);
 
 //
 // HID functions.
 //
 int hid_init(int vid, int pid);
+int hid_count(int vid, int pid);
 const char *hid_identify(void);
 void hid_close(void);
 void hid_send_recv(const unsigned char *data, unsigned nbytes, unsigned char *rdata, unsigned rlength);
+void hid_flush(void);
+void hid_send_recv_multi(int count, const unsigned char *data, unsigned nbytes, unsigned char *rdata, unsigned rlength);
 void hid_read_block(int bno, unsigned char *data, int nbytes);
 void hid_read_finish(void);
 void hid_write_block(int bno, unsigned char *data, int nbytes);
 void hid_write_finish(void);
 
+//
+// Range of the image, read from HID device before the rest of it.
+//
+typedef struct {
+    unsigned offset;                    // Offset in the image
+    unsigned length;                    // Size in bytes, 0 at end of list
+} hid_range_t;
+
+//
+// Read 128-byte blocks first...last-1 from HID device, except range
+// 0x7c00...0x8000.  Header ranges are read first; then mark_unused()
+// sets to 1 those bytes of unused[] which belong to unused entries.
+// Blocks which contain only unused bytes are skipped, and
+// erase_unused() is called to fill the unused entries in them.
+//
+void hid_read_used_blocks(int first, int last, const hid_range_t *headers,
+    void (*mark_unused)(unsigned char *unused), void (*erase_unused)(const unsigned char *state));
+
+//
+// Check whether any part of the item was skipped by hid_read_used_blocks().
+//
+int hid_is_skipped(const unsigned char *state, const void *item, int nbytes);
+
 //
 // Serial functions.
 //
 int serial_init(int vid, int pid);
+int serial_count(int vid, int pid);
+int serial_hotplug_init(int vid, int pid);
+int serial_hotplug_poll(hotplug_event_t *ev);
 const char *serial_identify(void);
 void serial_close(void);
 void serial_read_region(int addr, unsigned char *data, int nbytes);
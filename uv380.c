@@ -30,7 +30,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <sys/stat.h>
+#include <pthread.h>
 #include "radio.h"
 #include "util.h"
 
@@ -417,12 +417,19 @@ static void uv380_download(radio_device_t *radio)
 //
 static void uv380_upload(radio_device_t *radio, int cont_flag)
 {
-    int bno;
+    int bno, nskipped = 0;
 
+    if (cont_flag || radio_journal_resumed()) {
+        dfu_upload_changed_sectors(MEMSZ, cont_flag);
+        return;
+    }
     dfu_erase(0, MEMSZ);
 
     for (bno=0; bno<MEMSZ/1024; bno++) {
-        dfu_write_block(bno, &radio_mem[bno*1024], 1024);
+        if (! dfu_write_erased_block(bno, &radio_mem[bno*1024], 1024))
+            nskipped++;
+        if (bno % 64 == 63)
+            radio_journal_commit(bno / 64);
 
         ++radio_progress;
         if (radio_progress % 32 == 0) {
@@ -430,6 +437,7 @@ static void uv380_upload(radio_device_t *radio, int cont_flag)
             fflush(stderr);
         }
     }
+    fprintf(stderr, " %d blank blocks skipped,", nskipped);
 }
 
 //
@@ -1360,40 +1368,22 @@ static void uv380_print_config(radio_device_t *radio, FILE *out, int verbose)
 
 //
 // Read memory image from the binary file.
+// File contents are already loaded into radio_mem.
 //
-static void uv380_read_image(radio_device_t *radio, FILE *img)
+static void uv380_read_image(radio_device_t *radio, unsigned size)
 {
-    struct stat st;
-
-    // Guess device type by file size.
-    if (fstat(fileno(img), &st) < 0) {
-        fprintf(stderr, "Cannot get file size.\n");
-        exit(-1);
-    }
-    switch (st.st_size) {
+    switch (size) {
     case MEMSZ:
         // IMG file.
-        if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
         break;
     case MEMSZ + 0x225 + 0x10:
         // RTD file.
         // Header 0x225 bytes and footer 0x10 bytes at 0x40225.
-        fseek(img, 0x225, SEEK_SET);
-        if (fread(&radio_mem[0], 1, 0x40000, img) != 0x40000) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
-        fseek(img, 0x10, SEEK_CUR);
-        if (fread(&radio_mem[0x40000], 1, MEMSZ - 0x40000, img) != MEMSZ - 0x40000) {
-            fprintf(stderr, "Error reading image data.\n");
-            exit(-1);
-        }
+        radio_image_skip(0, 0x225);
+        radio_image_skip(0x40000, 0x10);
         break;
     default:
-        fprintf(stderr, "Unrecognized file size %u bytes.\n", (int) st.st_size);
+        fprintf(stderr, "Unrecognized file size %u bytes.\n", size);
         exit(-1);
     }
 }
@@ -1621,7 +1611,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         }
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
         erase_zones();
@@ -1632,7 +1622,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, 1, tot, rxonly, admit, colorcode,
         timeslot, grouplist, contact, 0xffff, 0xffff, BW_12_5_KHZ);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -1754,7 +1744,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         return 0;
     }
 
-    if (first_row && radio->channel_count == 0) {
+    if (first_row && radio_channel_count == 0) {
         // On first entry, erase all channels, zones and scanlists.
         erase_channels();
     }
@@ -1763,7 +1753,7 @@ badtx:  fprintf(stderr, "Bad transmit frequency.\n");
         power, scanlist, squelch, tot, rxonly, admit,
         1, 1, 0, 0, rxtone, txtone, width);
 
-    radio->channel_count++;
+    radio_channel_count++;
     return 1;
 }
 
@@ -2193,6 +2183,28 @@ static void uv380_update_timestamp(radio_device_t *radio)
     }
 }
 
+//
+// Compute fingerprint of the codeplug: timestamp and a few sampled blocks.
+// With read_flag, read these blocks from the radio first.
+//
+static unsigned long long uv380_fingerprint(radio_device_t *radio, int read_flag)
+{
+    static const unsigned sample[] = {
+        OFFSET_TIMESTMP, OFFSET_GLISTS, OFFSET_ZONES, OFFSET_CHANNELS, OFFSET_CONTACTS,
+    };
+    unsigned long long hash = 0;
+    int i;
+
+    for (i=0; i<sizeof(sample)/sizeof(sample[0]); i++) {
+        int bno = sample[i] / 1024;
+
+        if (read_flag)
+            dfu_read_block(bno, &radio_mem[bno*1024], 1024);
+        hash = hash_fnv(hash, &radio_mem[bno*1024], 1024);
+    }
+    return hash;
+}
+
 //
 // Check that configuration is correct.
 // Return 0 on error.
@@ -2417,34 +2429,33 @@ static void build_callsign_index(uint8_t *mem, int nrecords)
 }
 
 //
-// Write CSV file to contacts database.
+// State of the callsign database parser.
 //
-static void uv380_write_csv(radio_device_t *radio, FILE *csv)
+typedef struct {
+    FILE            *csv;       // Input file
+    chunk_queue_t   *queue;     // Sectors ready for writing
+    uint8_t         *mem;       // Image of callsign database
+    int             nrecords;   // Number of records
+    int             status;     // 0 on success, -1 on error
+} calldb_parser_t;
+
+//
+// Parse CSV file in a separate thread.
+// Every 64-kbyte sector is passed to the writer as soon as it is filled.
+// The first sector contains the search index, so it is passed last.
+// The database always fits: the memory ends at a 1-kbyte boundary.
+//
+static void *parse_calldb(void *arg)
 {
-    uint8_t *mem;
+    calldb_parser_t *ps = arg;
+    uint8_t *mem = ps->mem;
     char line[256];
     char *radioid, *callsign, *name, *city, *state, *country, *remarks;
-    int id, bno, nbytes, nrecords = 0;
-    unsigned finish;
+    int id, nbytes = CALLSIGN_FINISH - CALLSIGN_START;
+    unsigned sent = 0x10000, finish;
     callsign_t *cs;
 
-    // Allocate 14Mbytes of memory.
-    nbytes = CALLSIGN_FINISH - CALLSIGN_START;
-    mem = malloc(nbytes);
-    if (!mem) {
-        fprintf(stderr, "Out of memory!\n");
-        return;
-    }
-    memset(mem, 0xff, nbytes);
-
-    //
-    // Parse CSV file.
-    //
-    if (csv_init(csv) < 0) {
-        free(mem);
-        return;
-    }
-    while (csv_read(csv, &radioid, &callsign, &name, &city, &state, &country, &remarks)) {
+    while (csv_read(ps->csv, &radioid, &callsign, &name, &city, &state, &country, &remarks)) {
         //printf("%s,%s,%s,%s,%s,%s,%s\n", radioid, callsign, name, city, state, country, remarks);
 
         id = strtoul(radioid, 0, 10);
@@ -2452,16 +2463,18 @@ static void uv380_write_csv(radio_device_t *radio, FILE *csv)
             fprintf(stderr, "Bad id: %d\n", id);
             fprintf(stderr, "Line: '%s,%s,%s,%s,%s,%s,%s'\n",
                 radioid, callsign, name, city, state, country, remarks);
-            return;
+            ps->status = -1;
+            queue_fail(ps->queue);
+            return 0;
         }
 
-        cs = GET_CALLSIGN(mem, nrecords);
+        cs = GET_CALLSIGN(mem, ps->nrecords);
         if ((uint8_t*) (cs + 1) > &mem[nbytes]) {
             fprintf(stderr, "WARNING: Too many callsigns!\n");
             fprintf(stderr, "Skipping the rest.\n");
             break;
         }
-        nrecords++;
+        ps->nrecords++;
 
         // Fill callsign structure.
         cs->dmrid = id;
@@ -2469,54 +2482,183 @@ static void uv380_write_csv(radio_device_t *radio, FILE *csv)
         snprintf(line, sizeof(line), "%s,%s,%s,%s,%s",
             name, city, state, country, remarks);
         strncpy(cs->name, line, sizeof(cs->name));
+
+        // Pass complete sectors.
+        while ((uint8_t*) (cs + 1) >= &mem[sent + 0x10000]) {
+            queue_put(ps->queue, CALLSIGN_START + sent, &mem[sent], 0x10000);
+            sent += 0x10000;
+        }
     }
-    fprintf(stderr, "Total %d contacts.\n", nrecords);
 
-    build_callsign_index(mem, nrecords);
+    build_callsign_index(mem, ps->nrecords);
 #if 0
     print_hex(mem, 0x4003);
     exit(0);
 #endif
 
     // Align to 1kbyte.
+    finish = (CALLSIGN_OFFSET + ps->nrecords*120 + 1023) / 1024 * 1024;
+
+    // Pass the last sector and the first one.
+    if (finish > sent)
+        queue_put(ps->queue, CALLSIGN_START + sent, &mem[sent], finish - sent);
+    queue_put(ps->queue, CALLSIGN_START, mem, (finish < 0x10000) ? finish : 0x10000);
+    queue_close(ps->queue);
+    return 0;
+}
+
+//
+// Get the end of callsign database, currently stored in the radio.
+// Return CALLSIGN_START when the database is empty.
+//
+static unsigned callsign_db_finish()
+{
+    uint8_t header[1024];
+    unsigned nrecords, finish;
+
+    dfu_read_block(CALLSIGN_START / 1024, header, 1024);
+    nrecords = header[0] << 16 | header[1] << 8 | header[2];
+    if (nrecords == 0 || nrecords == 0xffffff)
+        return CALLSIGN_START;
+
     finish = CALLSIGN_START + (CALLSIGN_OFFSET + nrecords*120 + 1023) / 1024 * 1024;
-    if (finish > CALLSIGN_FINISH) {
-        // Limit is 122197 contacts.
-        fprintf(stderr, "Too many contacts!\n");
+    if (finish > CALLSIGN_FINISH)
+        return CALLSIGN_START;
+    return finish;
+}
+
+//
+// Compare a sector of callsign database with the contents of the radio.
+// Stop reading at first mismatch.
+// Return 1 when the data are identical.
+//
+static int sector_unchanged(unsigned addr, unsigned nbytes, uint8_t *data)
+{
+    uint8_t block[1024];
+    unsigned offset;
+
+    for (offset = 0; offset < nbytes; offset += 1024) {
+        dfu_read_block((addr + offset) / 1024, block, 1024);
+        if (memcmp(block, data + offset, 1024) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+//
+// Write CSV file to contacts database.
+// Only the sectors which differ from the radio contents
+// are erased and rewritten.
+// Before the first data sector is erased, the index sector is erased too,
+// so that on error the radio is left with an empty database,
+// not with the old index pointing into new data.
+// The index sector is written last.
+//
+static void uv380_write_csv(radio_device_t *radio, FILE *csv)
+{
+    calldb_parser_t ps = {0};
+    pthread_t parser;
+    chunk_t chunk;
+    int nbytes, bno, unchanged, nsectors = 0, nchanged = 0, nskipped = 0;
+    int index_erased = 0;
+    unsigned addr, old_finish;
+
+    // Allocate 14Mbytes of memory.
+    nbytes = CALLSIGN_FINISH - CALLSIGN_START;
+    ps.mem = malloc(nbytes);
+    if (!ps.mem) {
+        fprintf(stderr, "Out of memory!\n");
         return;
     }
+    memset(ps.mem, 0xff, nbytes);
+
+    if (csv_init(csv) < 0) {
+        free(ps.mem);
+        return;
+    }
+    ps.csv = csv;
+
+    // Get size of the old database.
+    old_finish = callsign_db_finish();
+    if (trace_flag)
+        printf("Old database ends at 0x%x.\n", old_finish);
 
     //
-    // Erase whole region.
-    // Align finish to 64kbytes.
+    // Parse CSV file in a separate thread.
+    // Erase and write every changed sector as soon as it is complete.
     //
-    radio_progress = 0;
-    if (! trace_flag) {
-        fprintf(stderr, "Erase: ");
-        fflush(stderr);
+    ps.queue = queue_create(16);
+    if (pthread_create(&parser, 0, parse_calldb, &ps) != 0) {
+        fprintf(stderr, "Cannot create parser thread!\n");
+        exit(-1);
     }
-    dfu_erase(CALLSIGN_START, (finish + 0xffff) / 0x10000 * 0x10000);
+    radio_progress = 0;
     if (! trace_flag) {
-        fprintf(stderr, "# done.\n");
         fprintf(stderr, "Write: ");
         fflush(stderr);
     }
+    while (queue_get(ps.queue, &chunk)) {
+        if (queue_failed(ps.queue))
+            break;
 
-    //
-    // Write callsigns.
-    //
-    for (bno = CALLSIGN_START/1024; bno < finish/1024; bno++) {
-        dfu_write_block(bno, &mem[bno*1024 - CALLSIGN_START], 1024);
+        // Skip the sector when it has not changed.
+        nsectors++;
+        unchanged = chunk.addr < old_finish &&
+            ! (chunk.addr == CALLSIGN_START && index_erased) &&
+            sector_unchanged(chunk.addr, chunk.nbytes, &ps.mem[chunk.addr - CALLSIGN_START]);
+        if (unchanged) {
+            if (trace_flag)
+                printf("Sector 0x%x unchanged.\n", chunk.addr);
+        } else {
+            if (chunk.addr != CALLSIGN_START && ! index_erased &&
+                old_finish > CALLSIGN_START) {
+                // Invalidate the old database.
+                dfu_erase_sector(CALLSIGN_START);
+                index_erased = 1;
+            }
 
-        ++radio_progress;
-        if (radio_progress % 512 == 0) {
+            // Erase the sector.
+            if (chunk.addr != CALLSIGN_START || ! index_erased)
+                dfu_erase_sector(chunk.addr);
+            nchanged++;
+        }
+        if ((chunk.addr & 0x00070000) == 0x00070000) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
+
+        // Write callsigns.
+        for (addr = chunk.addr; addr < chunk.addr + chunk.nbytes; addr += 1024) {
+            bno = addr / 1024;
+            if (! unchanged &&
+                ! dfu_write_erased_block(bno, &ps.mem[addr - CALLSIGN_START], 1024))
+                nskipped++;
+
+            ++radio_progress;
+            if (radio_progress % 512 == 0) {
+                fprintf(stderr, "#");
+                fflush(stderr);
+            }
+        }
     }
+    pthread_join(parser, 0);
+
+    // The parser has stopped on error: fail the command.
+    if (queue_failed(ps.queue)) {
+        if (index_erased)
+            fprintf(stderr, "Callsign database in the radio is now empty.\n");
+        queue_destroy(ps.queue);
+        free(ps.mem);
+        exit(-1);
+    }
+
     if (! trace_flag)
         fprintf(stderr, "# done.\n");
-    free(mem);
+    fprintf(stderr, "Total %d contacts, %d of %d sectors updated, %d blank blocks skipped.\n",
+        ps.nrecords, nchanged, nsectors, nskipped);
+    queue_print_stats(ps.queue, "Parse", "Write");
+    queue_destroy(ps.queue);
+    free(ps.mem);
 }
 
 //
@@ -2536,6 +2678,7 @@ radio_device_t radio_uv380 = {
     uv380_parse_header,
     uv380_parse_row,
     uv380_update_timestamp,
+    uv380_fingerprint,
     uv380_write_csv,
 };
 
@@ -2556,6 +2699,7 @@ radio_device_t radio_uv390 = {
     uv380_parse_header,
     uv380_parse_row,
     uv380_update_timestamp,
+    uv380_fingerprint,
     uv380_write_csv,
 };
 
@@ -2576,6 +2720,7 @@ radio_device_t radio_md2017 = {
     uv380_parse_header,
     uv380_parse_row,
     uv380_update_timestamp,
+    uv380_fingerprint,
     uv380_write_csv,
 };
 
@@ -2596,6 +2741,7 @@ radio_device_t radio_md9600 = {
     uv380_parse_header,
     uv380_parse_row,
     uv380_update_timestamp,
+    uv380_fingerprint,
     uv380_write_csv,
 };
 
@@ -2616,5 +2762,6 @@ radio_device_t radio_rt84 = {
     uv380_parse_header,
     uv380_parse_row,
     uv380_update_timestamp,
+    uv380_fingerprint,
     uv380_write_csv,
 };